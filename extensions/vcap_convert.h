@@ -0,0 +1,1524 @@
+//==============================================================================
+// MIT License
+//
+// Copyright 2022 James McLean
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//==============================================================================
+
+/**
+    \file vcap_convert.h
+    \brief Pixel conversion for Vcap
+
+    Summary:
+    --------
+
+    This tiny single-header library is an extension to Vcap that converts
+    frames in formats libv4l2 can't convert, such as the high bit depth
+    formats of machine vision sensors, deinterlaces frames from interlaced
+    sources such as analog video grabbers, and converts frames to normalized
+    float tensors for inference. Frames are captured with conversion disabled
+    and converted by the application.
+
+    Kernels use SSE2/SSSE3 when the compiler targets them (e.g. -mssse3 or
+    -march=native) and fall back to portable C otherwise.
+
+    Usage:
+    ------
+
+    To use this library in your project, add the following
+
+    > #define VCAP_CONVERT_IMPLEMENTATION
+    > #include "vcap_convert.h"
+
+    to a source file (once), then simply include the header normally.
+*/
+
+#ifndef VCAP_CONVERT_H
+#define VCAP_CONVERT_H
+
+#include "vcap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+///
+/// \brief Options for unpacking to 8 bits
+///
+typedef struct
+{
+    uint32_t shift;             ///< Right shift applied to each sample (results are clamped to 255)
+    const uint8_t* lut;         ///< Lookup table with 2^bits entries, overrides the shift if not NULL
+} vcap_unpack_options;
+
+///
+/// \brief Deinterlacing methods
+///
+typedef enum
+{
+    VCAP_DEINTERLACE_WEAVE,     ///< Interleaves the lines of both fields
+    VCAP_DEINTERLACE_BOB,       ///< Interpolates the missing lines of the first field
+    VCAP_DEINTERLACE_BLEND,     ///< Weaves and blends each line with its neighbours
+    VCAP_DEINTERLACE_COUNT      ///< Number of deinterlacing methods
+} vcap_deinterlace_mode;
+
+///
+/// \brief Tensor memory layouts
+///
+typedef enum
+{
+    VCAP_TENSOR_NCHW,           ///< One plane per channel
+    VCAP_TENSOR_NHWC,           ///< Interleaved channels
+    VCAP_TENSOR_LAYOUT_COUNT    ///< Number of layouts
+} vcap_tensor_layout;
+
+///
+/// \brief Tensor element types
+///
+typedef enum
+{
+    VCAP_TENSOR_FLOAT32,        ///< Single precision floats
+    VCAP_TENSOR_FLOAT16,        ///< Half precision floats (stored as uint16_t)
+    VCAP_TENSOR_TYPE_COUNT      ///< Number of element types
+} vcap_tensor_type;
+
+///
+/// \brief Options for converting to tensors
+///
+/// Zero-initialized options produce an RGB float32 NCHW tensor of the frame
+/// size with samples in [0, 1].
+///
+typedef struct
+{
+    vcap_tensor_layout layout;  ///< Memory layout
+    vcap_tensor_type type;      ///< Element type
+    uint32_t width;             ///< Tensor width (0 keeps the frame width)
+    uint32_t height;            ///< Tensor height (0 keeps the frame height)
+    bool grey;                  ///< One luma channel instead of three color channels
+    bool bgr;                   ///< BGR instead of RGB channel order
+    float mean[3];              ///< Mean of each tensor channel, subtracted from samples scaled to [0, 1]
+    float std[3];               ///< Standard deviation of each tensor channel (0 is treated as 1)
+    uint32_t threads;           ///< Number of threads (0 or 1 converts on the calling thread)
+} vcap_tensor_options;
+
+//------------------------------------------------------------------------------
+///
+/// \brief Returns the number of significant bits per sample of a format
+///
+/// \param fmt  The format ID
+///
+/// \returns 10, 12 or 16 for formats supported by the unpackers, and 0
+///          otherwise
+///
+uint32_t vcap_get_sample_bits(vcap_format_id fmt);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Unpacks a high bit depth frame to 16 bits per sample
+///
+/// Supports Y10, Y12, Y16, Y10BPACK, Y10P, Z16, and the 10/12/16-bit and
+/// MIPI-packed 10/12-bit Bayer formats. Samples keep their native range (e.g.
+/// 0-1023 for 10-bit formats) and Bayer patterns are kept as they are.
+///
+/// \param fmt         The format ID
+/// \param src         The captured frame
+/// \param src_stride  Bytes per line of the captured frame
+/// \param dst         The unpacked frame
+/// \param dst_stride  Bytes per line of the unpacked frame
+/// \param width       Frame width
+/// \param height      Frame height
+///
+/// \returns VCAP_OK       if the frame was unpacked,
+///          VCAP_ERROR    if an argument is invalid, and
+///          VCAP_INVALID  if the format isn't supported
+///
+int vcap_unpack16(vcap_format_id fmt, const uint8_t* src, size_t src_stride,
+                  uint16_t* dst, size_t dst_stride, uint32_t width, uint32_t height);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Unpacks a high bit depth frame to 8 bits per sample
+///
+/// Supports the same formats as `vcap_unpack16`. Each sample is shifted right
+/// and clamped, or mapped through a lookup table (e.g. for gamma or windowing).
+///
+/// \param fmt         The format ID
+/// \param src         The captured frame
+/// \param src_stride  Bytes per line of the captured frame
+/// \param dst         The unpacked frame
+/// \param dst_stride  Bytes per line of the unpacked frame
+/// \param width       Frame width
+/// \param height      Frame height
+/// \param options     Shift or lookup table (NULL keeps the 8 most significant bits)
+///
+/// \returns VCAP_OK       if the frame was unpacked,
+///          VCAP_ERROR    if an argument is invalid, and
+///          VCAP_INVALID  if the format isn't supported
+///
+int vcap_unpack8(vcap_format_id fmt, const uint8_t* src, size_t src_stride,
+                 uint8_t* dst, size_t dst_stride, uint32_t width, uint32_t height,
+                 const vcap_unpack_options* options);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Deinterlaces a frame
+///
+/// Supports greyscale (GREY) and packed YUV 4:2:2 (YUYV, YVYU, UYVY, VYUY)
+/// frames. The field order is usually taken from `vcap_get_frame_info`:
+///
+/// - Progressive frames (V4L2_FIELD_NONE) are copied.
+/// - Interleaved (V4L2_FIELD_INTERLACED*) and sequential (V4L2_FIELD_SEQ_*)
+///   fields are woven, bobbed or blended. V4L2_FIELD_INTERLACED is treated as
+///   top field first; NTSC sources should pass V4L2_FIELD_INTERLACED_BT.
+/// - Single fields (V4L2_FIELD_TOP/BOTTOM, e.g. with V4L2_FIELD_ALTERNATE)
+///   hold half the lines of the frame and are always bobbed.
+///
+/// \param fmt         The format ID
+/// \param field       Field order of the frame (V4L2_FIELD_*)
+/// \param mode        Deinterlacing method
+/// \param src         The captured frame
+/// \param src_stride  Bytes per line of the captured frame
+/// \param dst         The deinterlaced frame (must not overlap the captured frame)
+/// \param dst_stride  Bytes per line of the deinterlaced frame
+/// \param width       Frame width
+/// \param height      Frame height (of both fields)
+///
+/// \returns VCAP_OK       if the frame was deinterlaced,
+///          VCAP_ERROR    if an argument is invalid, and
+///          VCAP_INVALID  if the format or field order isn't supported
+///
+int vcap_deinterlace(vcap_format_id fmt, uint32_t field, vcap_deinterlace_mode mode,
+                     const uint8_t* src, size_t src_stride, uint8_t* dst, size_t dst_stride,
+                     uint32_t width, uint32_t height);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Returns the size of a tensor in bytes
+///
+/// \param width    Frame width
+/// \param height   Frame height
+/// \param options  Tensor options (NULL for defaults)
+///
+size_t vcap_get_tensor_size(uint32_t width, uint32_t height, const vcap_tensor_options* options);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Converts a frame to a normalized float tensor
+///
+/// Converts, resizes (bilinear) and normalizes a frame in a single pass, with
+/// the rows of the tensor split between threads. Each sample is scaled to
+/// [0, 1] and normalized as (x - mean) / std. The tensor holds one image, so
+/// N is 1.
+///
+/// Supports GREY, packed RGB (RGB24, BGR24 and the 32-bit formats), packed
+/// YUV 4:2:2 (YUYV, YVYU, UYVY, VYUY), YUV 4:2:0 (NV12, NV21, YUV420, YVU420)
+/// and the high bit depth formats supported by `vcap_unpack16`. These are
+/// read as one channel, so Bayer patterns are not demosaiced. Other formats
+/// can be captured with libv4l2 conversion to RGB24. YUV uses the BT.601
+/// limited range matrix.
+///
+/// \param fmt         The format ID
+/// \param src         The captured frame
+/// \param src_stride  Bytes per line of the captured frame
+/// \param dst         The tensor (`vcap_get_tensor_size` bytes)
+/// \param width       Frame width
+/// \param height      Frame height
+/// \param options     Tensor options (NULL for defaults)
+///
+/// \returns VCAP_OK       if the frame was converted,
+///          VCAP_ERROR    if an argument is invalid or out of memory, and
+///          VCAP_INVALID  if the format isn't supported
+///
+int vcap_convert_to_tensor(vcap_format_id fmt, const uint8_t* src, size_t src_stride, void* dst,
+                           uint32_t width, uint32_t height, const vcap_tensor_options* options);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // VCAP_CONVERT_H
+
+#ifdef VCAP_CONVERT_IMPLEMENTATION
+
+#include <assert.h>
+#include <linux/videodev2.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+//==============================================================================
+// Internal function declarations
+//==============================================================================
+
+//
+// Sample packing of high bit depth formats
+//
+typedef enum
+{
+    VCAP_PACKING_NONE,      // Not supported
+    VCAP_PACKING_LE16,      // One sample per little endian 16-bit word
+    VCAP_PACKING_MIPI10,    // Four samples in five bytes, low bits last
+    VCAP_PACKING_MIPI12,    // Two samples in three bytes, low bits last
+    VCAP_PACKING_BE10       // Big endian 10-bit bit stream
+} vcap_packing;
+
+// Number of samples unpacked at a time when a lookup table is used
+#define VCAP_UNPACK_CHUNK 256
+
+static vcap_packing vcap_get_packing(vcap_format_id fmt, uint32_t* bits);
+static size_t vcap_packed_offset(vcap_packing packing, uint32_t x);
+static void vcap_unpack_row16(vcap_packing packing, const uint8_t* src, uint16_t* dst, uint32_t width);
+static void vcap_unpack_row8(vcap_packing packing, const uint8_t* src, uint8_t* dst, uint32_t width, uint32_t shift);
+static uint16_t vcap_unpack_sample(vcap_packing packing, const uint8_t* src, uint32_t x);
+
+//
+// Lines of one field in a frame
+//
+typedef struct
+{
+    const uint8_t* data;
+    size_t stride;
+    uint32_t lines;
+} vcap_field_view;
+
+static uint32_t vcap_get_pixel_bytes(vcap_format_id fmt);
+static int vcap_split_fields(uint32_t field, const uint8_t* src, size_t src_stride, uint32_t height,
+                             vcap_field_view* top, vcap_field_view* bottom, bool* bottom_first);
+static const uint8_t* vcap_woven_line(const vcap_field_view* top, const vcap_field_view* bottom, uint32_t y);
+static void vcap_bob(const vcap_field_view* view, uint32_t parity, uint8_t* dst, size_t dst_stride, size_t row_bytes, uint32_t height);
+static void vcap_average_row(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t count);
+static void vcap_blend_row(const uint8_t* a, const uint8_t* b, const uint8_t* c, uint8_t* dst, size_t count);
+
+extern void* vcap_malloc(size_t size);
+extern void  vcap_free(void* ptr);
+
+// Length of normalization patterns, a multiple of the channel counts and SIMD width
+#define VCAP_TENSOR_PATTERN 12
+
+//
+// Sample arrangement of tensor sources
+//
+typedef enum
+{
+    VCAP_SOURCE_NONE,           // Not supported
+    VCAP_SOURCE_GREY,           // 8-bit luma
+    VCAP_SOURCE_GREY16,         // High bit depth samples
+    VCAP_SOURCE_RGB,            // Packed RGB
+    VCAP_SOURCE_YUV_PACKED,     // Packed YUV 4:2:2
+    VCAP_SOURCE_YUV_SEMIPLANAR, // Y plane followed by an interleaved chroma plane
+    VCAP_SOURCE_YUV_PLANAR      // Y plane followed by two chroma planes
+} vcap_source_kind;
+
+typedef struct
+{
+    vcap_source_kind kind;
+    uint32_t pixel_bytes;       // Bytes per pixel of packed RGB
+    uint8_t offsets[4];         // R/G/B or Y0/U/Y1/V byte offsets, or U/V chroma order
+    vcap_packing packing;       // Packing of high bit depth samples
+    uint16_t mask;              // Valid bits of high bit depth samples
+    float range;                // Maximum sample value
+} vcap_tensor_source;
+
+//
+// Conversion state shared by all threads
+//
+typedef struct
+{
+    vcap_tensor_source source;
+    const uint8_t* src;
+    size_t src_stride;
+    uint32_t src_width;
+    uint32_t src_height;
+    uint32_t src_channels;
+    void* dst;
+    vcap_tensor_layout layout;
+    vcap_tensor_type type;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    bool grey;
+    uint32_t channel_map[3];
+    const uint32_t* x0;
+    const uint32_t* x1;
+    const float* fx;
+    float plane_scale[3][VCAP_TENSOR_PATTERN];
+    float plane_bias[3][VCAP_TENSOR_PATTERN];
+    float pixel_scale[VCAP_TENSOR_PATTERN];
+    float pixel_bias[VCAP_TENSOR_PATTERN];
+} vcap_tensor_context;
+
+//
+// Band of tensor rows converted by one thread
+//
+typedef struct
+{
+    const vcap_tensor_context* ctx;
+    pthread_t thread;
+    bool started;
+    uint32_t begin;
+    uint32_t end;
+    int64_t row_index[2];
+    float* rows[2];
+    float* blend;
+    float* sampled;
+    float* out;
+    uint16_t* samples;
+} vcap_tensor_worker;
+
+static int vcap_get_tensor_source(vcap_format_id fmt, vcap_tensor_source* source);
+static void* vcap_tensor_thread(void* arg);
+static void vcap_convert_tensor_rows(vcap_tensor_worker* worker);
+static const float* vcap_get_source_row(vcap_tensor_worker* worker, uint32_t y, uint32_t keep);
+static void vcap_read_source_row(const vcap_tensor_context* ctx, uint32_t y, uint16_t* samples, float* row);
+static void vcap_yuv_to_rgb(float y, float u, float v, float* rgb);
+static void vcap_lerp_row(const float* a, const float* b, float weight, float* dst, size_t count);
+static void vcap_sample_row(const vcap_tensor_context* ctx, const float* src, float* sampled, float* dst);
+static void vcap_normalize(float* data, size_t count, const float* scale, const float* bias);
+static void vcap_store_tensor(const float* src, vcap_tensor_type type, void* dst, size_t offset, size_t count);
+static uint16_t vcap_float_to_half(float value);
+
+//==============================================================================
+// Public API implementation
+//==============================================================================
+
+uint32_t vcap_get_sample_bits(vcap_format_id fmt)
+{
+    uint32_t bits = 0;
+
+    if (vcap_get_packing(fmt, &bits) == VCAP_PACKING_NONE)
+        return 0;
+
+    return bits;
+}
+
+int vcap_unpack16(vcap_format_id fmt, const uint8_t* src, size_t src_stride,
+                  uint16_t* dst, size_t dst_stride, uint32_t width, uint32_t height)
+{
+    if (!src || !dst)
+        return VCAP_ERROR;
+
+    uint32_t bits;
+    vcap_packing packing = vcap_get_packing(fmt, &bits);
+
+    if (packing == VCAP_PACKING_NONE)
+        return VCAP_INVALID;
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+        vcap_unpack_row16(packing, src + y * src_stride,
+                          (uint16_t*)((uint8_t*)dst + y * dst_stride), width);
+    }
+
+    return VCAP_OK;
+}
+
+int vcap_unpack8(vcap_format_id fmt, const uint8_t* src, size_t src_stride,
+                 uint8_t* dst, size_t dst_stride, uint32_t width, uint32_t height,
+                 const vcap_unpack_options* options)
+{
+    if (!src || !dst)
+        return VCAP_ERROR;
+
+    uint32_t bits;
+    vcap_packing packing = vcap_get_packing(fmt, &bits);
+
+    if (packing == VCAP_PACKING_NONE)
+        return VCAP_INVALID;
+
+    uint32_t shift = options ? options->shift : bits - 8;
+
+    if (shift > 16)
+        return VCAP_ERROR;
+
+    // Shifted samples are unpacked directly
+    if (!options || !options->lut)
+    {
+        for (uint32_t y = 0; y < height; y++)
+            vcap_unpack_row8(packing, src + y * src_stride, dst + y * dst_stride, width, shift);
+
+        return VCAP_OK;
+    }
+
+    // Samples mapped through a lookup table are unpacked in chunks first
+    uint16_t chunk[VCAP_UNPACK_CHUNK];
+    uint16_t mask = (uint16_t)((1u << bits) - 1);
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+        const uint8_t* src_row = src + y * src_stride;
+        uint8_t* dst_row = dst + y * dst_stride;
+
+        for (uint32_t x = 0; x < width; x += VCAP_UNPACK_CHUNK)
+        {
+            uint32_t count = (width - x < VCAP_UNPACK_CHUNK) ? width - x : VCAP_UNPACK_CHUNK;
+
+            vcap_unpack_row16(packing, src_row + vcap_packed_offset(packing, x), chunk, count);
+
+            // Out of range samples (e.g. noise in unused bits) are masked
+            for (uint32_t i = 0; i < count; i++)
+                dst_row[x + i] = options->lut[chunk[i] & mask];
+        }
+    }
+
+    return VCAP_OK;
+}
+
+int vcap_deinterlace(vcap_format_id fmt, uint32_t field, vcap_deinterlace_mode mode,
+                     const uint8_t* src, size_t src_stride, uint8_t* dst, size_t dst_stride,
+                     uint32_t width, uint32_t height)
+{
+    assert(src != dst);
+
+    if (!src || !dst || mode >= VCAP_DEINTERLACE_COUNT)
+        return VCAP_ERROR;
+
+    uint32_t pixel_bytes = vcap_get_pixel_bytes(fmt);
+
+    if (pixel_bytes == 0)
+        return VCAP_INVALID;
+
+    size_t row_bytes = (size_t)width * pixel_bytes;
+
+    if (field == V4L2_FIELD_NONE)
+    {
+        for (uint32_t y = 0; y < height; y++)
+            memcpy(dst + y * dst_stride, src + y * src_stride, row_bytes);
+
+        return VCAP_OK;
+    }
+
+    vcap_field_view top, bottom;
+    bool bottom_first;
+
+    int result = vcap_split_fields(field, src, src_stride, height, &top, &bottom, &bottom_first);
+
+    if (result != VCAP_OK)
+        return result;
+
+    bool both = (top.lines > 0 && bottom.lines > 0 && field != V4L2_FIELD_TOP && field != V4L2_FIELD_BOTTOM);
+
+    if (both && mode == VCAP_DEINTERLACE_WEAVE)
+    {
+        for (uint32_t y = 0; y < height; y++)
+            memcpy(dst + y * dst_stride, vcap_woven_line(&top, &bottom, y), row_bytes);
+
+        return VCAP_OK;
+    }
+
+    if (both && mode == VCAP_DEINTERLACE_BLEND)
+    {
+        // Each line is blended 1:2:1 with the lines above and below it,
+        // repeating the first and last lines at the edges
+        for (uint32_t y = 0; y < height; y++)
+        {
+            const uint8_t* above = vcap_woven_line(&top, &bottom, (y > 0) ? y - 1 : y);
+            const uint8_t* below = vcap_woven_line(&top, &bottom, (y + 1 < height) ? y + 1 : y);
+
+            vcap_blend_row(above, vcap_woven_line(&top, &bottom, y), below, dst + y * dst_stride, row_bytes);
+        }
+
+        return VCAP_OK;
+    }
+
+    // Bobs the first field, or the only one
+    if (field == V4L2_FIELD_BOTTOM || (field != V4L2_FIELD_TOP && bottom_first))
+    {
+        if (bottom.lines == 0)
+            return VCAP_ERROR;
+
+        vcap_bob(&bottom, 1, dst, dst_stride, row_bytes, height);
+    }
+    else
+    {
+        vcap_bob(&top, 0, dst, dst_stride, row_bytes, height);
+    }
+
+    return VCAP_OK;
+}
+
+size_t vcap_get_tensor_size(uint32_t width, uint32_t height, const vcap_tensor_options* options)
+{
+    if (options && options->width > 0)
+        width = options->width;
+
+    if (options && options->height > 0)
+        height = options->height;
+
+    size_t channels = (options && options->grey) ? 1 : 3;
+    size_t element = (options && options->type == VCAP_TENSOR_FLOAT16) ? sizeof(uint16_t) : sizeof(float);
+
+    return (size_t)width * height * channels * element;
+}
+
+int vcap_convert_to_tensor(vcap_format_id fmt, const uint8_t* src, size_t src_stride, void* dst,
+                           uint32_t width, uint32_t height, const vcap_tensor_options* options)
+{
+    if (!src || !dst)
+        return VCAP_ERROR;
+
+    vcap_tensor_options defaults;
+    memset(&defaults, 0, sizeof(defaults));
+
+    if (!options)
+        options = &defaults;
+
+    if (options->layout >= VCAP_TENSOR_LAYOUT_COUNT || options->type >= VCAP_TENSOR_TYPE_COUNT)
+        return VCAP_ERROR;
+
+    vcap_tensor_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+
+    if (vcap_get_tensor_source(fmt, &ctx.source) != VCAP_OK)
+        return VCAP_INVALID;
+
+    ctx.src          = src;
+    ctx.src_stride   = src_stride;
+    ctx.src_width    = width;
+    ctx.src_height   = height;
+    ctx.src_channels = (ctx.source.kind == VCAP_SOURCE_GREY || ctx.source.kind == VCAP_SOURCE_GREY16) ? 1 : 3;
+    ctx.dst          = dst;
+    ctx.layout       = options->layout;
+    ctx.type         = options->type;
+    ctx.width        = options->width > 0 ? options->width : width;
+    ctx.height       = options->height > 0 ? options->height : height;
+    ctx.grey         = options->grey;
+    ctx.channels     = options->grey ? 1 : 3;
+
+    if (width == 0 || height == 0 || ctx.width == 0 || ctx.height == 0)
+        return VCAP_OK;
+
+    for (uint32_t c = 0; c < 3; c++)
+        ctx.channel_map[c] = options->bgr ? 2 - c : c;
+
+    // Scaling to [0, 1] and normalization are folded into x * scale + bias
+    for (uint32_t c = 0; c < ctx.channels; c++)
+    {
+        float std = (options->std[c] != 0.0f) ? options->std[c] : 1.0f;
+        float scale = 1.0f / (ctx.source.range * std);
+        float bias = -options->mean[c] / std;
+
+        for (uint32_t i = 0; i < VCAP_TENSOR_PATTERN; i++)
+        {
+            ctx.plane_scale[c][i] = scale;
+            ctx.plane_bias[c][i] = bias;
+        }
+    }
+
+    for (uint32_t i = 0; i < VCAP_TENSOR_PATTERN; i++)
+    {
+        ctx.pixel_scale[i] = ctx.plane_scale[i % ctx.channels][0];
+        ctx.pixel_bias[i] = ctx.plane_bias[i % ctx.channels][0];
+    }
+
+    uint32_t thread_count = (options->threads > 1) ? options->threads : 1;
+
+    if (thread_count > ctx.height)
+        thread_count = ctx.height;
+
+    // Sampling tables and per-thread rows share one allocation
+    size_t row_floats = (size_t)width * ctx.src_channels;
+    size_t sampled_floats = (size_t)ctx.width * ctx.src_channels;
+    size_t worker_floats = 3 * row_floats + sampled_floats + (size_t)ctx.width * ctx.channels + (width + 1) / 2;
+    size_t total = (size_t)ctx.width * 3 * sizeof(float) + thread_count * (sizeof(vcap_tensor_worker) + worker_floats * sizeof(float));
+
+    uint8_t* memory = (uint8_t*)vcap_malloc(total);
+
+    if (!memory)
+        return VCAP_ERROR;
+
+    vcap_tensor_worker* workers = (vcap_tensor_worker*)memory;
+    float* fx = (float*)(workers + thread_count);
+    uint32_t* x0 = (uint32_t*)(fx + ctx.width);
+    uint32_t* x1 = x0 + ctx.width;
+    float* scratch = (float*)(x1 + ctx.width);
+
+    // Bilinear sampling positions of pixel centers
+    float x_ratio = (float)width / (float)ctx.width;
+
+    for (uint32_t x = 0; x < ctx.width; x++)
+    {
+        float sx = ((float)x + 0.5f) * x_ratio - 0.5f;
+
+        if (sx < 0.0f)
+            sx = 0.0f;
+
+        x0[x] = (uint32_t)sx;
+
+        if (x0[x] > width - 1)
+            x0[x] = width - 1;
+
+        x1[x] = (x0[x] + 1 < width) ? x0[x] + 1 : x0[x];
+        fx[x] = sx - (float)x0[x];
+    }
+
+    ctx.x0 = x0;
+    ctx.x1 = x1;
+    ctx.fx = fx;
+
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+        vcap_tensor_worker* worker = &workers[i];
+        float* rows = scratch + i * worker_floats;
+
+        worker->ctx          = &ctx;
+        worker->started      = false;
+        worker->begin        = (uint32_t)((uint64_t)ctx.height * i / thread_count);
+        worker->end          = (uint32_t)((uint64_t)ctx.height * (i + 1) / thread_count);
+        worker->row_index[0] = -1;
+        worker->row_index[1] = -1;
+        worker->rows[0]      = rows;
+        worker->rows[1]      = rows + row_floats;
+        worker->blend        = rows + 2 * row_floats;
+        worker->sampled      = rows + 3 * row_floats;
+        worker->out          = worker->sampled + sampled_floats;
+        worker->samples      = (uint16_t*)(worker->out + (size_t)ctx.width * ctx.channels);
+    }
+
+    // Bands without a thread are converted on the calling thread
+    for (uint32_t i = 1; i < thread_count; i++)
+        workers[i].started = (pthread_create(&workers[i].thread, NULL, vcap_tensor_thread, &workers[i]) == 0);
+
+    vcap_convert_tensor_rows(&workers[0]);
+
+    for (uint32_t i = 1; i < thread_count; i++)
+    {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+        else
+            vcap_convert_tensor_rows(&workers[i]);
+    }
+
+    vcap_free(memory);
+
+    return VCAP_OK;
+}
+
+//==============================================================================
+// Internal functions
+//==============================================================================
+
+static vcap_packing vcap_get_packing(vcap_format_id fmt, uint32_t* bits)
+{
+    assert(bits != NULL);
+
+    switch (fmt)
+    {
+        case VCAP_FMT_Y10:
+        case VCAP_FMT_SBGGR10:
+        case VCAP_FMT_SGBRG10:
+        case VCAP_FMT_SGRBG10:
+        case VCAP_FMT_SRGGB10:
+            *bits = 10;
+            return VCAP_PACKING_LE16;
+
+        case VCAP_FMT_Y12:
+        case VCAP_FMT_SBGGR12:
+        case VCAP_FMT_SGBRG12:
+        case VCAP_FMT_SGRBG12:
+        case VCAP_FMT_SRGGB12:
+            *bits = 12;
+            return VCAP_PACKING_LE16;
+
+        case VCAP_FMT_Y16:
+        case VCAP_FMT_Z16:
+        case VCAP_FMT_SBGGR16:
+        case VCAP_FMT_SGBRG16:
+        case VCAP_FMT_SGRBG16:
+        case VCAP_FMT_SRGGB16:
+            *bits = 16;
+            return VCAP_PACKING_LE16;
+
+        case VCAP_FMT_Y10P:
+        case VCAP_FMT_SBGGR10P:
+        case VCAP_FMT_SGBRG10P:
+        case VCAP_FMT_SGRBG10P:
+        case VCAP_FMT_SRGGB10P:
+            *bits = 10;
+            return VCAP_PACKING_MIPI10;
+
+        case VCAP_FMT_SBGGR12P:
+        case VCAP_FMT_SGBRG12P:
+        case VCAP_FMT_SGRBG12P:
+        case VCAP_FMT_SRGGB12P:
+            *bits = 12;
+            return VCAP_PACKING_MIPI12;
+
+        case VCAP_FMT_Y10BPACK:
+            *bits = 10;
+            return VCAP_PACKING_BE10;
+
+        default:
+            return VCAP_PACKING_NONE;
+    }
+}
+
+static size_t vcap_packed_offset(vcap_packing packing, uint32_t x)
+{
+    switch (packing)
+    {
+        case VCAP_PACKING_LE16:
+            return (size_t)x * 2;
+
+        case VCAP_PACKING_MIPI10:
+        case VCAP_PACKING_BE10:
+            return (size_t)x / 4 * 5;
+
+        case VCAP_PACKING_MIPI12:
+            return (size_t)x / 2 * 3;
+
+        default:
+            return 0;
+    }
+}
+
+static uint16_t vcap_unpack_sample(vcap_packing packing, const uint8_t* src, uint32_t x)
+{
+    const uint8_t* group = src + vcap_packed_offset(packing, x);
+
+    switch (packing)
+    {
+        case VCAP_PACKING_LE16:
+            return (uint16_t)(group[0] | (group[1] << 8));
+
+        case VCAP_PACKING_MIPI10:
+            return (uint16_t)((group[x % 4] << 2) | ((group[4] >> (2 * (x % 4))) & 0x03));
+
+        case VCAP_PACKING_MIPI12:
+            return (uint16_t)((group[x % 2] << 4) | ((group[2] >> (4 * (x % 2))) & 0x0F));
+
+        case VCAP_PACKING_BE10:
+        {
+            // Sample i of the group starts at bit 10 * i
+            uint32_t bit = 10 * (x % 4);
+            uint32_t word = ((uint32_t)group[bit / 8] << 8) | group[bit / 8 + 1];
+
+            return (uint16_t)((word >> (6 - bit % 8)) & 0x3FF);
+        }
+
+        default:
+            return 0;
+    }
+}
+
+#if defined(__SSSE3__)
+
+static size_t vcap_packed_length(vcap_packing packing, uint32_t width)
+{
+    // Rounds up to whole groups
+    switch (packing)
+    {
+        case VCAP_PACKING_MIPI10:
+        case VCAP_PACKING_BE10:
+            return vcap_packed_offset(packing, width + 3);
+
+        case VCAP_PACKING_MIPI12:
+            return vcap_packed_offset(packing, width + 1);
+
+        default:
+            return vcap_packed_offset(packing, width);
+    }
+}
+
+// Unpacks 8 samples from 10 bytes (reads 16 bytes)
+static inline __m128i vcap_load_mipi10(const uint8_t* src)
+{
+    const __m128i hi_mask = _mm_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1, 5, -1, 6, -1, 7, -1, 8, -1);
+    const __m128i lo_mask = _mm_setr_epi8(4, -1, 4, -1, 4, -1, 4, -1, 9, -1, 9, -1, 9, -1, 9, -1);
+    const __m128i lo_mul  = _mm_setr_epi16(1 << 14, 1 << 12, 1 << 10, 1 << 8, 1 << 14, 1 << 12, 1 << 10, 1 << 8);
+
+    __m128i v  = _mm_loadu_si128((const __m128i*)src);
+    __m128i hi = _mm_shuffle_epi8(v, hi_mask);
+    __m128i lo = _mm_shuffle_epi8(v, lo_mask);
+
+    // Move each sample's two low bits to the top of its lane, then down
+    lo = _mm_srli_epi16(_mm_mullo_epi16(lo, lo_mul), 14);
+
+    return _mm_or_si128(_mm_slli_epi16(hi, 2), lo);
+}
+
+// Unpacks 8 samples from 12 bytes (reads 16 bytes)
+static inline __m128i vcap_load_mipi12(const uint8_t* src)
+{
+    const __m128i hi_mask = _mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1);
+    const __m128i lo_mask = _mm_setr_epi8(2, -1, 2, -1, 5, -1, 5, -1, 8, -1, 8, -1, 11, -1, 11, -1);
+    const __m128i lo_mul  = _mm_setr_epi16(1 << 12, 1 << 8, 1 << 12, 1 << 8, 1 << 12, 1 << 8, 1 << 12, 1 << 8);
+
+    __m128i v  = _mm_loadu_si128((const __m128i*)src);
+    __m128i hi = _mm_shuffle_epi8(v, hi_mask);
+    __m128i lo = _mm_shuffle_epi8(v, lo_mask);
+
+    lo = _mm_srli_epi16(_mm_mullo_epi16(lo, lo_mul), 12);
+
+    return _mm_or_si128(_mm_slli_epi16(hi, 4), lo);
+}
+
+#endif
+
+#if defined(__SSE2__)
+
+// Shifts 16 samples, clamps them to 255 and packs them to bytes
+static inline __m128i vcap_narrow(__m128i a, __m128i b, __m128i shift)
+{
+    const __m128i max = _mm_set1_epi16(255);
+
+    a = _mm_srl_epi16(a, shift);
+    b = _mm_srl_epi16(b, shift);
+
+    // Unsigned min(x, 255) as x - max(x - 255, 0)
+    a = _mm_sub_epi16(a, _mm_subs_epu16(a, max));
+    b = _mm_sub_epi16(b, _mm_subs_epu16(b, max));
+
+    return _mm_packus_epi16(a, b);
+}
+
+#endif
+
+static void vcap_unpack_row16(vcap_packing packing, const uint8_t* src, uint16_t* dst, uint32_t width)
+{
+    uint32_t x = 0;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (packing == VCAP_PACKING_LE16)
+    {
+        memcpy(dst, src, (size_t)width * 2);
+        return;
+    }
+#endif
+
+#if defined(__SSSE3__)
+    size_t length = vcap_packed_length(packing, width);
+
+    if (packing == VCAP_PACKING_MIPI10)
+    {
+        for (; x + 8 <= width && vcap_packed_offset(packing, x) + 16 <= length; x += 8)
+            _mm_storeu_si128((__m128i*)(dst + x), vcap_load_mipi10(src + vcap_packed_offset(packing, x)));
+    }
+    else if (packing == VCAP_PACKING_MIPI12)
+    {
+        for (; x + 8 <= width && vcap_packed_offset(packing, x) + 16 <= length; x += 8)
+            _mm_storeu_si128((__m128i*)(dst + x), vcap_load_mipi12(src + vcap_packed_offset(packing, x)));
+    }
+#endif
+
+    for (; x < width; x++)
+        dst[x] = vcap_unpack_sample(packing, src, x);
+}
+
+static void vcap_unpack_row8(vcap_packing packing, const uint8_t* src, uint8_t* dst, uint32_t width, uint32_t shift)
+{
+    uint32_t x = 0;
+
+#if defined(__SSE2__)
+    __m128i count = _mm_cvtsi32_si128((int)shift);
+
+    if (packing == VCAP_PACKING_LE16)
+    {
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(src + 2 * x));
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + 2 * x + 16));
+
+            _mm_storeu_si128((__m128i*)(dst + x), vcap_narrow(a, b, count));
+        }
+    }
+#endif
+
+#if defined(__SSSE3__)
+    size_t length = vcap_packed_length(packing, width);
+
+    if (packing == VCAP_PACKING_MIPI10)
+    {
+        for (; x + 16 <= width && vcap_packed_offset(packing, x) + 26 <= length; x += 16)
+        {
+            const uint8_t* group = src + vcap_packed_offset(packing, x);
+
+            __m128i a = vcap_load_mipi10(group);
+            __m128i b = vcap_load_mipi10(group + 10);
+
+            _mm_storeu_si128((__m128i*)(dst + x), vcap_narrow(a, b, count));
+        }
+    }
+    else if (packing == VCAP_PACKING_MIPI12)
+    {
+        for (; x + 16 <= width && vcap_packed_offset(packing, x) + 28 <= length; x += 16)
+        {
+            const uint8_t* group = src + vcap_packed_offset(packing, x);
+
+            __m128i a = vcap_load_mipi12(group);
+            __m128i b = vcap_load_mipi12(group + 12);
+
+            _mm_storeu_si128((__m128i*)(dst + x), vcap_narrow(a, b, count));
+        }
+    }
+#endif
+
+    for (; x < width; x++)
+    {
+        uint32_t value = (uint32_t)vcap_unpack_sample(packing, src, x) >> shift;
+        dst[x] = (uint8_t)(value > 255 ? 255 : value);
+    }
+}
+
+static uint32_t vcap_get_pixel_bytes(vcap_format_id fmt)
+{
+    switch (fmt)
+    {
+        case VCAP_FMT_GREY:
+            return 1;
+
+        case VCAP_FMT_YUYV:
+        case VCAP_FMT_YVYU:
+        case VCAP_FMT_UYVY:
+        case VCAP_FMT_VYUY:
+            return 2;
+
+        default:
+            return 0;
+    }
+}
+
+static int vcap_split_fields(uint32_t field, const uint8_t* src, size_t src_stride, uint32_t height,
+                             vcap_field_view* top, vcap_field_view* bottom, bool* bottom_first)
+{
+    assert(src != NULL);
+    assert(top != NULL);
+    assert(bottom != NULL);
+    assert(bottom_first != NULL);
+
+    // The top field holds the even lines and the bottom field the odd ones
+    uint32_t top_lines = (height + 1) / 2;
+    uint32_t bottom_lines = height / 2;
+
+    top->lines = top_lines;
+    bottom->lines = bottom_lines;
+    *bottom_first = false;
+
+    switch (field)
+    {
+        case V4L2_FIELD_INTERLACED_BT:
+            *bottom_first = true;
+            // Fall through
+
+        case V4L2_FIELD_INTERLACED:
+        case V4L2_FIELD_INTERLACED_TB:
+            top->data = src;
+            top->stride = 2 * src_stride;
+            bottom->data = src + src_stride;
+            bottom->stride = 2 * src_stride;
+            return VCAP_OK;
+
+        case V4L2_FIELD_SEQ_TB:
+        case V4L2_FIELD_TOP:
+            top->data = src;
+            top->stride = src_stride;
+            bottom->data = src + top_lines * src_stride;
+            bottom->stride = src_stride;
+            return VCAP_OK;
+
+        case V4L2_FIELD_SEQ_BT:
+        case V4L2_FIELD_BOTTOM:
+            *bottom_first = true;
+            bottom->data = src;
+            bottom->stride = src_stride;
+            top->data = src + bottom_lines * src_stride;
+            top->stride = src_stride;
+            return VCAP_OK;
+
+        default:
+            return VCAP_INVALID;
+    }
+}
+
+static const uint8_t* vcap_woven_line(const vcap_field_view* top, const vcap_field_view* bottom, uint32_t y)
+{
+    const vcap_field_view* view = (y & 1) ? bottom : top;
+
+    return view->data + (y >> 1) * view->stride;
+}
+
+static void vcap_bob(const vcap_field_view* view, uint32_t parity, uint8_t* dst, size_t dst_stride, size_t row_bytes, uint32_t height)
+{
+    assert(view != NULL);
+    assert(dst != NULL);
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+        uint8_t* line = dst + y * dst_stride;
+
+        if ((y & 1) == parity)
+        {
+            memcpy(line, view->data + (y >> 1) * view->stride, row_bytes);
+            continue;
+        }
+
+        // Missing lines are interpolated from the field lines around them
+        bool has_above = (y > 0);
+        bool has_below = (y + 1 < height && ((y + 1) >> 1) < view->lines);
+
+        const uint8_t* above = has_above ? view->data + ((y - 1) >> 1) * view->stride : NULL;
+        const uint8_t* below = has_below ? view->data + ((y + 1) >> 1) * view->stride : NULL;
+
+        if (above && below)
+            vcap_average_row(above, below, line, row_bytes);
+        else
+            memcpy(line, above ? above : below, row_bytes);
+    }
+}
+
+static void vcap_average_row(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_avg_epu8(va, vb));
+    }
+#endif
+
+    // Rounds like PAVGB
+    for (; i < count; i++)
+        dst[i] = (uint8_t)((a[i] + b[i] + 1) >> 1);
+}
+
+static void vcap_blend_row(const uint8_t* a, const uint8_t* b, const uint8_t* c, uint8_t* dst, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i vc = _mm_loadu_si128((const __m128i*)(c + i));
+
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_avg_epu8(_mm_avg_epu8(va, vc), vb));
+    }
+#endif
+
+    // Approximates (a + 2b + c) / 4 with two rounded averages, like the SIMD path
+    for (; i < count; i++)
+    {
+        uint32_t ac = (uint32_t)(a[i] + c[i] + 1) >> 1;
+        dst[i] = (uint8_t)((ac + b[i] + 1) >> 1);
+    }
+}
+
+static int vcap_get_tensor_source(vcap_format_id fmt, vcap_tensor_source* source)
+{
+    assert(source != NULL);
+
+    static const struct
+    {
+        vcap_format_id fmt;
+        vcap_source_kind kind;
+        uint32_t pixel_bytes;
+        uint8_t offsets[4];
+    } sources[] = {
+        { VCAP_FMT_GREY,   VCAP_SOURCE_GREY,           1, { 0, 0, 0, 0 } },
+        { VCAP_FMT_RGB24,  VCAP_SOURCE_RGB,            3, { 0, 1, 2, 0 } },
+        { VCAP_FMT_BGR24,  VCAP_SOURCE_RGB,            3, { 2, 1, 0, 0 } },
+        { VCAP_FMT_BGR32,  VCAP_SOURCE_RGB,            4, { 2, 1, 0, 0 } },
+        { VCAP_FMT_XBGR32, VCAP_SOURCE_RGB,            4, { 2, 1, 0, 0 } },
+        { VCAP_FMT_ABGR32, VCAP_SOURCE_RGB,            4, { 2, 1, 0, 0 } },
+        { VCAP_FMT_RGB32,  VCAP_SOURCE_RGB,            4, { 1, 2, 3, 0 } },
+        { VCAP_FMT_XRGB32, VCAP_SOURCE_RGB,            4, { 1, 2, 3, 0 } },
+        { VCAP_FMT_ARGB32, VCAP_SOURCE_RGB,            4, { 1, 2, 3, 0 } },
+        { VCAP_FMT_RGBA32, VCAP_SOURCE_RGB,            4, { 0, 1, 2, 0 } },
+        { VCAP_FMT_BGRA32, VCAP_SOURCE_RGB,            4, { 3, 2, 1, 0 } },
+        { VCAP_FMT_YUYV,   VCAP_SOURCE_YUV_PACKED,     2, { 0, 1, 2, 3 } },
+        { VCAP_FMT_YVYU,   VCAP_SOURCE_YUV_PACKED,     2, { 0, 3, 2, 1 } },
+        { VCAP_FMT_UYVY,   VCAP_SOURCE_YUV_PACKED,     2, { 1, 0, 3, 2 } },
+        { VCAP_FMT_VYUY,   VCAP_SOURCE_YUV_PACKED,     2, { 1, 2, 3, 0 } },
+        { VCAP_FMT_NV12,   VCAP_SOURCE_YUV_SEMIPLANAR, 1, { 0, 1, 0, 0 } },
+        { VCAP_FMT_NV21,   VCAP_SOURCE_YUV_SEMIPLANAR, 1, { 1, 0, 0, 0 } },
+        { VCAP_FMT_YUV420, VCAP_SOURCE_YUV_PLANAR,     1, { 0, 1, 0, 0 } },
+        { VCAP_FMT_YVU420, VCAP_SOURCE_YUV_PLANAR,     1, { 1, 0, 0, 0 } },
+    };
+
+    memset(source, 0, sizeof(*source));
+
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++)
+    {
+        if (sources[i].fmt != fmt)
+            continue;
+
+        source->kind = sources[i].kind;
+        source->pixel_bytes = sources[i].pixel_bytes;
+        memcpy(source->offsets, sources[i].offsets, sizeof(source->offsets));
+        source->range = 255.0f;
+
+        return VCAP_OK;
+    }
+
+    uint32_t bits;
+    source->packing = vcap_get_packing(fmt, &bits);
+
+    if (source->packing == VCAP_PACKING_NONE)
+        return VCAP_INVALID;
+
+    source->kind = VCAP_SOURCE_GREY16;
+    source->mask = (uint16_t)((1u << bits) - 1);
+    source->range = (float)source->mask;
+
+    return VCAP_OK;
+}
+
+static void* vcap_tensor_thread(void* arg)
+{
+    vcap_convert_tensor_rows((vcap_tensor_worker*)arg);
+    return NULL;
+}
+
+static void vcap_convert_tensor_rows(vcap_tensor_worker* worker)
+{
+    assert(worker != NULL);
+
+    const vcap_tensor_context* ctx = worker->ctx;
+
+    size_t row_floats = (size_t)ctx->src_width * ctx->src_channels;
+    float y_ratio = (float)ctx->src_height / (float)ctx->height;
+
+    for (uint32_t y = worker->begin; y < worker->end; y++)
+    {
+        float sy = ((float)y + 0.5f) * y_ratio - 0.5f;
+
+        if (sy < 0.0f)
+            sy = 0.0f;
+
+        uint32_t y0 = (uint32_t)sy;
+
+        if (y0 > ctx->src_height - 1)
+            y0 = ctx->src_height - 1;
+
+        uint32_t y1 = (y0 + 1 < ctx->src_height) ? y0 + 1 : y0;
+        float weight = sy - (float)y0;
+
+        const float* row = vcap_get_source_row(worker, y0, y1);
+
+        if (weight > 0.0f && y1 != y0)
+        {
+            const float* next = vcap_get_source_row(worker, y1, y0);
+
+            vcap_lerp_row(row, next, weight, worker->blend, row_floats);
+            row = worker->blend;
+        }
+
+        vcap_sample_row(ctx, row, worker->sampled, worker->out);
+
+        if (ctx->layout == VCAP_TENSOR_NHWC)
+        {
+            size_t count = (size_t)ctx->width * ctx->channels;
+
+            vcap_normalize(worker->out, count, ctx->pixel_scale, ctx->pixel_bias);
+            vcap_store_tensor(worker->out, ctx->type, ctx->dst, (size_t)y * count, count);
+        }
+        else
+        {
+            for (uint32_t c = 0; c < ctx->channels; c++)
+            {
+                float* plane = worker->out + (size_t)c * ctx->width;
+
+                vcap_normalize(plane, ctx->width, ctx->plane_scale[c], ctx->plane_bias[c]);
+                vcap_store_tensor(plane, ctx->type, ctx->dst, ((size_t)c * ctx->height + y) * ctx->width, ctx->width);
+            }
+        }
+    }
+}
+
+static const float* vcap_get_source_row(vcap_tensor_worker* worker, uint32_t y, uint32_t keep)
+{
+    assert(worker != NULL);
+
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        if (worker->row_index[i] == (int64_t)y)
+            return worker->rows[i];
+    }
+
+    // Replaces the row not needed for the current tensor row
+    uint32_t slot = (worker->row_index[0] == (int64_t)keep) ? 1 : 0;
+
+    vcap_read_source_row(worker->ctx, y, worker->samples, worker->rows[slot]);
+    worker->row_index[slot] = y;
+
+    return worker->rows[slot];
+}
+
+static void vcap_read_source_row(const vcap_tensor_context* ctx, uint32_t y, uint16_t* samples, float* row)
+{
+    assert(ctx != NULL);
+    assert(row != NULL);
+
+    const vcap_tensor_source* source = &ctx->source;
+    const uint8_t* line = ctx->src + y * ctx->src_stride;
+    const uint8_t* o = source->offsets;
+
+    uint32_t width = ctx->src_width;
+
+    switch (source->kind)
+    {
+        case VCAP_SOURCE_GREY:
+            for (uint32_t x = 0; x < width; x++)
+                row[x] = line[x];
+            break;
+
+        case VCAP_SOURCE_GREY16:
+            vcap_unpack_row16(source->packing, line, samples, width);
+
+            // Out of range samples (e.g. noise in unused bits) are masked
+            for (uint32_t x = 0; x < width; x++)
+                row[x] = samples[x] & source->mask;
+            break;
+
+        case VCAP_SOURCE_RGB:
+            for (uint32_t x = 0; x < width; x++)
+            {
+                const uint8_t* pixel = line + x * source->pixel_bytes;
+
+                row[3 * x + 0] = pixel[o[0]];
+                row[3 * x + 1] = pixel[o[1]];
+                row[3 * x + 2] = pixel[o[2]];
+            }
+            break;
+
+        case VCAP_SOURCE_YUV_PACKED:
+            for (uint32_t x = 0; x < width; x++)
+            {
+                const uint8_t* pair = line + (x / 2) * 4;
+                vcap_yuv_to_rgb(pair[(x & 1) ? o[2] : o[0]], pair[o[1]], pair[o[3]], row + 3 * x);
+            }
+            break;
+
+        case VCAP_SOURCE_YUV_SEMIPLANAR:
+        {
+            const uint8_t* chroma = ctx->src + ctx->src_height * ctx->src_stride + (y / 2) * ctx->src_stride;
+
+            for (uint32_t x = 0; x < width; x++)
+            {
+                const uint8_t* uv = chroma + (x / 2) * 2;
+                vcap_yuv_to_rgb(line[x], uv[o[0]], uv[o[1]], row + 3 * x);
+            }
+            break;
+        }
+
+        case VCAP_SOURCE_YUV_PLANAR:
+        {
+            size_t chroma_stride = ctx->src_stride / 2;
+
+            const uint8_t* first = ctx->src + ctx->src_height * ctx->src_stride;
+            const uint8_t* second = first + chroma_stride * ((ctx->src_height + 1) / 2);
+
+            const uint8_t* u = (o[0] == 0) ? first : second;
+            const uint8_t* v = (o[0] == 0) ? second : first;
+
+            u += (y / 2) * chroma_stride;
+            v += (y / 2) * chroma_stride;
+
+            for (uint32_t x = 0; x < width; x++)
+                vcap_yuv_to_rgb(line[x], u[x / 2], v[x / 2], row + 3 * x);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+static void vcap_yuv_to_rgb(float y, float u, float v, float* rgb)
+{
+    // BT.601, limited range
+    float luma = 1.164383f * (y - 16.0f);
+
+    u -= 128.0f;
+    v -= 128.0f;
+
+    float r = luma + 1.596027f * v;
+    float g = luma - 0.391762f * u - 0.812968f * v;
+    float b = luma + 2.017232f * u;
+
+    rgb[0] = (r < 0.0f) ? 0.0f : (r > 255.0f) ? 255.0f : r;
+    rgb[1] = (g < 0.0f) ? 0.0f : (g > 255.0f) ? 255.0f : g;
+    rgb[2] = (b < 0.0f) ? 0.0f : (b > 255.0f) ? 255.0f : b;
+}
+
+static void vcap_lerp_row(const float* a, const float* b, float weight, float* dst, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    __m128 w = _mm_set1_ps(weight);
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 va = _mm_loadu_ps(a + i);
+        __m128 vb = _mm_loadu_ps(b + i);
+
+        _mm_storeu_ps(dst + i, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), w)));
+    }
+#endif
+
+    for (; i < count; i++)
+        dst[i] = a[i] + (b[i] - a[i]) * weight;
+}
+
+static void vcap_sample_row(const vcap_tensor_context* ctx, const float* src, float* sampled, float* dst)
+{
+    assert(ctx != NULL);
+
+    uint32_t src_channels = ctx->src_channels;
+    const float* row = src;
+
+    // Rows are only interpolated when resized horizontally
+    if (ctx->width != ctx->src_width)
+    {
+        for (uint32_t x = 0; x < ctx->width; x++)
+        {
+            const float* a = src + ctx->x0[x] * src_channels;
+            const float* b = src + ctx->x1[x] * src_channels;
+
+            for (uint32_t c = 0; c < src_channels; c++)
+                sampled[x * src_channels + c] = a[c] + (b[c] - a[c]) * ctx->fx[x];
+        }
+
+        row = sampled;
+    }
+
+    // Channels are mapped one at a time to keep the loops simple
+    bool planar = (ctx->layout == VCAP_TENSOR_NCHW);
+    size_t step = planar ? 1 : ctx->channels;
+
+    for (uint32_t c = 0; c < ctx->channels; c++)
+    {
+        float* out = planar ? dst + (size_t)c * ctx->width : dst + c;
+
+        if (ctx->grey && src_channels == 3)
+        {
+            for (uint32_t x = 0; x < ctx->width; x++)
+                out[x * step] = 0.299f * row[3 * x] + 0.587f * row[3 * x + 1] + 0.114f * row[3 * x + 2];
+        }
+        else
+        {
+            const float* in = row + ((src_channels == 1) ? 0 : ctx->channel_map[c]);
+
+            for (uint32_t x = 0; x < ctx->width; x++)
+                out[x * step] = in[x * src_channels];
+        }
+    }
+}
+
+static void vcap_normalize(float* data, size_t count, const float* scale, const float* bias)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    // The pattern repeats every 12 samples, i.e. every three vectors
+    __m128 s0 = _mm_loadu_ps(scale + 0);
+    __m128 s1 = _mm_loadu_ps(scale + 4);
+    __m128 s2 = _mm_loadu_ps(scale + 8);
+    __m128 b0 = _mm_loadu_ps(bias + 0);
+    __m128 b1 = _mm_loadu_ps(bias + 4);
+    __m128 b2 = _mm_loadu_ps(bias + 8);
+
+    for (; i + VCAP_TENSOR_PATTERN <= count; i += VCAP_TENSOR_PATTERN)
+    {
+        _mm_storeu_ps(data + i + 0, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(data + i + 0), s0), b0));
+        _mm_storeu_ps(data + i + 4, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(data + i + 4), s1), b1));
+        _mm_storeu_ps(data + i + 8, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(data + i + 8), s2), b2));
+    }
+#endif
+
+    for (; i < count; i++)
+        data[i] = data[i] * scale[i % VCAP_TENSOR_PATTERN] + bias[i % VCAP_TENSOR_PATTERN];
+}
+
+static void vcap_store_tensor(const float* src, vcap_tensor_type type, void* dst, size_t offset, size_t count)
+{
+    if (type == VCAP_TENSOR_FLOAT32)
+    {
+        memcpy((float*)dst + offset, src, count * sizeof(float));
+        return;
+    }
+
+    uint16_t* out = (uint16_t*)dst + offset;
+    size_t i = 0;
+
+#if defined(__F16C__)
+    for (; i + 4 <= count; i += 4)
+        _mm_storel_epi64((__m128i*)(out + i), _mm_cvtps_ph(_mm_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+
+    for (; i < count; i++)
+        out[i] = vcap_float_to_half(src[i]);
+}
+
+static uint16_t vcap_float_to_half(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    uint32_t mantissa = bits & 0x7FFFFF;
+    int32_t exponent = (int32_t)((bits >> 23) & 0xFF) - 127 + 15;
+
+    // Infinity and NaN
+    if (exponent == 0xFF - 127 + 15)
+        return (uint16_t)(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+
+    if (exponent >= 31)
+        return (uint16_t)(sign | 0x7C00);
+
+    // Subnormals keep the implicit bit in the mantissa
+    uint32_t shift = 13;
+
+    if (exponent <= 0)
+    {
+        if (exponent < -10)
+            return sign;
+
+        mantissa |= 0x800000;
+        shift = (uint32_t)(14 - exponent);
+        exponent = 0;
+    }
+
+    uint32_t half = ((uint32_t)exponent << 10) + (mantissa >> shift);
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t middle = 1u << (shift - 1);
+
+    // Rounds to nearest even, carrying into the exponent if needed
+    if (rest > middle || (rest == middle && (half & 1)))
+        half++;
+
+    return (uint16_t)(sign | half);
+}
+
+#endif // VCAP_CONVERT_IMPLEMENTATION
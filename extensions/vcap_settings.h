@@ -58,6 +58,11 @@
 extern "C" {
 #endif
 
+///
+/// \brief Settings file watcher handle
+///
+typedef struct vcap_settings_watcher vcap_settings_watcher;
+
 //------------------------------------------------------------------------------
 ///
 /// \brief Imports camera settings from JSON
@@ -73,6 +78,54 @@ extern "C" {
 ///
 int vcap_import_settings(vcap_device* vd, const char* json_str);
 
+//------------------------------------------------------------------------------
+///
+/// \brief Imports camera settings from JSON, applying only what differs
+///
+/// Produces the same camera state as `vcap_import_settings`, i.e. controls
+/// missing from the JSON are reset to their defaults, but reads the current
+/// state first. The format and frame rate are only set if they differ, so
+/// streaming buffers aren't reallocated needlessly, and the controls that
+/// differ are written in a single batch.
+///
+/// \param vd        The video capture device
+/// \param json_str  The JSON encoded camera settings
+///
+/// \returns VCAP_OK     if the settings were successfully imported
+///          VCAP_ERROR  if there was an error.
+///
+int vcap_import_settings_diff(vcap_device* vd, const char* json_str);
+
+///
+/// \brief Settings import job (used by `vcap_import_settings_parallel`)
+///
+typedef struct
+{
+    vcap_device* vd;            ///< The video capture device
+    const char* json_str;       ///< The JSON encoded camera settings
+    int result;                 ///< Result of the import (output)
+} vcap_settings_job;
+
+//------------------------------------------------------------------------------
+///
+/// \brief Imports camera settings on many devices concurrently
+///
+/// Runs the jobs on a pool of at most 'max_threads' threads (including the
+/// calling thread), so a slow camera doesn't hold up the others. Each job
+/// records its own result, and error messages are available through
+/// `vcap_get_error` on the job's device. Every job must use a different device.
+///
+/// \param jobs         Array of import jobs
+/// \param count        Number of jobs
+/// \param max_threads  Maximum number of threads (0 uses one per job)
+/// \param diff         Use `vcap_import_settings_diff` instead of
+///                     `vcap_import_settings`
+///
+/// \returns VCAP_OK     if all settings were successfully imported
+///          VCAP_ERROR  if at least one import failed.
+///
+int vcap_import_settings_parallel(vcap_settings_job* jobs, size_t count, size_t max_threads, bool diff);
+
 //------------------------------------------------------------------------------
 ///
 /// \brief Exports camera settings to JSON
@@ -91,6 +144,156 @@ int vcap_import_settings(vcap_device* vd, const char* json_str);
 ///
 int vcap_export_settings(vcap_device* vd, char** json_str);
 
+//------------------------------------------------------------------------------
+///
+/// \brief Exports camera settings as JSON to a file
+///
+/// Produces the same JSON as `vcap_export_settings`, but writes it directly
+/// without building a JSON object tree and without allocating memory (once
+/// controls have been enumerated).
+///
+/// \param vd    The video capture device
+/// \param file  The file to write to
+///
+/// \returns VCAP_OK    if the settings were successfully exported
+///          VCAP_ERROR if there was an error.
+///
+int vcap_export_settings_file(vcap_device* vd, FILE* file);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Exports camera settings as JSON to a buffer
+///
+/// Like `vcap_export_settings_file`, but writes a null-terminated string to a
+/// caller-provided buffer.
+///
+/// \param vd      The video capture device
+/// \param buffer  The buffer to write to
+/// \param size    The size of the buffer in bytes
+/// \param length  Length of the JSON excluding the null terminator (output,
+///                may be NULL). If the buffer is too small, this is the
+///                required length.
+///
+/// \returns VCAP_OK    if the settings were successfully exported
+///          VCAP_ERROR if there was an error or the buffer is too small.
+///
+int vcap_export_settings_buffer(vcap_device* vd, char* buffer, size_t size, size_t* length);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Converts a binary snapshot to JSON
+///
+/// The JSON has the same layout as `vcap_export_settings` output. Control
+/// names are looked up on the device.
+///
+/// \param vd        The video capture device
+/// \param snapshot  The snapshot to convert
+/// \param json_str  Pointer to a string pointer, allocated as in
+///                  `vcap_export_settings`.
+///
+/// \returns VCAP_OK    if the snapshot was converted
+///          VCAP_ERROR if there was an error.
+///
+int vcap_snapshot_to_json(vcap_device* vd, const vcap_snapshot* snapshot, char** json_str);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Converts JSON camera settings to a binary snapshot
+///
+/// If the settings have more controls than `VCAP_SNAPSHOT_MAX_CONTROLS`,
+/// `snapshot->control_count` is set to the number required.
+///
+/// \param vd        The video capture device (used for error reporting)
+/// \param json_str  The JSON encoded camera settings
+/// \param snapshot  The snapshot (output)
+///
+/// \returns VCAP_OK      if the settings were converted,
+///          VCAP_ERROR   if there was an error, and
+///          VCAP_INVALID if the controls don't fit in a snapshot
+///
+int vcap_json_to_snapshot(vcap_device* vd, const char* json_str, vcap_snapshot* snapshot);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Creates a preset from JSON camera settings
+///
+/// Parses the settings once, see `vcap_create_preset`.
+///
+/// \param vd        The video capture device
+/// \param json_str  The JSON encoded camera settings
+///
+/// \returns A pointer to the preset, or NULL if there was an error.
+///
+vcap_preset* vcap_create_preset_json(vcap_device* vd, const char* json_str);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Watches a settings file for changes
+///
+/// Uses inotify to notice when the file is rewritten or replaced (e.g. by an
+/// editor saving atomically). Changes are processed by
+/// `vcap_process_settings_changes`, typically after polling the fd returned by
+/// `vcap_get_settings_watcher_fd`.
+///
+/// \param vd    The video capture device
+/// \param path  Path of the JSON settings file
+///
+/// \returns A pointer to the watcher, or NULL if there was an error.
+///
+vcap_settings_watcher* vcap_watch_settings(vcap_device* vd, const char* path);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Stops watching a settings file
+///
+/// \param watcher  The watcher (may be NULL)
+///
+void vcap_destroy_settings_watcher(vcap_settings_watcher* watcher);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Returns a file descriptor that becomes readable when the settings
+///        file changes
+///
+/// \param watcher  The watcher
+///
+/// \returns The file descriptor
+///
+int vcap_get_settings_watcher_fd(vcap_settings_watcher* watcher);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Applies changes of the settings file
+///
+/// Doesn't block. If the file changed, it is parsed and the controls that
+/// differ from the device are written in a single batch, without stopping the
+/// stream (as in `vcap_import_settings_diff`). A format or frame rate change
+/// would restart the stream, so it is deferred until
+/// `vcap_apply_pending_format` is called. If the new file can't be parsed,
+/// the device keeps its current settings.
+///
+/// \param watcher         The watcher
+/// \param format_pending  Set to true if a format or rate change is pending
+///                        (output, may be NULL)
+///
+/// \returns VCAP_OK     if there were no changes or they were applied
+///          VCAP_ERROR  if there was an error.
+///
+int vcap_process_settings_changes(vcap_settings_watcher* watcher, bool* format_pending);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Applies a deferred format and frame rate change
+///
+/// No-op if no change is pending.
+///
+/// \param watcher  The watcher
+///
+/// \returns VCAP_OK     if the format and rate were applied
+///          VCAP_ERROR  if there was an error.
+///
+int vcap_apply_pending_format(vcap_settings_watcher* watcher);
+
 #ifdef __cplusplus
 }
 #endif
@@ -99,8 +302,15 @@ int vcap_export_settings(vcap_device* vd, char** json_str);
 
 #ifdef VCAP_SETTINGS_IMPLEMENTATION
 
+#include <errno.h>
 #include <jansson.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
 //==============================================================================
 // Internal function declarations
@@ -131,6 +341,60 @@ static int vcap_parse_size(vcap_device* vd, json_t* obj, vcap_size* size);
 static int vcap_parse_rate(vcap_device* vd, json_t* obj, vcap_rate* rate);
 static int vcap_parse_ctrl(vcap_device* vd, json_t* obj, vcap_control_id* id, int32_t* value);
 
+static int vcap_parse_format(vcap_device* vd, json_t* root, vcap_format_id* fmt, vcap_size* size);
+static int vcap_diff_controls(vcap_device* vd, json_t* array);
+
+static json_t* vcap_build_settings(vcap_device* vd, vcap_format_id fmt, vcap_size size, vcap_rate rate);
+static int vcap_dump_settings(vcap_device* vd, json_t* root, char** json_str);
+
+//
+// Shared state of the import worker pool
+//
+typedef struct
+{
+    pthread_mutex_t mutex;
+    vcap_settings_job* jobs;
+    size_t count;
+    size_t next;
+    bool diff;
+} vcap_import_pool;
+
+static void* vcap_import_worker(void* arg);
+
+//
+// Destination of the streaming export (a file or a buffer)
+//
+typedef struct
+{
+    FILE* file;
+    char* buffer;
+    size_t size;
+    size_t length;
+    bool failed;
+} vcap_json_writer;
+
+static int vcap_write_settings(vcap_device* vd, vcap_json_writer* writer);
+
+//
+// Settings file watcher
+//
+struct vcap_settings_watcher
+{
+    vcap_device* vd;
+    int fd;
+    char dir[PATH_MAX];
+    char name[NAME_MAX + 1];
+    bool format_pending;
+    vcap_format_id fmt;
+    vcap_size size;
+    vcap_rate rate;
+};
+
+static char* vcap_read_file(vcap_device* vd, const char* path);
+static int vcap_reload_settings(vcap_settings_watcher* watcher);
+static void vcap_write(vcap_json_writer* writer, const char* fmt, ...);
+static void vcap_write_string(vcap_json_writer* writer, const char* str);
+
 //==============================================================================
 // Public API implementation
 //==============================================================================
@@ -259,6 +523,103 @@ int vcap_import_settings(vcap_device* vd, const char* json_str)
     return VCAP_OK;
 }
 
+int vcap_import_settings_diff(vcap_device* vd, const char* json_str)
+{
+    json_error_t error;
+    json_t* root = json_loads(json_str, 0, &error);
+
+    if (!root)
+    {
+        vcap_set_error(vd, "Parsing JSON failed (%d:%d): %s", error.line, error.column, error.text);
+        return VCAP_ERROR;
+    }
+
+    //==========================================================================
+    // Format/size
+    //==========================================================================
+
+    vcap_format_id fmt, current_fmt;
+    vcap_size size, current_size;
+
+    if (vcap_parse_format(vd, root, &fmt, &size) == VCAP_ERROR)
+    {
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    if (vcap_get_format(vd, &current_fmt, &current_size) == VCAP_ERROR)
+    {
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    // Setting the format restarts the stream
+    if (fmt != current_fmt || size.width != current_size.width || size.height != current_size.height)
+    {
+        if (vcap_set_format(vd, fmt, size) != VCAP_OK)
+        {
+            json_decref(root);
+            return VCAP_ERROR;
+        }
+    }
+
+    //==========================================================================
+    // Rate
+    //==========================================================================
+
+    json_t* obj = json_object_get(root, "rate");
+
+    if (!obj)
+    {
+        vcap_set_error(vd, "Unable to read rate");
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    vcap_rate rate, current_rate;
+
+    if (vcap_parse_rate(vd, obj, &rate) == -1)
+    {
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    if (vcap_get_rate(vd, &current_rate) == VCAP_ERROR)
+    {
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    // Compare fractions, e.g. 1/30 and 2/60 are the same rate
+    if ((uint64_t)rate.numerator * current_rate.denominator != (uint64_t)current_rate.numerator * rate.denominator)
+    {
+        if (vcap_set_rate(vd, rate) != VCAP_OK)
+        {
+            json_decref(root);
+            return VCAP_ERROR;
+        }
+    }
+
+    //==========================================================================
+    // Controls
+    //==========================================================================
+
+    json_t* array = json_object_get(root, "controls");
+
+    if (!array)
+    {
+        vcap_set_error(vd, "Unable to read control array");
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    int result = vcap_diff_controls(vd, array);
+
+    json_decref(root);
+
+    return result;
+}
+
 int vcap_export_settings(vcap_device* vd, char** json_str)
 {
     json_set_alloc_funcs(vcap_malloc, vcap_free);
@@ -436,120 +797,1172 @@ int vcap_export_settings(vcap_device* vd, char** json_str)
     return VCAP_OK;
 }
 
-//==============================================================================
-// Parsing functions (import)
-//==============================================================================
-
-static int vcap_parse_size(vcap_device* vd, json_t* obj, vcap_size* size)
+int vcap_export_settings_file(vcap_device* vd, FILE* file)
 {
-    if (json_typeof(obj) != JSON_OBJECT)
-    {
-        vcap_set_error(vd, "Invalid object");
-        return -1;
-    }
-
-    // Width
-
-    json_t* value = json_object_get(obj, "width");
-
-    if (!value || json_typeof(value) != JSON_INTEGER)
+    if (!file)
     {
-        vcap_set_error(vd, "Invalid integer type");
+        vcap_set_error(vd, "Argument can't be NULL");
         return VCAP_ERROR;
     }
 
-    size->width = json_integer_value(value);
+    vcap_json_writer writer;
+    memset(&writer, 0, sizeof(writer));
 
-    // Height
+    writer.file = file;
 
-    value = json_object_get(obj, "height");
+    if (vcap_write_settings(vd, &writer) == VCAP_ERROR)
+        return VCAP_ERROR;
 
-    if (!value || json_typeof(value) != JSON_INTEGER)
+    if (writer.failed)
     {
-        vcap_set_error(vd, "Invalid integer type");
+        vcap_set_error(vd, "Unable to write JSON");
         return VCAP_ERROR;
     }
 
-    size->height = json_integer_value(value);
-
     return VCAP_OK;
 }
 
-static int vcap_parse_rate(vcap_device* vd, json_t* obj, vcap_rate* rate)
+int vcap_export_settings_buffer(vcap_device* vd, char* buffer, size_t size, size_t* length)
 {
-    if (json_typeof(obj) != JSON_OBJECT)
+    if (!buffer && size > 0)
     {
-        vcap_set_error(vd, "Invalid object");
+        vcap_set_error(vd, "Argument can't be NULL");
         return VCAP_ERROR;
     }
 
-    // Numerator
+    vcap_json_writer writer;
+    memset(&writer, 0, sizeof(writer));
 
-    json_t* value = json_object_get(obj, "numerator");
+    writer.buffer = buffer;
+    writer.size = size;
 
-    if (!value || json_typeof(value) != JSON_INTEGER)
-    {
-        vcap_set_error(vd, "Invalid integer type");
+    if (vcap_write_settings(vd, &writer) == VCAP_ERROR)
         return VCAP_ERROR;
-    }
 
-    rate->numerator = json_integer_value(value);
-
-    // Denominator
-    value = json_object_get(obj, "denominator");
+    if (length)
+        *length = writer.length;
 
-    if (!value || json_typeof(value) != JSON_INTEGER)
+    if (writer.failed || writer.length >= size)
     {
-        vcap_set_error(vd, "Invalid integer type");
+        vcap_set_error(vd, "Buffer too small (%zu bytes required)", writer.length + 1);
         return VCAP_ERROR;
     }
 
-    rate->denominator = json_integer_value(value);
-
     return VCAP_OK;
 }
 
-static int vcap_parse_ctrl(vcap_device* vd, json_t* obj, vcap_control_id* id, int32_t* value)
+int vcap_snapshot_to_json(vcap_device* vd, const vcap_snapshot* snapshot, char** json_str)
 {
-    if (!id || !value)
+    json_set_alloc_funcs(vcap_malloc, vcap_free);
+
+    if (!snapshot || !json_str)
     {
         vcap_set_error(vd, "Argument can't be NULL");
         return VCAP_ERROR;
     }
 
-    if (json_typeof(obj) != JSON_OBJECT)
+    if (snapshot->magic != VCAP_SNAPSHOT_MAGIC || snapshot->version != VCAP_SNAPSHOT_VERSION ||
+        snapshot->control_count > VCAP_SNAPSHOT_MAX_CONTROLS)
     {
-        vcap_set_error(vd, "Invalid object");
+        vcap_set_error(vd, "Invalid snapshot");
         return VCAP_ERROR;
     }
 
-    json_t* json_value = json_object_get(obj, "id");
+    json_t* root = vcap_build_settings(vd, snapshot->format_id, snapshot->size, snapshot->rate);
 
-    if (!json_value || json_typeof(json_value) != JSON_INTEGER)
+    if (!root)
+        return VCAP_ERROR;
+
+    json_t* ctrls = json_array();
+
+    if (!ctrls)
+    {
+        vcap_set_error(vd, "Unable to create JSON array");
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    for (uint32_t i = 0; i < snapshot->control_count; i++)
+    {
+        vcap_control_info info;
+
+        if (vcap_get_control_info(vd, snapshot->controls[i].id, &info) != VCAP_OK)
+        {
+            json_decref(root);
+            json_decref(ctrls);
+            return VCAP_ERROR;
+        }
+
+        json_t* ctrl_obj = vcap_build_ctrl(vd, &info, snapshot->controls[i].value);
+
+        if (!ctrl_obj)
+        {
+            json_decref(root);
+            json_decref(ctrls);
+            return VCAP_ERROR;
+        }
+
+        if (json_array_append_new(ctrls, ctrl_obj) == -1)
+        {
+            vcap_set_error(vd, "Unable to append control");
+            json_decref(root);
+            json_decref(ctrls);
+            return VCAP_ERROR;
+        }
+    }
+
+    if (json_object_set_new(root, "controls", ctrls) == -1)
+    {
+        vcap_set_error(vd, "Unable to set controls");
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    return vcap_dump_settings(vd, root, json_str);
+}
+
+int vcap_json_to_snapshot(vcap_device* vd, const char* json_str, vcap_snapshot* snapshot)
+{
+    json_set_alloc_funcs(vcap_malloc, vcap_free);
+
+    if (!json_str || !snapshot)
+    {
+        vcap_set_error(vd, "Argument can't be NULL");
+        return VCAP_ERROR;
+    }
+
+    json_error_t error;
+    json_t* root = json_loads(json_str, 0, &error);
+
+    if (!root)
+    {
+        vcap_set_error(vd, "Parsing JSON failed (%d:%d): %s", error.line, error.column, error.text);
+        return VCAP_ERROR;
+    }
+
+    memset(snapshot, 0, sizeof(vcap_snapshot));
+
+    snapshot->magic   = VCAP_SNAPSHOT_MAGIC;
+    snapshot->version = VCAP_SNAPSHOT_VERSION;
+
+    if (vcap_parse_format(vd, root, &snapshot->format_id, &snapshot->size) == VCAP_ERROR)
+    {
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    json_t* obj = json_object_get(root, "rate");
+
+    if (!obj)
+    {
+        vcap_set_error(vd, "Unable to read rate");
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    if (vcap_parse_rate(vd, obj, &snapshot->rate) == VCAP_ERROR)
+    {
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    json_t* array = json_object_get(root, "controls");
+
+    if (!array || json_typeof(array) != JSON_ARRAY)
+    {
+        vcap_set_error(vd, "Unable to read control array");
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    if (json_array_size(array) > VCAP_SNAPSHOT_MAX_CONTROLS)
+    {
+        snapshot->control_count = (uint32_t)json_array_size(array);
+
+        vcap_set_error(vd, "Snapshot requires %u controls (maximum %u)",
+                       snapshot->control_count, VCAP_SNAPSHOT_MAX_CONTROLS);
+        json_decref(root);
+        return VCAP_INVALID;
+    }
+
+    size_t index;
+
+    json_array_foreach(array, index, obj)
+    {
+        vcap_control_value* ctrl = &snapshot->controls[snapshot->control_count++];
+
+        if (vcap_parse_ctrl(vd, obj, &ctrl->id, &ctrl->value) == VCAP_ERROR)
+        {
+            json_decref(root);
+            return VCAP_ERROR;
+        }
+    }
+
+    json_decref(root);
+
+    return VCAP_OK;
+}
+
+vcap_preset* vcap_create_preset_json(vcap_device* vd, const char* json_str)
+{
+    vcap_snapshot snapshot;
+
+    if (vcap_json_to_snapshot(vd, json_str, &snapshot) != VCAP_OK)
+        return NULL;
+
+    return vcap_create_preset(vd, &snapshot);
+}
+
+int vcap_import_settings_parallel(vcap_settings_job* jobs, size_t count, size_t max_threads, bool diff)
+{
+    if (!jobs || count == 0)
+        return VCAP_OK;
+
+    if (max_threads == 0 || max_threads > count)
+        max_threads = count;
+
+    // Generate the hash seed before threads race to do it
+    json_object_seed(0);
+
+    vcap_import_pool pool;
+
+    pool.jobs  = jobs;
+    pool.count = count;
+    pool.next  = 0;
+    pool.diff  = diff;
+
+    pthread_mutex_init(&pool.mutex, NULL);
+
+    for (size_t i = 0; i < count; i++)
+        jobs[i].result = VCAP_ERROR;
+
+    // The calling thread is one of the workers
+    size_t thread_count = 0;
+    pthread_t* threads = NULL;
+
+    if (max_threads > 1)
+        threads = (pthread_t*)vcap_malloc((max_threads - 1) * sizeof(pthread_t));
+
+    // Fewer threads (or none) just means less concurrency
+    if (threads)
+    {
+        while (thread_count < max_threads - 1 &&
+               pthread_create(&threads[thread_count], NULL, vcap_import_worker, &pool) == 0)
+        {
+            thread_count++;
+        }
+    }
+
+    vcap_import_worker(&pool);
+
+    for (size_t i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+
+    vcap_free(threads);
+    pthread_mutex_destroy(&pool.mutex);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (jobs[i].result != VCAP_OK)
+            return VCAP_ERROR;
+    }
+
+    return VCAP_OK;
+}
+
+vcap_settings_watcher* vcap_watch_settings(vcap_device* vd, const char* path)
+{
+    if (!path)
+    {
+        vcap_set_error(vd, "Argument can't be NULL");
+        return NULL;
+    }
+
+    vcap_settings_watcher* watcher = (vcap_settings_watcher*)vcap_malloc(sizeof(vcap_settings_watcher));
+
+    if (!watcher)
+    {
+        vcap_set_error(vd, "Out of memory");
+        return NULL;
+    }
+
+    memset(watcher, 0, sizeof(vcap_settings_watcher));
+
+    watcher->vd = vd;
+
+    // Editors often replace the file, so the directory is watched instead
+    const char* slash = strrchr(path, '/');
+    const char* name = slash ? slash + 1 : path;
+    size_t dir_len = slash ? (size_t)(slash - path) : 0;
+
+    if (strlen(name) == 0 || strlen(name) > NAME_MAX || dir_len >= sizeof(watcher->dir))
+    {
+        vcap_set_error(vd, "Invalid settings path %s", path);
+        vcap_free(watcher);
+        return NULL;
+    }
+
+    if (slash)
+    {
+        memcpy(watcher->dir, path, dir_len);
+        watcher->dir[dir_len] = '\0';
+
+        if (dir_len == 0)
+            strcpy(watcher->dir, "/");
+    }
+    else
+    {
+        strcpy(watcher->dir, ".");
+    }
+
+    strcpy(watcher->name, name);
+
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (watcher->fd == -1)
+    {
+        vcap_set_error(vd, "Unable to initialize inotify: %s", strerror(errno));
+        vcap_free(watcher);
+        return NULL;
+    }
+
+    if (inotify_add_watch(watcher->fd, watcher->dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+    {
+        vcap_set_error(vd, "Unable to watch %s: %s", watcher->dir, strerror(errno));
+        close(watcher->fd);
+        vcap_free(watcher);
+        return NULL;
+    }
+
+    return watcher;
+}
+
+void vcap_destroy_settings_watcher(vcap_settings_watcher* watcher)
+{
+    if (!watcher)
+        return;
+
+    close(watcher->fd);
+    vcap_free(watcher);
+}
+
+int vcap_get_settings_watcher_fd(vcap_settings_watcher* watcher)
+{
+    return watcher ? watcher->fd : -1;
+}
+
+int vcap_process_settings_changes(vcap_settings_watcher* watcher, bool* format_pending)
+{
+    if (!watcher)
+        return VCAP_ERROR;
+
+    bool changed = false;
+
+    // Drain all pending events, several may refer to the same save
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (true)
+    {
+        ssize_t len = read(watcher->fd, buffer, sizeof(buffer));
+
+        if (len <= 0)
+        {
+            if (len == -1 && errno != EAGAIN)
+            {
+                vcap_set_error(watcher->vd, "Unable to read inotify events: %s", strerror(errno));
+                return VCAP_ERROR;
+            }
+
+            break;
+        }
+
+        for (char* ptr = buffer; ptr < buffer + len; )
+        {
+            const struct inotify_event* event = (const struct inotify_event*)ptr;
+
+            if (event->len > 0 && strcmp(event->name, watcher->name) == 0)
+                changed = true;
+
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    int result = VCAP_OK;
+
+    if (changed)
+        result = vcap_reload_settings(watcher);
+
+    if (format_pending)
+        *format_pending = watcher->format_pending;
+
+    return result;
+}
+
+int vcap_apply_pending_format(vcap_settings_watcher* watcher)
+{
+    if (!watcher)
+        return VCAP_ERROR;
+
+    if (!watcher->format_pending)
+        return VCAP_OK;
+
+    vcap_device* vd = watcher->vd;
+
+    vcap_format_id fmt;
+    vcap_size size;
+
+    if (vcap_get_format(vd, &fmt, &size) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    if (fmt != watcher->fmt || size.width != watcher->size.width || size.height != watcher->size.height)
+    {
+        if (vcap_set_format(vd, watcher->fmt, watcher->size) != VCAP_OK)
+            return VCAP_ERROR;
+    }
+
+    if (vcap_set_rate(vd, watcher->rate) != VCAP_OK)
+        return VCAP_ERROR;
+
+    watcher->format_pending = false;
+
+    return VCAP_OK;
+}
+
+//==============================================================================
+// Parsing functions (import)
+//==============================================================================
+
+static int vcap_parse_size(vcap_device* vd, json_t* obj, vcap_size* size)
+{
+    if (json_typeof(obj) != JSON_OBJECT)
+    {
+        vcap_set_error(vd, "Invalid object");
+        return -1;
+    }
+
+    // Width
+
+    json_t* value = json_object_get(obj, "width");
+
+    if (!value || json_typeof(value) != JSON_INTEGER)
+    {
+        vcap_set_error(vd, "Invalid integer type");
+        return VCAP_ERROR;
+    }
+
+    size->width = json_integer_value(value);
+
+    // Height
+
+    value = json_object_get(obj, "height");
+
+    if (!value || json_typeof(value) != JSON_INTEGER)
+    {
+        vcap_set_error(vd, "Invalid integer type");
+        return VCAP_ERROR;
+    }
+
+    size->height = json_integer_value(value);
+
+    return VCAP_OK;
+}
+
+static int vcap_parse_rate(vcap_device* vd, json_t* obj, vcap_rate* rate)
+{
+    if (json_typeof(obj) != JSON_OBJECT)
+    {
+        vcap_set_error(vd, "Invalid object");
+        return VCAP_ERROR;
+    }
+
+    // Numerator
+
+    json_t* value = json_object_get(obj, "numerator");
+
+    if (!value || json_typeof(value) != JSON_INTEGER)
+    {
+        vcap_set_error(vd, "Invalid integer type");
+        return VCAP_ERROR;
+    }
+
+    rate->numerator = json_integer_value(value);
+
+    // Denominator
+    value = json_object_get(obj, "denominator");
+
+    if (!value || json_typeof(value) != JSON_INTEGER)
+    {
+        vcap_set_error(vd, "Invalid integer type");
+        return VCAP_ERROR;
+    }
+
+    rate->denominator = json_integer_value(value);
+
+    return VCAP_OK;
+}
+
+static int vcap_parse_ctrl(vcap_device* vd, json_t* obj, vcap_control_id* id, int32_t* value)
+{
+    if (!id || !value)
+    {
+        vcap_set_error(vd, "Argument can't be NULL");
+        return VCAP_ERROR;
+    }
+
+    if (json_typeof(obj) != JSON_OBJECT)
+    {
+        vcap_set_error(vd, "Invalid object");
+        return VCAP_ERROR;
+    }
+
+    json_t* json_value = json_object_get(obj, "id");
+
+    if (!json_value || json_typeof(json_value) != JSON_INTEGER)
+    {
+        vcap_set_error(vd, "Invalid control ID type");
+        return VCAP_ERROR;
+    }
+
+    *id = json_integer_value(json_value);
+
+    json_value = json_object_get(obj, "value");
+
+    if (!json_value || json_typeof(json_value) != JSON_INTEGER)
+    {
+        vcap_set_error(vd, "Invalid control value type");
+        return VCAP_ERROR;
+    }
+
+    *value = json_integer_value(json_value);
+
+    return VCAP_OK;
+}
+
+static int vcap_parse_format(vcap_device* vd, json_t* root, vcap_format_id* fmt, vcap_size* size)
+{
+    json_t* value = json_object_get(root, "format_id");
+
+    if (!value)
+    {
+        vcap_set_error(vd, "Unable to read format ID");
+        return VCAP_ERROR;
+    }
+
+    if (json_typeof(value) != JSON_INTEGER)
+    {
+        vcap_set_error(vd, "Invalid format ID (must be integer)");
+        return VCAP_ERROR;
+    }
+
+    *fmt = json_integer_value(value);
+
+    json_t* obj = json_object_get(root, "size");
+
+    if (!obj)
+    {
+        vcap_set_error(vd, "Unable to read size");
+        return VCAP_ERROR;
+    }
+
+    if (vcap_parse_size(vd, obj, size) == -1)
+        return VCAP_ERROR;
+
+    return VCAP_OK;
+}
+
+//
+// Builds the target state (defaults overlaid with the JSON values), reads the
+// current values in one batch and writes the differences in another
+//
+static int vcap_diff_controls(vcap_device* vd, json_t* array)
+{
+    if (json_typeof(array) != JSON_ARRAY)
+    {
+        vcap_set_error(vd, "Invalid control array");
+        return VCAP_ERROR;
+    }
+
+    // Count controls (enumeration is cached by Vcap)
+    size_t ctrl_count = 0;
+
+    vcap_iterator* itr = vcap_control_iterator(vd);
+
+    if (!itr)
+        return VCAP_ERROR;
+
+    vcap_control_info info;
+
+    while (vcap_next_control(itr, &info))
+        ctrl_count++;
+
+    vcap_free_iterator(itr);
+
+    size_t count = json_array_size(array) + ctrl_count;
+
+    if (count == 0)
+        return VCAP_OK;
+
+    // Target values followed by the current values
+    vcap_control_value* target = (vcap_control_value*)vcap_malloc(2 * count * sizeof(vcap_control_value));
+    bool* readable = (bool*)vcap_malloc(count * sizeof(bool));
+
+    // Candidates for the defaults and their statuses
+    vcap_control_id* ids = (vcap_control_id*)vcap_malloc((ctrl_count + 1) * sizeof(vcap_control_id));
+    vcap_control_status* statuses = (vcap_control_status*)vcap_malloc((ctrl_count + 1) * sizeof(vcap_control_status));
+
+    if (!target || !readable || !ids || !statuses)
+    {
+        vcap_set_error(vd, "Out of memory");
+        vcap_free(target);
+        vcap_free(readable);
+        vcap_free(ids);
+        vcap_free(statuses);
+        return VCAP_ERROR;
+    }
+
+    vcap_control_value* current = target + count;
+    uint32_t target_count = 0;
+
+    // Defaults of the controls a reset would write
+    itr = vcap_control_iterator(vd);
+
+    if (!itr)
+    {
+        vcap_free(target);
+        vcap_free(readable);
+        vcap_free(ids);
+        vcap_free(statuses);
+        return VCAP_ERROR;
+    }
+
+    while (target_count < ctrl_count && vcap_next_control(itr, &info))
+    {
+        if (info.type == VCAP_CTRL_TYPE_BUTTON)
+            continue;
+
+        ids[target_count] = info.id;
+        target[target_count].id = info.id;
+        target[target_count].value = info.default_value;
+        readable[target_count] = true;
+        target_count++;
+    }
+
+    if (vcap_iterator_error(itr))
+    {
+        vcap_free_iterator(itr);
+        vcap_free(target);
+        vcap_free(readable);
+        vcap_free(ids);
+        vcap_free(statuses);
+        return VCAP_ERROR;
+    }
+
+    vcap_free_iterator(itr);
+
+    // One call for all statuses, which uses cached flags where events keep them current
+    if (vcap_get_control_statuses(vd, ids, statuses, target_count) != VCAP_OK)
+    {
+        vcap_free(target);
+        vcap_free(readable);
+        vcap_free(ids);
+        vcap_free(statuses);
+        return VCAP_ERROR;
+    }
+
+    uint32_t default_count = 0;
+
+    for (uint32_t i = 0; i < target_count; i++)
+    {
+        const vcap_control_status* status = &statuses[i];
+
+        if (status->read_only || status->write_only || status->inactive || status->disabled)
+            continue;
+
+        target[default_count++] = target[i];
+    }
+
+    target_count = default_count;
+
+    // Overlay the imported values
+    size_t index;
+    json_t* obj;
+
+    json_array_foreach(array, index, obj)
+    {
+        vcap_control_id id;
+        int32_t value;
+
+        if (vcap_parse_ctrl(vd, obj, &id, &value) == VCAP_ERROR)
+        {
+            vcap_free(target);
+            vcap_free(readable);
+            vcap_free(ids);
+            vcap_free(statuses);
+            return VCAP_ERROR;
+        }
+
+        uint32_t i = 0;
+
+        while (i < target_count && target[i].id != id)
+            i++;
+
+        if (i == target_count)
+        {
+            if (vcap_get_control_statuses(vd, &id, statuses, 1) != VCAP_OK)
+            {
+                vcap_free(target);
+                vcap_free(readable);
+                vcap_free(ids);
+                vcap_free(statuses);
+                return VCAP_ERROR;
+            }
+
+            target[i].id = id;
+            readable[i] = !statuses[0].write_only;
+            target_count++;
+        }
+
+        target[i].value = value;
+    }
+
+    vcap_free(ids);
+    vcap_free(statuses);
+
+    // Read current values (write-only controls are always written)
+    uint32_t read_count = 0;
+
+    for (uint32_t i = 0; i < target_count; i++)
     {
-        vcap_set_error(vd, "Invalid control ID type");
+        if (readable[i])
+            current[read_count++].id = target[i].id;
+    }
+
+    if (vcap_get_controls(vd, current, read_count, NULL) != VCAP_OK)
+    {
+        vcap_free(target);
+        vcap_free(readable);
         return VCAP_ERROR;
     }
 
-    *id = json_integer_value(json_value);
+    // Keep only the values that differ (in place, preserving order)
+    uint32_t diff_count = 0;
 
-    json_value = json_object_get(obj, "value");
+    for (uint32_t i = 0, j = 0; i < target_count; i++)
+    {
+        if (readable[i] && current[j++].value == target[i].value)
+            continue;
 
-    if (!json_value || json_typeof(json_value) != JSON_INTEGER)
+        target[diff_count++] = target[i];
+    }
+
+    vcap_free(readable);
+
+    int result = VCAP_OK;
+
+    if (vcap_set_controls(vd, target, diff_count, NULL) != VCAP_OK)
     {
-        vcap_set_error(vd, "Invalid control value type");
+        // Fall back to writing controls one at a time
+        for (uint32_t i = 0; i < diff_count && result == VCAP_OK; i++)
+            result = (vcap_set_control(vd, target[i].id, target[i].value) == VCAP_OK) ? VCAP_OK : VCAP_ERROR;
+    }
+
+    vcap_free(target);
+
+    return result;
+}
+
+//==============================================================================
+// Import worker pool
+//==============================================================================
+
+static void* vcap_import_worker(void* arg)
+{
+    vcap_import_pool* pool = (vcap_import_pool*)arg;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        size_t index = pool->next++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (index >= pool->count)
+            break;
+
+        vcap_settings_job* job = &pool->jobs[index];
+
+        if (pool->diff)
+            job->result = vcap_import_settings_diff(job->vd, job->json_str);
+        else
+            job->result = vcap_import_settings(job->vd, job->json_str);
+    }
+
+    return NULL;
+}
+
+//==============================================================================
+// Settings file watcher
+//==============================================================================
+
+static char* vcap_read_file(vcap_device* vd, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+
+    if (!file)
+    {
+        vcap_set_error(vd, "Unable to open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    long size = -1;
+
+    if (fseek(file, 0, SEEK_END) == 0)
+        size = ftell(file);
+
+    if (size < 0 || fseek(file, 0, SEEK_SET) != 0)
+    {
+        vcap_set_error(vd, "Unable to read %s", path);
+        fclose(file);
+        return NULL;
+    }
+
+    char* str = (char*)vcap_malloc((size_t)size + 1);
+
+    if (!str)
+    {
+        vcap_set_error(vd, "Out of memory");
+        fclose(file);
+        return NULL;
+    }
+
+    if (fread(str, 1, (size_t)size, file) != (size_t)size)
+    {
+        vcap_set_error(vd, "Unable to read %s", path);
+        vcap_free(str);
+        fclose(file);
+        return NULL;
+    }
+
+    str[size] = '\0';
+
+    fclose(file);
+
+    return str;
+}
+
+static int vcap_reload_settings(vcap_settings_watcher* watcher)
+{
+    vcap_device* vd = watcher->vd;
+
+    char path[PATH_MAX + NAME_MAX + 2];
+    snprintf(path, sizeof(path), "%s/%s", watcher->dir, watcher->name);
+
+    char* json_str = vcap_read_file(vd, path);
+
+    if (!json_str)
+        return VCAP_ERROR;
+
+    json_set_alloc_funcs(vcap_malloc, vcap_free);
+
+    json_error_t error;
+    json_t* root = json_loads(json_str, 0, &error);
+
+    vcap_free(json_str);
+
+    if (!root)
+    {
+        vcap_set_error(vd, "Parsing JSON failed (%d:%d): %s", error.line, error.column, error.text);
         return VCAP_ERROR;
     }
 
-    *value = json_integer_value(json_value);
+    // Validate the whole file before applying anything
+    vcap_format_id fmt;
+    vcap_size size;
+    vcap_rate rate;
+
+    json_t* obj = json_object_get(root, "rate");
+    json_t* array = json_object_get(root, "controls");
+
+    if (vcap_parse_format(vd, root, &fmt, &size) == VCAP_ERROR)
+    {
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    if (!obj || vcap_parse_rate(vd, obj, &rate) == VCAP_ERROR)
+    {
+        if (!obj)
+            vcap_set_error(vd, "Unable to read rate");
+
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    if (!array)
+    {
+        vcap_set_error(vd, "Unable to read control array");
+        json_decref(root);
+        return VCAP_ERROR;
+    }
+
+    // Controls can change while streaming
+    int result = vcap_diff_controls(vd, array);
+
+    json_decref(root);
+
+    if (result == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    // Format and rate changes are deferred
+    vcap_format_id current_fmt;
+    vcap_size current_size;
+    vcap_rate current_rate;
+
+    if (vcap_get_format(vd, &current_fmt, &current_size) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    if (vcap_get_rate(vd, &current_rate) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    watcher->fmt  = fmt;
+    watcher->size = size;
+    watcher->rate = rate;
+
+    watcher->format_pending =
+        fmt != current_fmt || size.width != current_size.width || size.height != current_size.height ||
+        (uint64_t)rate.numerator * current_rate.denominator != (uint64_t)current_rate.numerator * rate.denominator;
+
+    return VCAP_OK;
+}
+
+//==============================================================================
+// Streaming export
+//==============================================================================
+
+//
+// Mirrors the layout of json_dumps(JSON_INDENT(4) | JSON_PRESERVE_ORDER)
+//
+static int vcap_write_settings(vcap_device* vd, vcap_json_writer* writer)
+{
+    vcap_format_id fmt;
+    vcap_size size;
+
+    if (vcap_get_format(vd, &fmt, &size) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    vcap_rate rate;
+
+    if (vcap_get_rate(vd, &rate) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    vcap_write(writer, "{\n");
+    vcap_write(writer, "    \"format_id\": %u,\n", fmt);
+    vcap_write(writer, "    \"size\": {\n");
+    vcap_write(writer, "        \"width\": %u,\n", size.width);
+    vcap_write(writer, "        \"height\": %u\n", size.height);
+    vcap_write(writer, "    },\n");
+    vcap_write(writer, "    \"rate\": {\n");
+    vcap_write(writer, "        \"numerator\": %u,\n", rate.numerator);
+    vcap_write(writer, "        \"denominator\": %u\n", rate.denominator);
+    vcap_write(writer, "    },\n");
+
+    // Same selection as vcap_export_settings, each control is written as it's
+    // read (enumerated by index, which unlike an iterator doesn't allocate)
+    vcap_control_info info;
+    uint32_t count = 0;
+    int result;
+
+    for (uint32_t i = 0; (result = vcap_enum_control(vd, i, &info)) == VCAP_OK; i++)
+    {
+        vcap_control_status status;
+
+        if (vcap_get_control_status(vd, info.id, &status) != VCAP_OK)
+            return VCAP_ERROR;
+
+        if (status.read_only || status.write_only || status.disabled || status.inactive)
+            continue;
+
+        int32_t value = 0;
+
+        if (vcap_get_control(vd, info.id, &value) != VCAP_OK)
+            return VCAP_ERROR;
+
+        vcap_write(writer, (count == 0) ? "    \"controls\": [\n" : ",\n");
+        vcap_write(writer, "        {\n");
+        vcap_write(writer, "            \"id\": %u,\n", info.id);
+        vcap_write(writer, "            \"name\": ");
+        vcap_write_string(writer, (const char*)info.name);
+        vcap_write(writer, ",\n");
+        vcap_write(writer, "            \"value\": %d\n", value);
+        vcap_write(writer, "        }");
+
+        count++;
+    }
+
+    if (result == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    if (count == 0)
+        vcap_write(writer, "    \"controls\": []\n");
+    else
+        vcap_write(writer, "\n    ]\n");
+
+    vcap_write(writer, "}");
 
     return VCAP_OK;
 }
 
+static void vcap_write(vcap_json_writer* writer, const char* fmt, ...)
+{
+    if (writer->failed)
+        return;
+
+    va_list args;
+    va_start(args, fmt);
+
+    int count;
+
+    if (writer->file)
+    {
+        count = vfprintf(writer->file, fmt, args);
+    }
+    else
+    {
+        // Keep counting past the end of the buffer to report the required size
+        size_t offset = writer->length < writer->size ? writer->length : writer->size;
+        count = vsnprintf(writer->buffer ? writer->buffer + offset : NULL, writer->size - offset, fmt, args);
+    }
+
+    va_end(args);
+
+    if (count < 0)
+        writer->failed = true;
+    else
+        writer->length += (size_t)count;
+}
+
+static void vcap_write_string(vcap_json_writer* writer, const char* str)
+{
+    vcap_write(writer, "\"");
+
+    // Same escapes as Jansson
+    for (const unsigned char* c = (const unsigned char*)str; *c; c++)
+    {
+        const char* escape = NULL;
+
+        switch (*c)
+        {
+            case '"':
+                escape = "\\\"";
+                break;
+
+            case '\\':
+                escape = "\\\\";
+                break;
+
+            case '\b':
+                escape = "\\b";
+                break;
+
+            case '\f':
+                escape = "\\f";
+                break;
+
+            case '\n':
+                escape = "\\n";
+                break;
+
+            case '\r':
+                escape = "\\r";
+                break;
+
+            case '\t':
+                escape = "\\t";
+                break;
+        }
+
+        if (escape)
+            vcap_write(writer, "%s", escape);
+        else if (*c < 0x20)
+            vcap_write(writer, "\\u%04X", *c);
+        else
+            vcap_write(writer, "%c", *c);
+    }
+
+    vcap_write(writer, "\"");
+}
+
 //==============================================================================
 // Build function (export)
 //==============================================================================
 
+static json_t* vcap_build_settings(vcap_device* vd, vcap_format_id fmt, vcap_size size, vcap_rate rate)
+{
+    json_t* root = json_object();
+
+    if (!root)
+    {
+        vcap_set_error(vd, "Unable to create JSON object");
+        return NULL;
+    }
+
+    if (json_object_set_new(root, "format_id", json_integer(fmt)) == -1)
+    {
+        vcap_set_error(vd, "Unable to set format ID");
+        json_decref(root);
+        return NULL;
+    }
+
+    json_t* size_obj = vcap_build_size(vd, size);
+
+    if (!size_obj)
+    {
+        json_decref(root);
+        return NULL;
+    }
+
+    if (json_object_set_new(root, "size", size_obj) == -1)
+    {
+        vcap_set_error(vd, "Unable to set size");
+        json_decref(root);
+        return NULL;
+    }
+
+    json_t* rate_obj = vcap_build_rate(vd, rate);
+
+    if (!rate_obj)
+    {
+        json_decref(root);
+        return NULL;
+    }
+
+    if (json_object_set_new(root, "rate", rate_obj) == -1)
+    {
+        vcap_set_error(vd, "Unable to set rate");
+        json_decref(root);
+        return NULL;
+    }
+
+    return root;
+}
+
+static int vcap_dump_settings(vcap_device* vd, json_t* root, char** json_str)
+{
+    char* str = json_dumps(root, JSON_INDENT(4) | JSON_PRESERVE_ORDER);
+
+    json_decref(root);
+
+    if (!str)
+    {
+        vcap_set_error(vd, "Unable to write JSON");
+        return VCAP_ERROR;
+    }
+
+    // Jansson allocates with the Vcap allocator (see json_set_alloc_funcs)
+    *json_str = str;
+
+    return VCAP_OK;
+}
+
 static json_t* vcap_build_size(vcap_device* vd, const vcap_size size)
 {
     json_t* obj = json_object();
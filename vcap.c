@@ -32,13 +32,25 @@
 #include <fcntl.h>
 #include <libv4l2.h>
 #include <linux/videodev2.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// Number of events that can be queued internally (e.g. by vcap_capture)
+#define VCAP_EVENT_QUEUE_SIZE 32
 
 //
 // Memory mapped buffer definition
@@ -49,12 +61,173 @@ typedef struct
     void* data;
 } vcap_buffer;
 
+//
+// Cached frame size and its frame rates
+//
+typedef struct
+{
+    vcap_size size;
+    uint32_t rate_count;
+    vcap_rate* rates;
+    bool has_rate_range;
+    vcap_rate_range rate_range;
+} vcap_size_cache;
+
+//
+// Cached format and its frame sizes
+//
+typedef struct
+{
+    vcap_format_info info;
+    uint32_t pixelformat;
+    uint32_t flags;
+    uint32_t size_count;
+    vcap_size_cache* sizes;
+    bool has_size_range;
+    vcap_size_range size_range;
+} vcap_format_cache;
+
+// Capability cache file identifier ("VCCF", stored in native byte order)
+#define VCAP_CACHE_FILE_MAGIC 0x46434356
+
+// Capability cache file layout version (bumped when records or the format
+// table change, e.g. version 2 extended the format table)
+#define VCAP_CACHE_FILE_VERSION 2
+
+//
+// Capability cache file header. Cache entries are stored as-is, so the record
+// sizes guard against files written by an incompatible build.
+//
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t fmt_size;
+    uint32_t size_size;
+    uint32_t ctrl_size;
+    uint8_t driver[32];
+    uint8_t card[32];
+    uint8_t bus_info[32];
+    uint32_t driver_version;
+    uint32_t convert;
+    uint32_t fmt_count;
+    uint32_t ctrl_count;
+} vcap_cache_header;
+
+//
+// Format negotiation candidate
+//
+typedef struct
+{
+    vcap_format_cache* fmt;
+    vcap_size size;
+    vcap_rate rate;
+    double bandwidth;
+    double cpu;
+    double cost;
+} vcap_format_candidate;
+
+//
+// Pixel format table entry. Bits per pixel are an estimate for compressed
+// formats (bpp is zero). CPU cost is the relative per-pixel cost of converting
+// to or from a common RGB representation.
+//
+typedef struct
+{
+    uint32_t fourcc;
+    uint8_t bpp;
+    uint8_t planes;
+    uint8_t h_sub;
+    uint8_t v_sub;
+    double bits;
+    double cpu;
+} vcap_format_entry;
+
+// Size of the FourCC lookup table (power of two, at least twice VCAP_FMT_COUNT)
+#define VCAP_FMT_HASH_SIZE 256
+
+//
+// Cached control metadata
+//
+typedef struct
+{
+    vcap_control_info info;
+    uint32_t v4l2_id;
+    uint32_t flags;
+    bool menu_cached;
+    uint32_t menu_count;
+    vcap_menu_item* menu;
+    bool value_valid;
+    int32_t value;
+    bool feedback;
+    bool subscribed;
+    uint64_t write_seq;
+} vcap_control_cache;
+
+// Maximum number of distinct controls pending in the control writer
+#define VCAP_WRITER_SLOT_COUNT 64
+
+// Time allowed for an asynchronous control write to complete (in milliseconds)
+#define VCAP_ASYNC_TIMEOUT_MS 10000
+
+//
+// Result of a control write requested by vcap_set_control_async
+//
+typedef struct
+{
+    vcap_control_id id;
+    int32_t value;
+    int result;
+    bool changed;
+} vcap_control_written;
+
+//
+// Asynchronous control write that hasn't completed yet
+//
+typedef struct
+{
+    vcap_control_id id;
+    int32_t value;
+    bool written;
+    bool event_seen;
+    uint64_t deadline;
+} vcap_async_wait;
+
+//
+// Background control writer, pending values are coalesced per control
+//
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    int fd;
+    int done_fd;
+    int timer_fd;
+    bool running;
+    bool busy;
+    bool failed;
+    bool overflowed;
+    char error_msg[1024];
+    uint64_t queued_seq;
+    uint64_t applied_seq;
+    uint32_t pending_count;
+    vcap_control_id pending_ids[VCAP_WRITER_SLOT_COUNT];
+    bool pending_notify[VCAP_WRITER_SLOT_COUNT];
+    struct v4l2_ext_control pending[VCAP_WRITER_SLOT_COUNT];
+    uint32_t done_count;
+    vcap_control_written done[VCAP_WRITER_SLOT_COUNT];
+} vcap_control_writer;
+
 //
 // Video device definition
 //
 struct vcap_device
 {
     int fd;
+    int event_fd;
+    int notify_fd;
     char path[512];
     char error_msg[2048];
     bool open;
@@ -63,6 +236,28 @@ struct vcap_device
     uint32_t buffer_count;
     vcap_buffer* buffers;
     struct v4l2_capability caps;
+    bool fmt_valid;
+    struct v4l2_format fmt;
+    bool frame_info_valid;
+    vcap_frame_info frame_info;
+    bool fmts_cached;
+    uint32_t fmt_count;
+    vcap_format_cache* fmts;
+    bool ctrls_cached;
+    uint32_t ctrl_count;
+    uint32_t ctrl_capacity;
+    vcap_control_cache* ctrls;
+    bool ctrl_flags_stale;
+    vcap_control_writer* writer;
+    uint32_t wait_count;
+    vcap_async_wait waits[VCAP_WRITER_SLOT_COUNT];
+    bool value_cache;
+    bool source_events;
+    bool auto_renegotiate;
+    bool notified;
+    uint32_t event_head;
+    uint32_t event_count;
+    vcap_event events[VCAP_EVENT_QUEUE_SIZE];
 };
 
 //
@@ -121,6 +316,20 @@ struct vcap_iterator
     } data;
 };
 
+//
+// Precompiled settings, resolved against a specific device
+//
+struct vcap_preset
+{
+    vcap_device* vd;
+    vcap_format_id format_id;
+    vcap_size size;
+    vcap_rate rate;
+    uint32_t count;
+    vcap_control_id ids[VCAP_SNAPSHOT_MAX_CONTROLS];
+    struct v4l2_ext_control ctrls[VCAP_SNAPSHOT_MAX_CONTROLS];
+};
+
 //==============================================================================
 // Internal function declarations
 //==============================================================================
@@ -167,6 +376,78 @@ static int vcap_unmap_buffers(vcap_device* vd);
 // Queue mapped buffers
 static int vcap_queue_buffers(vcap_device* vd);
 
+// Resets all writable controls to their defaults in a single batch
+static int vcap_reset_controls_batch(vcap_device* vd);
+
+// Returns true if the value of a control may be served from the value cache
+static bool vcap_value_cacheable(vcap_device* vd, const vcap_control_cache* entry);
+
+// Marks the controls whose queued values the writer has applied as cacheable
+// again (called with the writer locked)
+static void vcap_settle_writes(vcap_device* vd);
+
+// Locks the writer, if any, and settles the applied writes
+static void vcap_sync_writer(vcap_device* vd);
+
+// Records the value of a control after it was read or written
+static void vcap_store_value(vcap_device* vd, vcap_control_cache* entry, int32_t value, bool written);
+
+// Discards all cached control values
+static void vcap_invalidate_values(vcap_device* vd);
+
+// Re-reads the flags of all cached controls
+static int vcap_refresh_control_flags(vcap_device* vd);
+
+// Re-reads the flags of a cached control
+static int vcap_query_control_flags(vcap_device* vd, vcap_control_cache* entry);
+
+// Clamps a control value to the range of the control and snaps it to the step
+static int32_t vcap_clamp_value(const vcap_control_info* info, int32_t value);
+
+// Marks cached control flags as stale if writing the control affects others
+static void vcap_note_write(vcap_device* vd, const vcap_control_cache* entry);
+
+// Applies queued control values in the background
+static void* vcap_control_writer_main(void* arg);
+
+// Queues a control value, optionally requesting a completion event
+static int vcap_queue_control_value(vcap_device* vd, vcap_control_id ctrl, int32_t value, bool notify);
+
+// Writes a batch of controls, retrying without controls the driver rejects.
+// Returns the errno of the first failure (0 if none) and stores its control.
+static int vcap_write_controls(int fd, const struct v4l2_ext_control* ctrls, uint32_t count, int* results, uint32_t* failed_id);
+
+// Records the result of an asynchronous write and signals it through the event fd
+static void vcap_post_written(vcap_control_writer* writer, const vcap_control_written* written);
+
+// Arms the writer's timer with the earliest deadline of the asynchronous writes
+static void vcap_arm_async_timer(vcap_device* vd);
+
+// Adds the writer's completion and timer fds to an event fd
+static int vcap_watch_writer(int event_fd, vcap_control_writer* writer);
+
+// Collects asynchronous write results from the control writer, queueing
+// completion events for writes that are done
+static void vcap_collect_completions(vcap_device* vd);
+
+// Completes asynchronous writes of a control after a control event
+static void vcap_complete_async(vcap_device* vd, vcap_control_id ctrl);
+
+// Queues a completion event for an asynchronous write
+static void vcap_push_completion(vcap_device* vd, vcap_control_id ctrl, int32_t value, int result);
+
+// Returns a monotonic timestamp in milliseconds
+static uint64_t vcap_monotonic_ms(void);
+
+// Returns a monotonic timestamp in microseconds
+static uint64_t vcap_monotonic_us(void);
+
+// Returns the field order of the current format
+static uint32_t vcap_format_field(vcap_device* vd);
+
+// Gets, sets or tries a batch of controls using the extended control ioctls
+static int vcap_ext_ctrls(vcap_device* vd, long unsigned request, vcap_control_value* ctrls, uint32_t count, uint32_t* error_index);
+
 // Grab a frame using memory-mapped buffers
 static int vcap_capture_mmap(vcap_device* vd, size_t size, uint8_t* data);
 
@@ -185,6 +466,9 @@ void vcap_set_error_str(const char* func, int line, vcap_device* vd, const char*
 // Set error message (including errno infomation) for specified device
 void vcap_set_error_errno_str(const char* func, int line, vcap_device* vd, const char* fmt, ...);
 
+// Returns true if the control ID is either a Vcap or a V4L2 control ID
+static bool vcap_ctrl_valid(vcap_control_id id);
+
 // Converts a V4L2 control ID to VCAP control ID
 static vcap_control_id vcap_convert_ctrl(uint32_t id);
 
@@ -194,12 +478,140 @@ static uint32_t vcap_map_ctrl(vcap_control_id id);
 // Converts a V4L2 control type ID to VCAP control type ID
 static vcap_control_type vcap_convert_ctrl_type(uint32_t type);
 
+// Converts V4L2 control flags to a control status
+static void vcap_flags_to_status(uint32_t flags, vcap_control_status* status);
+
+// Converts a V4L2 control event and updates the control cache
+static void vcap_convert_ctrl_event(vcap_device* vd, const struct v4l2_event* ev, vcap_event* event);
+
+// Converts a V4L2 event, returns false if the event type is not supported
+static bool vcap_convert_event(vcap_device* vd, const struct v4l2_event* ev, vcap_event* event);
+
+// Appends an event to the internal event queue
+static void vcap_push_event(vcap_device* vd, const vcap_event* event);
+
+// Removes an event from the internal event queue, returns false if empty
+static bool vcap_pop_event(vcap_device* vd, vcap_event* event);
+
+// Keeps the notification fd readable while the internal event queue is not empty
+static void vcap_update_notify(vcap_device* vd);
+
+// Moves pending driver events into the internal queue, returning
+// VCAP_SOURCE_CHANGED or VCAP_END_OF_STREAM if such an event was found
+static int vcap_drain_events(vcap_device* vd);
+
+// Waits until a frame is ready, handling source events if subscribed
+static int vcap_wait_frame(vcap_device* vd);
+
 // Returns true if control type is supported
 static bool vcap_ctrl_type_supported(uint32_t type);
 
 // Return string describing a control type
 static const char* vcap_ctrl_type_str(vcap_control_type id);
 
+// Grows a dynamic array so that it can hold at least 'count + 1' elements
+static void* vcap_grow_array(void* array, uint32_t count, uint32_t* capacity, size_t elem_size);
+
+// Builds the format/size/rate cache (no-op if the cache is valid)
+static int vcap_cache_formats(vcap_device* vd);
+
+// Caches the frame sizes of a format
+static int vcap_cache_sizes(vcap_device* vd, vcap_format_cache* fmt);
+
+// Caches the frame rates of a frame size
+static int vcap_cache_rates(vcap_device* vd, uint32_t pixelformat, vcap_size_cache* size);
+
+// Releases the format/size/rate cache
+static void vcap_free_format_cache(vcap_device* vd);
+
+// Frees an array of cached formats, including their sizes and rates
+static void vcap_free_formats(vcap_format_cache* fmts, uint32_t count);
+
+// Finds a format in the cache
+static vcap_format_cache* vcap_find_format(vcap_device* vd, vcap_format_id fmt);
+
+// Finds a frame size in a cached format
+static vcap_size_cache* vcap_find_size(vcap_format_cache* fmt, vcap_size size);
+
+// Queries the driver for the format at the specified index
+static int vcap_query_fmt(vcap_device* vd, uint32_t index, vcap_format_info* info, uint32_t* pixelformat, uint32_t* flags);
+
+// Queries the driver for the frame size at the specified index
+static int vcap_query_size(vcap_device* vd, uint32_t pixelformat, uint32_t index, vcap_size* size, vcap_size_range* range, bool* stepwise);
+
+// Checks if a frame size lies on a stepwise or continuous size range
+static bool vcap_size_in_range(const vcap_size_range* range, vcap_size size);
+
+// Confirms a format and frame size with the driver without applying it
+static int vcap_try_format(vcap_device* vd, vcap_format_id fmt, vcap_size size, vcap_format_id* actual_fmt, vcap_size* actual_size);
+static int vcap_try_native_format(vcap_device* vd, vcap_format_id fmt, vcap_size size, vcap_format_id* actual_fmt, vcap_size* actual_size);
+
+// Adds the cheapest rate of a format and frame size that meets the request
+static int vcap_add_candidate(vcap_device* vd, const vcap_format_request* request, vcap_format_cache* fmt,
+                              const vcap_size_cache* size, vcap_format_candidate** candidates,
+                              uint32_t* count, uint32_t* capacity);
+
+// Adds the smallest frame size of a size range that meets the request
+static int vcap_add_range_candidate(vcap_device* vd, const vcap_format_request* request, vcap_format_cache* fmt,
+                                    vcap_format_candidate** candidates, uint32_t* count, uint32_t* capacity);
+
+// Orders candidates by ascending cost
+static int vcap_compare_candidates(const void* a, const void* b);
+
+// Estimated per-pixel cost of converting between two formats
+static double vcap_conversion_cost(vcap_format_id from, vcap_format_id to);
+
+// Queries the driver for the frame rate at the specified index
+static int vcap_query_rate(vcap_device* vd, uint32_t pixelformat, vcap_size size, uint32_t index, vcap_rate* rate, vcap_rate_range* range, bool* stepwise);
+
+// Chooses the slowest rate of a range that is at least 'min' (any rate if 'min' is zero)
+static bool vcap_rate_from_range(const vcap_rate_range* range, vcap_rate min, vcap_rate* rate);
+
+// Builds the control metadata cache (no-op if the cache is valid)
+static int vcap_cache_controls(vcap_device* vd);
+
+// Walks the control list using VIDIOC_QUERY_EXT_CTRL/VIDIOC_QUERYCTRL
+static int vcap_cache_next_controls(vcap_device* vd, bool extended);
+
+// Probes the controls known to Vcap one at a time (drivers without NEXT_CTRL)
+static int vcap_cache_known_controls(vcap_device* vd);
+
+// Appends a control to the control cache
+static int vcap_add_control(vcap_device* vd, uint32_t id, uint32_t type, const char* name,
+                            int64_t min, int64_t max, uint64_t step, int64_t default_value,
+                            uint32_t flags);
+
+// Caches the menu items of a menu control (no-op if the menu is cached)
+static int vcap_cache_menu(vcap_device* vd, vcap_control_cache* ctrl);
+
+// Releases the control metadata cache
+static void vcap_free_control_cache(vcap_device* vd);
+
+// Frees an array of cached controls, including their menus
+static void vcap_free_controls(vcap_control_cache* ctrls, uint32_t count);
+
+// Copy cache entries into zeroed cache file records, leaving out pointers and
+// values that are never persisted
+static void vcap_format_record(const vcap_format_cache* fmt, vcap_format_cache* record);
+static void vcap_size_record(const vcap_size_cache* size, vcap_size_cache* record);
+static void vcap_control_record(const vcap_control_cache* ctrl, vcap_control_cache* record);
+
+// Copies bytes from a cache file buffer and advances the read position
+static bool vcap_read_cache(const uint8_t** pos, const uint8_t* end, void* data, size_t size);
+
+// Parses the format and control caches from a cache file buffer, replacing the
+// device caches only if the whole buffer is valid
+static int vcap_parse_cache(vcap_device* vd, const vcap_cache_header* header, const uint8_t* pos, const uint8_t* end);
+
+// Parses cache entries into the given arrays (entries may be partially loaded
+// on failure)
+static int vcap_parse_cache_entries(const vcap_cache_header* header, const uint8_t* pos, const uint8_t* end,
+                                    vcap_format_cache** fmts, uint32_t* fmt_count,
+                                    vcap_control_cache** ctrls, uint32_t* ctrl_count);
+
+// Finds a control in the cache
+static vcap_control_cache* vcap_find_control(vcap_device* vd, vcap_control_id ctrl);
+
 // Enumerates formats
 static int vcap_enum_fmts(vcap_device* vd, vcap_format_info* info, uint32_t index);
 
@@ -221,6 +633,21 @@ static vcap_format_id vcap_convert_fmt(uint32_t id);
 // Converts a VCAP format ID to a V4L2 ID
 static uint32_t vcap_map_fmt(vcap_format_id id);
 
+// Converts a VCAP selection target to a V4L2 selection target
+static uint32_t vcap_map_sel_target(vcap_selection_target target);
+
+// Gets the table entry of a format ID
+static const vcap_format_entry* vcap_get_format_entry(vcap_format_id id);
+
+// Builds the FourCC lookup table
+static void vcap_init_fmt_hash(void);
+
+// Hashes a FourCC code into the lookup table
+static uint32_t vcap_hash_fourcc(uint32_t fourcc);
+
+// Number of extended controls that are batched without dynamic allocation
+#define VCAP_EXT_CTRL_STACK_COUNT 64
+
 // Global malloc function pointer
 static vcap_malloc_fn global_malloc_fp = malloc;
 
@@ -474,6 +901,8 @@ vcap_device* vcap_create_device(const char* path, bool convert, uint32_t buffer_
     memset(vd, 0, sizeof(vcap_device));
 
     vd->fd = -1;
+    vd->event_fd = -1;
+    vd->notify_fd = -1;
     vd->buffer_count = buffer_count;
     vd->streaming = false;
     vd->convert = convert;
@@ -596,10 +1025,31 @@ void vcap_close(vcap_device* vd)
     // No-op if device is not streaming, ignore errors
     vcap_stop_stream(vd);
 
+    // Pending control values are still applied
+    vcap_stop_control_writer(vd);
+
     // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/func-close.html
     if (vd->fd >= 0)
         v4l2_close(vd->fd);
 
+    if (vd->event_fd >= 0)
+        close(vd->event_fd);
+
+    if (vd->notify_fd >= 0)
+        close(vd->notify_fd);
+
+    vd->event_fd = -1;
+    vd->notify_fd = -1;
+    vd->source_events = false;
+    vd->auto_renegotiate = false;
+    vd->notified = false;
+    vd->event_head = 0;
+    vd->event_count = 0;
+    vd->wait_count = 0;
+    vd->frame_info_valid = false;
+
+    vcap_invalidate_cache(vd);
+
     vd->open = false;
 }
 
@@ -636,6 +1086,7 @@ int vcap_start_stream(vcap_device* vd)
         }
 
         vd->streaming = true;
+        vd->frame_info_valid = false;
     }
 
     return VCAP_OK;
@@ -735,19 +1186,82 @@ size_t vcap_get_image_size(vcap_device* vd)
         return 0;
     }
 
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-fmt.html
-    struct v4l2_format fmt;
-    VCAP_CLEAR(fmt);
+    // Served from the negotiated format, if known
+    if (!vd->fmt_valid && vcap_get_format(vd, NULL, NULL) == VCAP_ERROR)
+        return 0;
 
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    return vd->fmt.fmt.pix.sizeimage;
+}
 
-    if (vcap_ioctl(vd->fd, VIDIOC_G_FMT, &fmt) == -1)
+int vcap_get_frame_layout(vcap_device* vd, vcap_frame_layout* layout)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
     {
-        vcap_set_error_errno(vd, "Unable to get format on device %s", vd->path);
-        return 0;
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(layout != NULL);
+
+    if (!layout)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    if (!vd->fmt_valid && vcap_get_format(vd, NULL, NULL) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    const struct v4l2_pix_format* pix = &vd->fmt.fmt.pix;
+
+    VCAP_CLEAR(*layout);
+
+    layout->format       = vcap_convert_fmt(pix->pixelformat);
+    layout->fourcc       = pix->pixelformat;
+    layout->width        = pix->width;
+    layout->height       = pix->height;
+    layout->stride       = pix->bytesperline;
+    layout->image_size   = pix->sizeimage;
+    layout->field        = pix->field;
+    layout->colorspace   = pix->colorspace;
+    layout->ycbcr_enc    = pix->ycbcr_enc;
+    layout->quantization = pix->quantization;
+    layout->xfer_func    = pix->xfer_func;
+
+    // Planes are stored one after the other in the buffer. The plane layout of
+    // unknown and compressed formats isn't known, so they have a single plane.
+    layout->plane_count = 1;
+    layout->planes[0].stride = pix->bytesperline;
+    layout->planes[0].size   = pix->sizeimage;
+
+    if (layout->format == VCAP_FMT_UNKNOWN)
+        return VCAP_OK;
+
+    const vcap_format_entry* entry = vcap_get_format_entry(layout->format);
+
+    if (entry->bpp == 0 || entry->planes < 2)
+        return VCAP_OK;
+
+    uint32_t chroma_height = (pix->height + entry->v_sub - 1) / entry->v_sub;
+
+    // Semi-planar chroma interleaves Cb and Cr, planar chroma doesn't
+    uint32_t chroma_stride = (entry->planes == 2) ? pix->bytesperline * 2 / entry->h_sub
+                                                  : pix->bytesperline / entry->h_sub;
+
+    layout->plane_count = entry->planes;
+    layout->planes[0].size = (size_t)pix->bytesperline * pix->height;
+
+    for (uint32_t i = 1; i < entry->planes; i++)
+    {
+        layout->planes[i].offset = layout->planes[i - 1].offset + layout->planes[i - 1].size;
+        layout->planes[i].stride = chroma_stride;
+        layout->planes[i].size   = (size_t)chroma_stride * chroma_height;
     }
 
-    return fmt.fmt.pix.sizeimage;
+    return VCAP_OK;
 }
 
 int vcap_capture(vcap_device* vd, size_t image_size, uint8_t* image_data)
@@ -789,6 +1303,33 @@ int vcap_capture(vcap_device* vd, size_t image_size, uint8_t* image_data)
     }
 }
 
+int vcap_get_frame_info(vcap_device* vd, vcap_frame_info* info)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(info != NULL);
+
+    if (!info)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    if (!vd->frame_info_valid)
+        return VCAP_INVALID;
+
+    *info = vd->frame_info;
+
+    return VCAP_OK;
+}
+
 //==============================================================================
 // Iterator functions
 //==============================================================================
@@ -807,6 +1348,25 @@ void vcap_free_iterator(vcap_iterator* itr)
     vcap_free(itr);
 }
 
+void vcap_invalidate_cache(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    vcap_free_format_cache(vd);
+    vcap_free_control_cache(vd);
+
+    vd->fmt_valid = false;
+}
+
+void vcap_set_value_cache(vcap_device* vd, bool enable)
+{
+    assert(vd != NULL);
+
+    vd->value_cache = enable;
+
+    vcap_invalidate_values(vd);
+}
+
 //==============================================================================
 // Format functions
 //==============================================================================
@@ -830,25 +1390,44 @@ int vcap_get_format_info(vcap_device* vd, vcap_format_id fmt, vcap_format_info*
         return VCAP_ERROR;
     }
 
-    // NOTE: Unfortunately there is no V4L2 function that returns information
-    // about a format without enumerating them
+    if (vcap_cache_formats(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
 
-    int result, index = 0;
+    vcap_format_cache* entry = vcap_find_format(vd, fmt);
 
-    do
+    if (!entry)
     {
-        result = vcap_enum_fmts(vd, info, index);
+        vcap_set_error(vd, "Invalid format ID");
+        return VCAP_INVALID;
+    }
 
-        if (result == VCAP_ERROR)
-            return VCAP_ERROR;
+    *info = entry->info;
 
-        if (result == VCAP_OK && info->id == fmt)
-            return VCAP_OK;
+    return VCAP_OK;
+}
+
+int vcap_get_pixel_format(vcap_format_id fmt, vcap_pixel_format* layout)
+{
+    assert(layout != NULL);
+
+    if (!layout || fmt >= VCAP_FMT_COUNT)
+        return VCAP_INVALID;
 
-    } while (result != VCAP_INVALID && ++index);
+    const vcap_format_entry* entry = vcap_get_format_entry(fmt);
 
-    vcap_set_error(vd, "Invalid format ID");
-    return VCAP_INVALID;
+    layout->fourcc        = entry->fourcc;
+    layout->bpp           = entry->bpp;
+    layout->planes        = entry->planes;
+    layout->h_subsampling = entry->h_sub;
+    layout->v_subsampling = entry->v_sub;
+    layout->compressed    = (entry->bpp == 0);
+
+    return VCAP_OK;
+}
+
+vcap_format_id vcap_fourcc_to_format(uint32_t fourcc)
+{
+    return vcap_convert_fmt(fourcc);
 }
 
 vcap_iterator* vcap_format_iterator(vcap_device* vd)
@@ -1037,52 +1616,151 @@ bool vcap_next_rate(vcap_iterator* itr, vcap_rate* rate)
     return true;
 }
 
-int vcap_get_format(vcap_device* vd, vcap_format_id* fmt, vcap_size* size)
+int vcap_get_size_range(vcap_device* vd, vcap_format_id fmt, vcap_size_range* range)
 {
     assert(vd != NULL);
-    assert(vcap_is_open(vd));
+    assert(range != NULL);
 
-    if (!vcap_is_open(vd))
+    if (!range)
     {
-        vcap_set_error(vd, "Device %s must be open", vd->path);
+        vcap_set_error(vd, "Argument can't be null");
         return VCAP_ERROR;
     }
 
-    // Get format
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-fmt.html
-    struct v4l2_format gfmt;
-    VCAP_CLEAR(gfmt);
-
-    gfmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    // Ensure format ID is within the proper range
+    assert(fmt < VCAP_FMT_COUNT);
 
-    if (vcap_ioctl(vd->fd, VIDIOC_G_FMT, &gfmt))
+    if (fmt >= VCAP_FMT_COUNT)
     {
-        vcap_set_error_errno(vd, "Unable to get format on device %s", vd->path);
+        vcap_set_error(vd, "Invalid argument (out of range)");
         return VCAP_ERROR;
     }
 
-    // Get format ID, if requested
-    if (fmt)
-        *fmt = vcap_convert_fmt(gfmt.fmt.pix.pixelformat);
+    if (vcap_cache_formats(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
 
-    // Get size, if requested
-    if (size)
-    {
-        size->width  = gfmt.fmt.pix.width;
-        size->height = gfmt.fmt.pix.height;
-    }
+    vcap_format_cache* entry = vcap_find_format(vd, fmt);
+
+    if (!entry || !entry->has_size_range)
+        return VCAP_INVALID;
+
+    *range = entry->size_range;
 
     return VCAP_OK;
 }
 
-int vcap_set_format(vcap_device* vd, vcap_format_id fmt, vcap_size size)
+int vcap_get_rate_range(vcap_device* vd, vcap_format_id fmt, vcap_size size, vcap_rate_range* range)
 {
     assert(vd != NULL);
-    assert(vcap_is_open(vd));
+    assert(range != NULL);
 
-    if (!vcap_is_open(vd))
+    if (!range)
     {
-        vcap_set_error(vd, "Device %s must be open", vd->path);
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    // Ensure format ID is within the proper range
+    assert(fmt < VCAP_FMT_COUNT);
+
+    if (fmt >= VCAP_FMT_COUNT)
+    {
+        vcap_set_error(vd, "Invalid argument (out of range)");
+        return VCAP_ERROR;
+    }
+
+    if (vcap_cache_formats(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    vcap_format_cache* fmt_entry = vcap_find_format(vd, fmt);
+
+    if (!fmt_entry)
+        return VCAP_INVALID;
+
+    vcap_size_cache* size_entry = vcap_find_size(fmt_entry, size);
+
+    if (size_entry)
+    {
+        if (!size_entry->has_rate_range)
+            return VCAP_INVALID;
+
+        *range = size_entry->rate_range;
+        return VCAP_OK;
+    }
+
+    // Sizes from a size range aren't cached, so their rates are queried
+    if (!fmt_entry->has_size_range || !vcap_size_in_range(&fmt_entry->size_range, size))
+        return VCAP_INVALID;
+
+    vcap_size_cache entry;
+    VCAP_CLEAR(entry);
+
+    entry.size = size;
+
+    int result = vcap_cache_rates(vd, fmt_entry->pixelformat, &entry);
+
+    vcap_free(entry.rates);
+
+    if (result == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    if (!entry.has_rate_range)
+        return VCAP_INVALID;
+
+    *range = entry.rate_range;
+
+    return VCAP_OK;
+}
+
+int vcap_get_format(vcap_device* vd, vcap_format_id* fmt, vcap_size* size)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    // Get format
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-fmt.html
+    struct v4l2_format gfmt;
+    VCAP_CLEAR(gfmt);
+
+    gfmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_G_FMT, &gfmt))
+    {
+        vcap_set_error_errno(vd, "Unable to get format on device %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    vd->fmt = gfmt;
+    vd->fmt_valid = true;
+
+    // Get format ID, if requested
+    if (fmt)
+        *fmt = vcap_convert_fmt(gfmt.fmt.pix.pixelformat);
+
+    // Get size, if requested
+    if (size)
+    {
+        size->width  = gfmt.fmt.pix.width;
+        size->height = gfmt.fmt.pix.height;
+    }
+
+    return VCAP_OK;
+}
+
+int vcap_set_format(vcap_device* vd, vcap_format_id fmt, vcap_size size)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
         return VCAP_ERROR;
     }
 
@@ -1113,10 +1791,15 @@ int vcap_set_format(vcap_device* vd, vcap_format_id fmt, vcap_size size)
 
     if (vcap_ioctl(vd->fd, VIDIOC_S_FMT, &sfmt) == -1)
     {
+        vd->fmt_valid = false;
         vcap_set_error_errno(vd, "Unable to set format on %s", vd->path);
         return VCAP_ERROR;
     }
 
+    // The driver returns the format it actually applied
+    vd->fmt = sfmt;
+    vd->fmt_valid = true;
+
     if (streaming && vcap_start_stream(vd) == VCAP_ERROR)
         return VCAP_ERROR;
 
@@ -1203,11 +1886,7 @@ int vcap_set_rate(vcap_device* vd, vcap_rate rate)
     return VCAP_OK;
 }
 
-//==============================================================================
-// Control Functions
-//==============================================================================
-
-int vcap_get_control_info(vcap_device* vd, vcap_control_id ctrl, vcap_control_info* info)
+int vcap_negotiate(vcap_device* vd, const vcap_format_request* request, vcap_format_choice* choice)
 {
     assert(vd != NULL);
     assert(vcap_is_open(vd));
@@ -1218,73 +1897,194 @@ int vcap_get_control_info(vcap_device* vd, vcap_control_id ctrl, vcap_control_in
         return VCAP_ERROR;
     }
 
-    // Ensure control ID is within the proper range
-    assert(ctrl < VCAP_CTRL_COUNT);
+    assert(request != NULL);
+    assert(choice != NULL);
 
-    if (ctrl >= VCAP_CTRL_COUNT)
+    if (!request || !choice)
     {
-        vcap_set_error(vd, "Invalid argument (out of range)");
+        vcap_set_error(vd, "Argument can't be null");
         return VCAP_ERROR;
     }
 
-    assert(info != NULL);
+    assert(request->format < VCAP_FMT_COUNT);
 
-    if (!info)
+    if (request->format >= VCAP_FMT_COUNT)
     {
-        vcap_set_error(vd, "Argument can't be null");
+        vcap_set_error(vd, "Invalid argument (out of range)");
         return VCAP_ERROR;
     }
 
-    // Query specified control
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-queryctrl.html
-    struct v4l2_queryctrl qctrl;
-    VCAP_CLEAR(qctrl);
+    if (vcap_cache_formats(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
 
-    qctrl.id = vcap_map_ctrl(ctrl);
+    // Collect the cheapest rate of every native format and size that satisfies
+    // the request
+    vcap_format_candidate* candidates = NULL;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
 
-    if (vcap_ioctl(vd->fd, VIDIOC_QUERYCTRL, &qctrl) == -1)
+    for (uint32_t i = 0; i < vd->fmt_count; i++)
     {
-        if (errno == EINVAL)
+        vcap_format_cache* fmt = &vd->fmts[i];
+
+        // Formats emulated by libv4l2 are never delivered by the device
+        if ((fmt->flags & V4L2_FMT_FLAG_EMULATED) || fmt->info.id == VCAP_FMT_UNKNOWN)
+            continue;
+
+        for (uint32_t j = 0; j < fmt->size_count; j++)
         {
-            vcap_set_error(vd, "Invalid control ID");
-            return VCAP_INVALID;
+            if (vcap_add_candidate(vd, request, fmt, &fmt->sizes[j], &candidates, &count, &capacity) == VCAP_ERROR)
+            {
+                vcap_free(candidates);
+                return VCAP_ERROR;
+            }
         }
-        else
+
+        if (fmt->has_size_range &&
+            vcap_add_range_candidate(vd, request, fmt, &candidates, &count, &capacity) == VCAP_ERROR)
         {
-            vcap_set_error_errno(vd, "Unable to read control info on device %s", vd->path);
+            vcap_free(candidates);
             return VCAP_ERROR;
         }
     }
 
-    // Test if control type is supported
-    if (!vcap_ctrl_type_supported(qctrl.type))
+    if (count == 0)
     {
-        vcap_set_error(vd, "Invalid control type");
+        vcap_set_error(vd, "No format on device %s satisfies the request", vd->path);
         return VCAP_INVALID;
     }
 
-    // Copy name
-    vcap_ustrcpy(info->name, qctrl.name, sizeof(info->name));
+    qsort(candidates, count, sizeof(vcap_format_candidate), vcap_compare_candidates);
 
-    // Copy control ID
-    info->id = vcap_convert_ctrl(qctrl.id);
+    // Confirm the cheapest candidate that the driver accepts unchanged
+    bool emulated = false;
+    vcap_format_cache* target = vcap_find_format(vd, request->format);
 
-    // Copy type
-    info->type = vcap_convert_ctrl_type(qctrl.type);
+    if (vd->convert && target && (target->flags & V4L2_FMT_FLAG_EMULATED))
+        emulated = true;
 
-    // Copy type string
-    vcap_ustrcpy(info->type_name, (uint8_t*)vcap_ctrl_type_str(info->type), sizeof(info->type_name));
+    for (uint32_t i = 0; i < count; i++)
+    {
+        vcap_format_candidate* candidate = &candidates[i];
+        vcap_format_id native = candidate->fmt->info.id;
+        vcap_format_id fmt = (native != request->format && emulated) ? request->format : native;
 
-    // Min/Max/Step
-    info->min  = qctrl.minimum;
-    info->max  = qctrl.maximum;
-    info->step = qctrl.step;
+        vcap_format_id actual_fmt;
+        vcap_size actual_size;
+        int result;
 
-    // Default
-    info->default_value = qctrl.default_value;
+        // libv4l2 accepts any emulated format, so ask the driver directly
+        // whether it delivers the native format it would convert from
+        if (fmt != native)
+        {
+            result = vcap_try_native_format(vd, native, candidate->size, &actual_fmt, &actual_size);
 
-    // Slider control hint
-    info->slider = (bool)(qctrl.flags & V4L2_CTRL_FLAG_SLIDER);
+            if (result == VCAP_ERROR)
+            {
+                vcap_free(candidates);
+                return VCAP_ERROR;
+            }
+
+            if (result == VCAP_INVALID || actual_fmt != native ||
+                actual_size.width != candidate->size.width || actual_size.height != candidate->size.height)
+            {
+                continue;
+            }
+        }
+
+        result = vcap_try_format(vd, fmt, candidate->size, &actual_fmt, &actual_size);
+
+        if (result == VCAP_ERROR)
+        {
+            vcap_free(candidates);
+            return VCAP_ERROR;
+        }
+
+        if (result == VCAP_INVALID || actual_fmt != fmt ||
+            actual_size.width != candidate->size.width || actual_size.height != candidate->size.height)
+        {
+            continue;
+        }
+
+        VCAP_CLEAR(*choice);
+
+        choice->format = fmt;
+        choice->native_format = native;
+        choice->size = candidate->size;
+        choice->rate = candidate->rate;
+        choice->cost = candidate->cost;
+
+        int len = snprintf(choice->reason, sizeof(choice->reason),
+                           "%s %ux%u at %u/%u fps: %.1f MB/s, %s",
+                           (const char*)candidate->fmt->info.fourcc, candidate->size.width, candidate->size.height,
+                           candidate->rate.numerator, candidate->rate.denominator, candidate->bandwidth / 1e6,
+                           (native == request->format) ? "no conversion" :
+                           (fmt == native) ? "converted by the caller" : "converted by libv4l2");
+
+        if (i + 1 < count && len > 0 && (size_t)len < sizeof(choice->reason))
+        {
+            const vcap_format_candidate* next = &candidates[i + 1];
+
+            snprintf(choice->reason + len, sizeof(choice->reason) - len,
+                     "; cost %.3g vs %.3g for %s %ux%u at %u/%u fps",
+                     candidate->cost, next->cost, (const char*)next->fmt->info.fourcc,
+                     next->size.width, next->size.height, next->rate.numerator, next->rate.denominator);
+        }
+
+        vcap_free(candidates);
+        return VCAP_OK;
+    }
+
+    vcap_free(candidates);
+
+    vcap_set_error(vd, "Device %s rejected all formats that satisfy the request", vd->path);
+    return VCAP_INVALID;
+}
+
+//==============================================================================
+// Control Functions
+//==============================================================================
+
+int vcap_get_control_info(vcap_device* vd, vcap_control_id ctrl, vcap_control_info* info)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    // Ensure control ID is within the proper range
+    assert(vcap_ctrl_valid(ctrl));
+
+    if (!vcap_ctrl_valid(ctrl))
+    {
+        vcap_set_error(vd, "Invalid argument (out of range)");
+        return VCAP_ERROR;
+    }
+
+    assert(info != NULL);
+
+    if (!info)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    if (vcap_cache_controls(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    vcap_control_cache* entry = vcap_find_control(vd, ctrl);
+
+    if (!entry)
+    {
+        vcap_set_error(vd, "Invalid control ID");
+        return VCAP_INVALID;
+    }
+
+    *info = entry->info;
 
     return VCAP_OK;
 }
@@ -1301,9 +2101,9 @@ int vcap_get_control_status(vcap_device* vd, vcap_control_id ctrl, vcap_control_
     }
 
     // Ensure control ID is within the proper range
-    assert(ctrl < VCAP_CTRL_COUNT);
+    assert(vcap_ctrl_valid(ctrl));
 
-    if (ctrl >= VCAP_CTRL_COUNT)
+    if (!vcap_ctrl_valid(ctrl))
     {
         vcap_set_error(vd, "Invalid argument (out of range)");
         return VCAP_ERROR;
@@ -1348,11 +2148,63 @@ int vcap_get_control_status(vcap_device* vd, vcap_control_id ctrl, vcap_control_
     // Flags
     uint32_t flags = qctrl.flags;
 
-    status->read_only  = (bool)(flags & V4L2_CTRL_FLAG_READ_ONLY);
-    status->write_only = (bool)(flags & V4L2_CTRL_FLAG_WRITE_ONLY);
-    status->disabled   = (bool)(flags & V4L2_CTRL_FLAG_DISABLED);
-    status->inactive   = (bool)(flags & V4L2_CTRL_FLAG_INACTIVE) ||
-                         (bool)(flags & V4L2_CTRL_FLAG_GRABBED);
+    // Keep cached flags up to date
+    vcap_control_cache* entry = vcap_find_control(vd, ctrl);
+
+    if (entry)
+        entry->flags = flags;
+
+    vcap_flags_to_status(flags, status);
+
+    return VCAP_OK;
+}
+
+int vcap_get_control_statuses(vcap_device* vd, const vcap_control_id* ctrls, vcap_control_status* statuses, uint32_t count)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(ctrls != NULL);
+    assert(statuses != NULL);
+
+    if (!ctrls || !statuses)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    if (vcap_cache_controls(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    // Writing a control that affects others doesn't notify the writing handle
+    bool refreshed = vd->ctrl_flags_stale;
+
+    if (refreshed && vcap_refresh_control_flags(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        vcap_control_cache* entry = vcap_find_control(vd, ctrls[i]);
+
+        if (!entry)
+        {
+            vcap_set_error(vd, "Invalid control ID");
+            return VCAP_INVALID;
+        }
+
+        // Flags change on their own (e.g. auto modes, other handles), so
+        // cached flags are only current if control events update them
+        if (!refreshed && !entry->subscribed && vcap_query_control_flags(vd, entry) == VCAP_ERROR)
+            return VCAP_ERROR;
+
+        vcap_flags_to_status(entry->flags, &statuses[i]);
+    }
 
     return VCAP_OK;
 }
@@ -1370,7 +2222,11 @@ vcap_iterator* vcap_control_iterator(vcap_device* vd)
 
     vcap_iterator* itr = (vcap_iterator*)vcap_malloc(sizeof(vcap_iterator));
 
-    //FIXME Set error and return NULL if null
+    if (!itr)
+    {
+        vcap_set_error(vd, "Out of memory while allocating iterator");
+        return NULL;
+    }
 
     itr->type = VCAP_ITR_TYPE_CTRL;
     itr->vd = vd;
@@ -1380,17 +2236,39 @@ vcap_iterator* vcap_control_iterator(vcap_device* vd)
     return itr;
 }
 
-bool vcap_next_control(vcap_iterator* itr, vcap_control_info* info)
+int vcap_enum_control(vcap_device* vd, uint32_t index, vcap_control_info* info)
 {
-    assert(itr != NULL);
-    assert(vcap_is_open(itr->vd));
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
 
-    if (!vcap_is_open(itr->vd))
+    if (!vcap_is_open(vd))
     {
-        vcap_set_error(itr->vd, "Device %s must be open", itr->vd->path);
-        itr->result = VCAP_ERROR;
-        return false;
-    }
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(info != NULL);
+
+    if (!info)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    return vcap_enum_ctrls(vd, info, index);
+}
+
+bool vcap_next_control(vcap_iterator* itr, vcap_control_info* info)
+{
+    assert(itr != NULL);
+    assert(vcap_is_open(itr->vd));
+
+    if (!vcap_is_open(itr->vd))
+    {
+        vcap_set_error(itr->vd, "Device %s must be open", itr->vd->path);
+        itr->result = VCAP_ERROR;
+        return false;
+    }
 
     assert(itr->type == VCAP_ITR_TYPE_CTRL);
 
@@ -1494,9 +2372,9 @@ int vcap_get_control(vcap_device* vd, vcap_control_id ctrl, int32_t* value)
     }
 
     // Ensure control ID is within the proper range
-    assert(ctrl < VCAP_CTRL_COUNT);
+    assert(vcap_ctrl_valid(ctrl));
 
-    if (ctrl >= VCAP_CTRL_COUNT)
+    if (!vcap_ctrl_valid(ctrl))
     {
         vcap_set_error(vd, "Invalid argument (out of range)");
         return VCAP_ERROR;
@@ -1510,6 +2388,25 @@ int vcap_get_control(vcap_device* vd, vcap_control_id ctrl, int32_t* value)
         return VCAP_ERROR;
     }
 
+    vcap_control_cache* entry = NULL;
+
+    if (vd->value_cache)
+    {
+        if (vcap_cache_controls(vd) == VCAP_ERROR)
+            return VCAP_ERROR;
+
+        entry = vcap_find_control(vd, ctrl);
+
+        vcap_sync_writer(vd);
+
+        // Serve repeated reads from the value cache
+        if (entry && entry->value_valid && vcap_value_cacheable(vd, entry))
+        {
+            *value = entry->value;
+            return VCAP_OK;
+        }
+    }
+
     // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-ctrl.html
     struct v4l2_control gctrl;
     VCAP_CLEAR(gctrl);
@@ -1524,6 +2421,9 @@ int vcap_get_control(vcap_device* vd, vcap_control_id ctrl, int32_t* value)
 
     *value = gctrl.value;
 
+    if (entry)
+        vcap_store_value(vd, entry, gctrl.value, false);
+
     return VCAP_OK;
 }
 
@@ -1539,14 +2439,30 @@ int vcap_set_control(vcap_device* vd, vcap_control_id ctrl, int32_t value)
     }
 
     // Ensure control ID is within the proper range
-    assert(ctrl < VCAP_CTRL_COUNT);
+    assert(vcap_ctrl_valid(ctrl));
 
-    if (ctrl >= VCAP_CTRL_COUNT)
+    if (!vcap_ctrl_valid(ctrl))
     {
         vcap_set_error(vd, "Invalid argument (out of range)");
         return VCAP_ERROR;
     }
 
+    vcap_control_cache* entry = NULL;
+
+    if (vd->value_cache)
+    {
+        if (vcap_cache_controls(vd) == VCAP_ERROR)
+            return VCAP_ERROR;
+
+        entry = vcap_find_control(vd, ctrl);
+
+        vcap_sync_writer(vd);
+
+        // Skip writes that wouldn't change anything
+        if (entry && entry->value_valid && entry->value == value && vcap_value_cacheable(vd, entry))
+            return VCAP_OK;
+    }
+
     // Specify control and value
     // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-ctrl.html
     struct v4l2_control sctrl;
@@ -1558,13 +2474,66 @@ int vcap_set_control(vcap_device* vd, vcap_control_id ctrl, int32_t value)
     // Set control
     if (vcap_ioctl(vd->fd, VIDIOC_S_CTRL, &sctrl) == -1)
     {
+        // The driver may have applied part of the change
+        if (entry)
+            entry->value_valid = false;
+
         vcap_set_error_errno(vd, "Could not set control (%d) value on device %s", ctrl, vd->path);
         return VCAP_ERROR;
     }
 
+    // The driver returns the value actually set (e.g. rounded to the step)
+    if (entry)
+        vcap_store_value(vd, entry, sctrl.value, true);
+
+    vcap_note_write(vd, entry ? entry : vcap_find_control(vd, ctrl));
+
     return VCAP_OK;
 }
 
+int vcap_get_controls(vcap_device* vd, vcap_control_value* ctrls, uint32_t count, uint32_t* error_index)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    return vcap_ext_ctrls(vd, VIDIOC_G_EXT_CTRLS, ctrls, count, error_index);
+}
+
+int vcap_set_controls(vcap_device* vd, const vcap_control_value* ctrls, uint32_t count, uint32_t* error_index)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    // NOTE: Values are only read when setting controls
+    return vcap_ext_ctrls(vd, VIDIOC_S_EXT_CTRLS, (vcap_control_value*)ctrls, count, error_index);
+}
+
+int vcap_try_controls(vcap_device* vd, vcap_control_value* ctrls, uint32_t count, uint32_t* error_index)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    return vcap_ext_ctrls(vd, VIDIOC_TRY_EXT_CTRLS, ctrls, count, error_index);
+}
+
 int vcap_reset_control(vcap_device* vd, vcap_control_id ctrl)
 {
     assert(vd != NULL);
@@ -1619,10 +2588,22 @@ int vcap_reset_all_controls(vcap_device* vd)
         return VCAP_ERROR;
     }
 
-    // Loop over all controlsa
-    for (vcap_control_id ctrl = 0; ctrl < VCAP_CTRL_COUNT; ctrl++)
+    if (vcap_cache_controls(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    // Fast path: write all defaults in a single batch
+    if (vcap_reset_controls_batch(vd) == VCAP_OK)
+        return VCAP_OK;
+
+    // Fall back to resetting controls one at a time if the batch failed (e.g.
+    // a driver rejected one of the controls)
+    for (uint32_t i = 0; i < vd->ctrl_count; i++)
     {
-        int result = vcap_reset_control(vd, ctrl);
+        // Buttons perform an action rather than hold a value
+        if (vd->ctrls[i].info.type == VCAP_CTRL_TYPE_BUTTON)
+            continue;
+
+        int result = vcap_reset_control(vd, vd->ctrls[i].info.id);
 
         if (result == VCAP_ERROR)
             return VCAP_ERROR;
@@ -1634,11 +2615,7 @@ int vcap_reset_all_controls(vcap_device* vd)
     return VCAP_OK;
 }
 
-//==============================================================================
-// Crop functions
-//==============================================================================
-
-int vcap_get_crop_bounds(vcap_device* vd, vcap_rect* rect)
+int vcap_start_control_writer(vcap_device* vd)
 {
     assert(vd != NULL);
     assert(vcap_is_open(vd));
@@ -1649,82 +2626,79 @@ int vcap_get_crop_bounds(vcap_device* vd, vcap_rect* rect)
         return VCAP_ERROR;
     }
 
-    assert(rect != NULL);
+    if (vd->writer)
+        return VCAP_OK;
 
-    if (!rect)
+    vcap_control_writer* writer = (vcap_control_writer*)vcap_malloc(sizeof(vcap_control_writer));
+
+    if (!writer)
     {
-        vcap_set_error(vd, "Argument can't be null");
+        vcap_set_error(vd, "Out of memory while starting control writer on device %s", vd->path);
         return VCAP_ERROR;
     }
 
-    // Get crop rectangle
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-cropcap.html
-    struct v4l2_cropcap cropcap;
-    VCAP_CLEAR(cropcap);
+    memset(writer, 0, sizeof(vcap_control_writer));
 
-    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    writer->fd = vd->fd;
+    writer->running = true;
 
-    if (vcap_ioctl(vd->fd, VIDIOC_CROPCAP, &cropcap) == -1)
+    // Signals completion events to the event fd
+    writer->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (writer->done_fd == -1)
     {
-        if (errno == ENODATA || errno == EINVAL)
-        {
-            vcap_set_error(vd, "Cropping is not supported on device '%s'", vd->path);
-            return VCAP_ERROR;
-        }
+        vcap_set_error_errno(vd, "Unable to create event fd for device %s", vd->path);
+        vcap_free(writer);
+        return VCAP_ERROR;
     }
 
-    // Copy rectangle bounds
-    rect->top = cropcap.bounds.top;
-    rect->left = cropcap.bounds.left;
-    rect->width = cropcap.bounds.width;
-    rect->height = cropcap.bounds.height;
-
-    return VCAP_OK;
-}
-
-int vcap_reset_crop(vcap_device* vd)
-{
-    assert(vd != NULL);
-    assert(vcap_is_open(vd));
+    // Expires at the earliest deadline of the asynchronous writes
+    writer->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 
-    if (!vcap_is_open(vd))
+    if (writer->timer_fd == -1)
     {
-        vcap_set_error(vd, "Device %s must be open", vd->path);
+        vcap_set_error_errno(vd, "Unable to create timer for device %s", vd->path);
+        close(writer->done_fd);
+        vcap_free(writer);
         return VCAP_ERROR;
     }
 
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-cropcap.html
-    struct v4l2_cropcap cropcap;
-    VCAP_CLEAR(cropcap);
-
-    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-    if (vcap_ioctl(vd->fd, VIDIOC_CROPCAP, &cropcap) == -1)
+    if (vd->event_fd >= 0 && vcap_watch_writer(vd->event_fd, writer) == -1)
     {
-        if (errno == ENODATA || errno == EINVAL)
-        {
-            vcap_set_error(vd, "Cropping is not supported on device '%s'", vd->path);
-            return VCAP_ERROR;
-        }
+        vcap_set_error_errno(vd, "Unable to watch events on device %s", vd->path);
+        close(writer->timer_fd);
+        close(writer->done_fd);
+        vcap_free(writer);
+        return VCAP_ERROR;
     }
 
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-crop.html
-    struct v4l2_crop crop;
-    VCAP_CLEAR(crop);
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->wake, NULL);
+    pthread_cond_init(&writer->idle, NULL);
 
-    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    crop.c = cropcap.defrect;
+    int error = pthread_create(&writer->thread, NULL, vcap_control_writer_main, writer);
 
-    if (vcap_ioctl(vd->fd, VIDIOC_S_CROP, &crop) == -1)
+    if (error != 0)
     {
-        vcap_set_error_errno(vd, "Unable to set crop window on device '%s'", vd->path);
+        errno = error;
+        vcap_set_error_errno(vd, "Unable to start control writer on device %s", vd->path);
+
+        pthread_cond_destroy(&writer->idle);
+        pthread_cond_destroy(&writer->wake);
+        pthread_mutex_destroy(&writer->mutex);
+        close(writer->timer_fd);
+        close(writer->done_fd);
+        vcap_free(writer);
+
         return VCAP_ERROR;
     }
 
+    vd->writer = writer;
+
     return VCAP_OK;
 }
 
-int vcap_get_crop(vcap_device* vd, vcap_rect* rect)
+int vcap_queue_control(vcap_device* vd, vcap_control_id ctrl, int32_t value)
 {
     assert(vd != NULL);
     assert(vcap_is_open(vd));
@@ -1735,43 +2709,16 @@ int vcap_get_crop(vcap_device* vd, vcap_rect* rect)
         return VCAP_ERROR;
     }
 
-    assert(rect != NULL);
-
-    if (!rect)
+    if (!vd->writer)
     {
-        vcap_set_error(vd, "Argument can't be null");
+        vcap_set_error(vd, "Control writer on device %s must be started", vd->path);
         return VCAP_ERROR;
     }
 
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-crop.html
-    struct v4l2_crop crop;
-    VCAP_CLEAR(crop);
-
-    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-    if (vcap_ioctl(vd->fd, VIDIOC_G_CROP, &crop) == -1)
-    {
-        if (errno == ENODATA || errno == EINVAL)
-        {
-            vcap_set_error(vd, "Cropping is not supported on device %s", vd->path);
-            return VCAP_ERROR;
-        }
-        else
-        {
-            vcap_set_error(vd, "Unable to get crop window on device %s", vd->path);
-            return VCAP_ERROR;
-        }
-    }
-
-    rect->top = crop.c.top;
-    rect->left = crop.c.left;
-    rect->width = crop.c.width;
-    rect->height = crop.c.height;
-
-    return VCAP_OK;
+    return vcap_queue_control_value(vd, ctrl, value, false);
 }
 
-int vcap_set_crop(vcap_device* vd, vcap_rect rect)
+int vcap_set_control_async(vcap_device* vd, vcap_control_id ctrl, int32_t value)
 {
     assert(vd != NULL);
     assert(vcap_is_open(vd));
@@ -1782,441 +2729,4227 @@ int vcap_set_crop(vcap_device* vd, vcap_rect rect)
         return VCAP_ERROR;
     }
 
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-crop.html
-    struct v4l2_crop crop;
-    VCAP_CLEAR(crop);
+    if (vcap_start_control_writer(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
 
-    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    crop.c.left = rect.left;
-    crop.c.top = rect.top;
-    crop.c.width = rect.width;
-    crop.c.height = rect.height;
+    if (vcap_cache_controls(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
 
-    if (vcap_ioctl(vd->fd, VIDIOC_S_CROP, &crop) == -1)
+    vcap_control_cache* entry = vcap_ctrl_valid(ctrl) ? vcap_find_control(vd, ctrl) : NULL;
+
+    if (!entry)
     {
-        if (errno == ENODATA || errno == EINVAL)
-        {
-            vcap_set_error(vd, "Cropping is not supported on device %s", vd->path);
-            return VCAP_ERROR;
-        }
-        else
-        {
-            vcap_set_error(vd, "Unable to set crop window on device %s", vd->path);
-            return VCAP_ERROR;
-        }
+        vcap_set_error(vd, "Invalid control ID (%u)", ctrl);
+        return VCAP_INVALID;
     }
 
-    return VCAP_OK;
-}
-
-//==============================================================================
-// Internal Functions
-//==============================================================================
-
-void* vcap_malloc(size_t size)
-{
-    return global_malloc_fp(size);
-}
+    // Drivers with asynchronous controls (e.g. UVC) signal completion with a
+    // control event, which is only sent to the writing file handle with
+    // feedback enabled. Resubscribing drops pending events of this control.
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-subscribe-event.html
+    if (!entry->feedback)
+    {
+        struct v4l2_event_subscription sub;
+        VCAP_CLEAR(sub);
 
-void vcap_free(void* ptr)
-{
-    global_free_fp(ptr);
-}
+        sub.type = V4L2_EVENT_CTRL;
+        sub.id   = entry->v4l2_id;
 
-static void vcap_fourcc_str(uint32_t code, uint8_t* str)
-{
-    assert(str);
+        vcap_ioctl(vd->fd, VIDIOC_UNSUBSCRIBE_EVENT, &sub);
 
-    str[0] = (code >> 0) & 0xFF;
-    str[1] = (code >> 8) & 0xFF;
-    str[2] = (code >> 16) & 0xFF;
-    str[3] = (code >> 24) & 0xFF;
-    str[4] = '\0';
-}
+        sub.flags = V4L2_EVENT_SUB_FL_ALLOW_FEEDBACK;
 
-static int vcap_ioctl(int fd, long unsigned request, void *arg)
-{
-    assert(arg != NULL);
+        // Without events, a write is complete once the driver returns
+        entry->feedback = (vcap_ioctl(vd->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == 0);
+        entry->subscribed = entry->feedback;
+    }
 
-    int result;
+    // A newer value replaces a pending write of the same control
+    uint32_t i = 0;
 
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/func-ioctl.html#func-ioctl
+    while (i < vd->wait_count && vd->waits[i].id != ctrl)
+        i++;
 
-    do
+    if (i == VCAP_WRITER_SLOT_COUNT)
     {
-        result = v4l2_ioctl(fd, (int)request, arg);
+        vcap_set_error(vd, "Too many pending controls on device %s", vd->path);
+        return VCAP_ERROR;
     }
-    while (result == -1 && (errno == EINTR || errno == EAGAIN));
 
-    return result;
-}
+    int result = vcap_queue_control_value(vd, ctrl, value, true);
 
-static int vcap_query_caps(const char* path, struct v4l2_capability* caps)
-{
-    assert(path != NULL);
-    assert(caps != NULL);
+    if (result != VCAP_OK)
+        return result;
 
-    struct stat st;
-    int fd = -1;
+    if (i == vd->wait_count)
+        vd->wait_count++;
 
-    // Device must exist
-    if (stat(path, &st) == -1)
-       return VCAP_ERROR;
+    vcap_async_wait* wait = &vd->waits[i];
 
-    // Device must be a character device
-    if (!S_ISCHR(st.st_mode))
-        return VCAP_ERROR;
+    wait->id         = ctrl;
+    wait->value      = value;
+    wait->written    = false;
+    wait->event_seen = false;
+    wait->deadline   = vcap_monotonic_ms() + VCAP_ASYNC_TIMEOUT_MS;
 
-    // Open the video device
-    fd = v4l2_open(path, O_RDWR | O_NONBLOCK, 0);
+    vcap_arm_async_timer(vd);
+
+    return VCAP_OK;
+}
+
+int vcap_flush_controls(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    vcap_control_writer* writer = vd->writer;
+
+    if (!writer)
+        return VCAP_OK;
+
+    pthread_mutex_lock(&writer->mutex);
+
+    while (writer->pending_count > 0 || writer->busy)
+        pthread_cond_wait(&writer->idle, &writer->mutex);
+
+    // Report the first error since the last flush
+    bool failed = writer->failed;
+
+    if (failed)
+        vcap_set_error(vd, "%s", writer->error_msg);
+
+    writer->failed = false;
+
+    pthread_mutex_unlock(&writer->mutex);
+
+    return failed ? VCAP_ERROR : VCAP_OK;
+}
+
+int vcap_stop_control_writer(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    vcap_control_writer* writer = vd->writer;
+
+    if (!writer)
+        return VCAP_OK;
+
+    // The writer applies the remaining values before exiting
+    pthread_mutex_lock(&writer->mutex);
+    writer->running = false;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->mutex);
+
+    pthread_join(writer->thread, NULL);
+
+    // Keep completion events that weren't collected yet
+    vcap_collect_completions(vd);
+
+    int result = VCAP_OK;
+
+    if (writer->failed)
+    {
+        vcap_set_error(vd, "%s", writer->error_msg);
+        result = VCAP_ERROR;
+    }
+
+    pthread_cond_destroy(&writer->idle);
+    pthread_cond_destroy(&writer->wake);
+    pthread_mutex_destroy(&writer->mutex);
+
+    // Closing the fds also removes them from the event fd
+    close(writer->timer_fd);
+    close(writer->done_fd);
+    vcap_free(writer);
+
+    vd->writer = NULL;
+
+    return result;
+}
+
+//==============================================================================
+// Event Functions
+//==============================================================================
+
+int vcap_get_event_fd(vcap_device* vd)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return -1;
+    }
+
+    if (vd->event_fd >= 0)
+        return vd->event_fd;
+
+    // V4L2 signals pending events with POLLPRI. Wrap the device in an epoll
+    // instance so that applications can simply wait for the fd to be readable.
+    int fd = epoll_create1(EPOLL_CLOEXEC);
 
     if (fd == -1)
+    {
+        vcap_set_error_errno(vd, "Unable to create event fd for device %s", vd->path);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    VCAP_CLEAR(ev);
+
+    ev.events = EPOLLPRI;
+    ev.data.fd = vd->fd;
+
+    if (epoll_ctl(fd, EPOLL_CTL_ADD, vd->fd, &ev) == -1)
+    {
+        vcap_set_error_errno(vd, "Unable to watch events on device %s", vd->path);
+        close(fd);
+        return -1;
+    }
+
+    // Events that were already taken from the driver (e.g. by vcap_capture)
+    // wait in an internal queue, which is signaled through an eventfd
+    int notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (notify_fd == -1)
+    {
+        vcap_set_error_errno(vd, "Unable to create event fd for device %s", vd->path);
+        close(fd);
+        return -1;
+    }
+
+    VCAP_CLEAR(ev);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = notify_fd;
+
+    if (epoll_ctl(fd, EPOLL_CTL_ADD, notify_fd, &ev) == -1)
+    {
+        vcap_set_error_errno(vd, "Unable to watch events on device %s", vd->path);
+        close(notify_fd);
+        close(fd);
+        return -1;
+    }
+
+    // Completion events of asynchronous control writes
+    if (vd->writer)
+    {
+        if (vcap_watch_writer(fd, vd->writer) == -1)
+        {
+            vcap_set_error_errno(vd, "Unable to watch events on device %s", vd->path);
+            close(notify_fd);
+            close(fd);
+            return -1;
+        }
+    }
+
+    vd->event_fd = fd;
+    vd->notify_fd = notify_fd;
+    vd->notified = false;
+
+    vcap_update_notify(vd);
+
+    return fd;
+}
+
+int vcap_subscribe_control_events(vcap_device* vd, vcap_control_id ctrl)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
         return VCAP_ERROR;
+    }
 
-    // Obtain device capabilities
-    if (vcap_ioctl(fd, VIDIOC_QUERYCAP, caps) == -1)
+    // Ensure control ID is within the proper range
+    assert(vcap_ctrl_valid(ctrl));
+
+    if (!vcap_ctrl_valid(ctrl))
     {
-        v4l2_close(fd);
+        vcap_set_error(vd, "Invalid argument (out of range)");
+        return VCAP_ERROR;
+    }
+
+    if (vcap_cache_controls(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    vcap_control_cache* entry = vcap_find_control(vd, ctrl);
+
+    if (!entry)
+    {
+        vcap_set_error(vd, "Invalid control ID");
+        return VCAP_INVALID;
+    }
+
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-subscribe-event.html
+    struct v4l2_event_subscription sub;
+    VCAP_CLEAR(sub);
+
+    sub.type = V4L2_EVENT_CTRL;
+    sub.id   = entry->v4l2_id;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == -1)
+    {
+        vcap_set_error_errno(vd, "Unable to subscribe to control (%u) events on device %s", ctrl, vd->path);
+        return VCAP_ERROR;
+    }
+
+    entry->subscribed = true;
+
+    return VCAP_OK;
+}
+
+int vcap_subscribe_all_control_events(vcap_device* vd)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    if (vcap_cache_controls(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    for (uint32_t i = 0; i < vd->ctrl_count; i++)
+    {
+        if (vcap_subscribe_control_events(vd, vd->ctrls[i].info.id) != VCAP_OK)
+            return VCAP_ERROR;
+    }
+
+    return VCAP_OK;
+}
+
+int vcap_subscribe_source_events(vcap_device* vd, bool auto_renegotiate)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    // Source change events are subscribed per input
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-input.html
+    int input = 0;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_G_INPUT, &input) == -1)
+        input = 0;
+
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-subscribe-event.html
+    struct v4l2_event_subscription sub;
+    VCAP_CLEAR(sub);
+
+    sub.type = V4L2_EVENT_SOURCE_CHANGE;
+    sub.id   = (uint32_t)input;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == -1)
+    {
+        vcap_set_error_errno(vd, "Unable to subscribe to source change events on device %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    VCAP_CLEAR(sub);
+
+    sub.type = V4L2_EVENT_EOS;
+
+    // Not every driver generates end-of-stream events
+    if (vcap_ioctl(vd->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == -1 && errno != EINVAL)
+    {
+        vcap_set_error_errno(vd, "Unable to subscribe to end-of-stream events on device %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    vd->source_events = true;
+    vd->auto_renegotiate = auto_renegotiate;
+
+    return VCAP_OK;
+}
+
+int vcap_renegotiate(vcap_device* vd)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    bool streaming = vcap_is_streaming(vd);
+
+    if (streaming && vcap_stop_stream(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    vd->fmt_valid = false;
+
+    // Lock onto the new timings of digital video sources (e.g. HDMI)
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-query-dv-timings.html
+    struct v4l2_dv_timings timings;
+    VCAP_CLEAR(timings);
+
+    if (vcap_ioctl(vd->fd, VIDIOC_QUERY_DV_TIMINGS, &timings) == 0)
+    {
+        if (vcap_ioctl(vd->fd, VIDIOC_S_DV_TIMINGS, &timings) == -1)
+        {
+            vcap_set_error_errno(vd, "Unable to set DV timings on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+    else if (errno == ENOLINK || errno == ENOLCK)
+    {
+        vcap_set_error_errno(vd, "No stable signal on device %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    // The driver adjusts the format to the new source, keep the pixel format
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-fmt.html
+    struct v4l2_format fmt;
+    VCAP_CLEAR(fmt);
+
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_G_FMT, &fmt) == -1)
+    {
+        vcap_set_error_errno(vd, "Unable to get format on device %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    if (vcap_ioctl(vd->fd, VIDIOC_S_FMT, &fmt) == -1)
+    {
+        vcap_set_error_errno(vd, "Unable to set format on %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    vd->fmt = fmt;
+    vd->fmt_valid = true;
+
+    // Frame sizes and rates may differ for the new source
+    vcap_free_format_cache(vd);
+
+    if (streaming && vcap_start_stream(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    return VCAP_OK;
+}
+
+int vcap_unsubscribe_events(vcap_device* vd)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-subscribe-event.html
+    struct v4l2_event_subscription sub;
+    VCAP_CLEAR(sub);
+
+    sub.type = V4L2_EVENT_ALL;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_UNSUBSCRIBE_EVENT, &sub) == -1)
+    {
+        vcap_set_error_errno(vd, "Unable to unsubscribe from events on device %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    // Cached flags are no longer kept current by control events
+    for (uint32_t i = 0; i < vd->ctrl_count; i++)
+    {
+        vd->ctrls[i].feedback = false;
+        vd->ctrls[i].subscribed = false;
+    }
+
+    return VCAP_OK;
+}
+
+int vcap_dequeue_event(vcap_device* vd, vcap_event* event)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(event != NULL);
+
+    if (!event)
+    {
+        vcap_set_error(vd, "Argument can't be null");
         return VCAP_ERROR;
     }
 
-    // Ensure video capture is supported
-    if (!(caps->capabilities & V4L2_CAP_VIDEO_CAPTURE))
+    // Events taken from the driver earlier are returned first
+    vcap_collect_completions(vd);
+
+    if (vcap_pop_event(vd, event))
+        return VCAP_OK;
+
+    while (true)
+    {
+        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-dqevent.html
+        struct v4l2_event ev;
+        VCAP_CLEAR(ev);
+
+        if (vcap_ioctl(vd->fd, VIDIOC_DQEVENT, &ev) == -1)
+        {
+            // No events pending
+            if (errno == ENOENT)
+                return VCAP_INVALID;
+
+            vcap_set_error_errno(vd, "Unable to dequeue event on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+
+        // Skip events that Vcap doesn't know about
+        if (vcap_convert_event(vd, &ev, event))
+            return VCAP_OK;
+    }
+}
+
+//==============================================================================
+// Snapshot functions
+//==============================================================================
+
+int vcap_capture_snapshot(vcap_device* vd, vcap_snapshot* snapshot)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(snapshot != NULL);
+
+    if (!snapshot)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    VCAP_CLEAR(*snapshot);
+
+    snapshot->magic   = VCAP_SNAPSHOT_MAGIC;
+    snapshot->version = VCAP_SNAPSHOT_VERSION;
+
+    if (vcap_get_format(vd, &snapshot->format_id, &snapshot->size) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    if (vcap_get_rate(vd, &snapshot->rate) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    if (vcap_cache_controls(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    // Statuses come from the cache, unless a control that affects other
+    // controls was set since they were read
+    if (vd->ctrl_flags_stale && vcap_refresh_control_flags(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    // Same selection as the settings export
+    for (uint32_t i = 0; i < vd->ctrl_count; i++)
+    {
+        const vcap_control_cache* entry = &vd->ctrls[i];
+
+        if (entry->info.type == VCAP_CTRL_TYPE_BUTTON)
+            continue;
+
+        if (entry->flags & (V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_WRITE_ONLY |
+                            V4L2_CTRL_FLAG_DISABLED | V4L2_CTRL_FLAG_INACTIVE))
+            continue;
+
+        // Keep counting to report the number of controls required
+        if (snapshot->control_count < VCAP_SNAPSHOT_MAX_CONTROLS)
+            snapshot->controls[snapshot->control_count].id = entry->info.id;
+
+        snapshot->control_count++;
+    }
+
+    if (snapshot->control_count > VCAP_SNAPSHOT_MAX_CONTROLS)
+    {
+        vcap_set_error(vd, "Snapshot of device %s requires %u controls (maximum %u)",
+                       vd->path, snapshot->control_count, VCAP_SNAPSHOT_MAX_CONTROLS);
+        return VCAP_INVALID;
+    }
+
+    return vcap_get_controls(vd, snapshot->controls, snapshot->control_count, NULL);
+}
+
+int vcap_apply_snapshot(vcap_device* vd, const vcap_snapshot* snapshot)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(snapshot != NULL);
+
+    if (!snapshot)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    if (snapshot->magic != VCAP_SNAPSHOT_MAGIC || snapshot->version != VCAP_SNAPSHOT_VERSION ||
+        snapshot->control_count > VCAP_SNAPSHOT_MAX_CONTROLS)
+    {
+        vcap_set_error(vd, "Invalid snapshot");
+        return VCAP_INVALID;
+    }
+
+    // Setting the format restarts the stream, skip it if nothing changes
+    vcap_format_id fmt;
+    vcap_size size;
+
+    if (vcap_get_format(vd, &fmt, &size) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    if (fmt != snapshot->format_id || size.width != snapshot->size.width || size.height != snapshot->size.height)
+    {
+        if (vcap_set_format(vd, snapshot->format_id, snapshot->size) == VCAP_ERROR)
+            return VCAP_ERROR;
+    }
+
+    vcap_rate rate;
+
+    if (vcap_get_rate(vd, &rate) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    if ((uint64_t)rate.numerator * snapshot->rate.denominator != (uint64_t)snapshot->rate.numerator * rate.denominator)
+    {
+        if (vcap_set_rate(vd, snapshot->rate) == VCAP_ERROR)
+            return VCAP_ERROR;
+    }
+
+    if (vcap_set_controls(vd, snapshot->controls, snapshot->control_count, NULL) == VCAP_OK)
+        return VCAP_OK;
+
+    // Fall back to writing controls one at a time
+    for (uint32_t i = 0; i < snapshot->control_count; i++)
+    {
+        if (vcap_set_control(vd, snapshot->controls[i].id, snapshot->controls[i].value) == VCAP_ERROR)
+            return VCAP_ERROR;
+    }
+
+    return VCAP_OK;
+}
+
+size_t vcap_snapshot_size(const vcap_snapshot* snapshot)
+{
+    assert(snapshot != NULL);
+
+    uint32_t count = snapshot->control_count;
+
+    if (count > VCAP_SNAPSHOT_MAX_CONTROLS)
+        count = VCAP_SNAPSHOT_MAX_CONTROLS;
+
+    return offsetof(vcap_snapshot, controls) + count * sizeof(vcap_control_value);
+}
+
+int vcap_load_snapshot(vcap_snapshot* snapshot, const void* data, size_t size)
+{
+    assert(snapshot != NULL);
+    assert(data != NULL);
+
+    const size_t header_size = offsetof(vcap_snapshot, controls);
+
+    if (!snapshot || !data || size < header_size || size > sizeof(vcap_snapshot))
+        return VCAP_INVALID;
+
+    vcap_snapshot header;
+    memcpy(&header, data, header_size);
+
+    if (header.magic != VCAP_SNAPSHOT_MAGIC || header.version != VCAP_SNAPSHOT_VERSION ||
+        header.control_count > VCAP_SNAPSHOT_MAX_CONTROLS)
+        return VCAP_INVALID;
+
+    if (size != header_size + header.control_count * sizeof(vcap_control_value))
+        return VCAP_INVALID;
+
+    VCAP_CLEAR(*snapshot);
+    memcpy(snapshot, data, size);
+
+    return VCAP_OK;
+}
+
+//==============================================================================
+// Preset functions
+//==============================================================================
+
+vcap_preset* vcap_create_preset(vcap_device* vd, const vcap_snapshot* snapshot)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return NULL;
+    }
+
+    assert(snapshot != NULL);
+
+    if (!snapshot)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return NULL;
+    }
+
+    if (snapshot->magic != VCAP_SNAPSHOT_MAGIC || snapshot->version != VCAP_SNAPSHOT_VERSION ||
+        snapshot->control_count > VCAP_SNAPSHOT_MAX_CONTROLS)
+    {
+        vcap_set_error(vd, "Invalid snapshot");
+        return NULL;
+    }
+
+    // Validate the format and frame size
+    if (vcap_cache_formats(vd) == VCAP_ERROR)
+        return NULL;
+
+    vcap_format_cache* fmt = vcap_find_format(vd, snapshot->format_id);
+
+    if (!fmt)
+    {
+        vcap_set_error(vd, "Format (%u) is not supported by device %s", snapshot->format_id, vd->path);
+        return NULL;
+    }
+
+    // Only enumerated frame sizes can be checked
+    bool in_range = fmt->has_size_range && vcap_size_in_range(&fmt->size_range, snapshot->size);
+
+    if ((fmt->size_count > 0 || fmt->has_size_range) && !in_range && !vcap_find_size(fmt, snapshot->size))
+    {
+        vcap_set_error(vd, "Frame size %ux%u is not supported by device %s",
+                       snapshot->size.width, snapshot->size.height, vd->path);
+        return NULL;
+    }
+
+    if (snapshot->rate.numerator == 0 || snapshot->rate.denominator == 0)
+    {
+        vcap_set_error(vd, "Invalid frame rate");
+        return NULL;
+    }
+
+    if (vcap_cache_controls(vd) == VCAP_ERROR)
+        return NULL;
+
+    vcap_preset* preset = (vcap_preset*)vcap_malloc(sizeof(vcap_preset));
+
+    if (!preset)
+    {
+        vcap_set_error(vd, "Out of memory while creating preset");
+        return NULL;
+    }
+
+    memset(preset, 0, sizeof(vcap_preset));
+
+    preset->vd        = vd;
+    preset->format_id = snapshot->format_id;
+    preset->size      = snapshot->size;
+    preset->rate      = snapshot->rate;
+
+    // Resolve controls once, so applying is a single ioctl
+    for (uint32_t i = 0; i < snapshot->control_count; i++)
+    {
+        vcap_control_id id = snapshot->controls[i].id;
+        vcap_control_cache* entry = vcap_ctrl_valid(id) ? vcap_find_control(vd, id) : NULL;
+
+        if (!entry)
+        {
+            vcap_set_error(vd, "Invalid control ID (%u)", id);
+            vcap_free(preset);
+            return NULL;
+        }
+
+        if (entry->flags & (V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_DISABLED))
+        {
+            vcap_set_error(vd, "Control (%u) is not writable on device %s", id, vd->path);
+            vcap_free(preset);
+            return NULL;
+        }
+
+        int32_t value = vcap_clamp_value(&entry->info, snapshot->controls[i].value);
+
+        // Menus may have gaps
+        if (entry->info.type == VCAP_CTRL_TYPE_MENU || entry->info.type == VCAP_CTRL_TYPE_INTEGER_MENU)
+        {
+            if (vcap_cache_menu(vd, entry) == VCAP_ERROR)
+            {
+                vcap_free(preset);
+                return NULL;
+            }
+
+            uint32_t j = 0;
+
+            while (j < entry->menu_count && entry->menu[j].index != (uint32_t)value)
+                j++;
+
+            if (j == entry->menu_count)
+            {
+                vcap_set_error(vd, "Invalid menu item (%d) for control (%u)", value, id);
+                vcap_free(preset);
+                return NULL;
+            }
+        }
+
+        preset->ids[preset->count] = id;
+        preset->ctrls[preset->count].id = entry->v4l2_id;
+        preset->ctrls[preset->count].value = value;
+        preset->count++;
+    }
+
+    return preset;
+}
+
+void vcap_destroy_preset(vcap_preset* preset)
+{
+    vcap_free(preset);
+}
+
+int vcap_apply_preset(vcap_device* vd, vcap_preset* preset, uint64_t* apply_ns)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(preset != NULL);
+
+    if (!preset)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    if (preset->vd != vd)
+    {
+        vcap_set_error(vd, "Preset was created for a different device");
+        return VCAP_INVALID;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Setting the format restarts the stream, skip it if nothing changes
+    vcap_format_id fmt;
+    vcap_size size;
+
+    if (vcap_get_format(vd, &fmt, &size) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    if (fmt != preset->format_id || size.width != preset->size.width || size.height != preset->size.height)
+    {
+        if (vcap_set_format(vd, preset->format_id, preset->size) == VCAP_ERROR)
+            return VCAP_ERROR;
+    }
+
+    vcap_rate rate;
+
+    if (vcap_get_rate(vd, &rate) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    if ((uint64_t)rate.numerator * preset->rate.denominator != (uint64_t)preset->rate.numerator * rate.denominator)
+    {
+        if (vcap_set_rate(vd, preset->rate) == VCAP_ERROR)
+            return VCAP_ERROR;
+    }
+
+    if (preset->count > 0)
+    {
+        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-ext-ctrls.html
+        struct v4l2_ext_controls ext;
+        VCAP_CLEAR(ext);
+
+        ext.which     = V4L2_CTRL_WHICH_CUR_VAL;
+        ext.count     = preset->count;
+        ext.controls  = preset->ctrls;
+        ext.error_idx = preset->count;
+
+        if (vcap_ioctl(vd->fd, VIDIOC_S_EXT_CTRLS, &ext) == -1)
+        {
+            if (ext.error_idx < preset->count)
+                vcap_set_error_errno(vd, "Control (%u) failed on device %s", preset->ids[ext.error_idx], vd->path);
+            else
+                vcap_set_error_errno(vd, "Unable to apply preset on device %s", vd->path);
+
+            vcap_invalidate_values(vd);
+            return VCAP_ERROR;
+        }
+
+        // Keep the control caches consistent. Controls changed by the preset
+        // are invalidated once, so the values of the preset itself are kept.
+        for (uint32_t i = 0; i < preset->count; i++)
+        {
+            vcap_control_cache* entry = vcap_find_control(vd, preset->ids[i]);
+
+            if (entry && (entry->flags & V4L2_CTRL_FLAG_UPDATE))
+            {
+                vcap_invalidate_values(vd);
+                break;
+            }
+        }
+
+        for (uint32_t i = 0; i < preset->count; i++)
+        {
+            vcap_control_cache* entry = vcap_find_control(vd, preset->ids[i]);
+
+            if (!entry)
+                continue;
+
+            vcap_note_write(vd, entry);
+
+            if (vd->value_cache)
+                vcap_store_value(vd, entry, preset->ctrls[i].value, false);
+        }
+    }
+
+    if (apply_ns)
+    {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        *apply_ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 + (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+    }
+
+    return VCAP_OK;
+}
+
+//==============================================================================
+// Cache file functions
+//==============================================================================
+
+int vcap_save_cache(vcap_device* vd, const char* path)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(path != NULL);
+
+    if (!path)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    // Enumerate everything, including menus that are otherwise cached lazily
+    if (vcap_cache_formats(vd) == VCAP_ERROR || vcap_cache_controls(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    for (uint32_t i = 0; i < vd->ctrl_count; i++)
+    {
+        vcap_control_cache* entry = &vd->ctrls[i];
+
+        if (entry->info.type != VCAP_CTRL_TYPE_MENU && entry->info.type != VCAP_CTRL_TYPE_INTEGER_MENU)
+            continue;
+
+        if (vcap_cache_menu(vd, entry) == VCAP_ERROR)
+            return VCAP_ERROR;
+    }
+
+    vcap_cache_header header;
+    VCAP_CLEAR(header);
+
+    header.magic          = VCAP_CACHE_FILE_MAGIC;
+    header.version        = VCAP_CACHE_FILE_VERSION;
+    header.fmt_size       = sizeof(vcap_format_cache);
+    header.size_size      = sizeof(vcap_size_cache);
+    header.ctrl_size      = sizeof(vcap_control_cache);
+    header.driver_version = vd->caps.version;
+    header.convert        = vd->convert;
+    header.fmt_count      = vd->fmt_count;
+    header.ctrl_count     = vd->ctrl_count;
+
+    memcpy(header.driver, vd->caps.driver, sizeof(header.driver));
+    memcpy(header.card, vd->caps.card, sizeof(header.card));
+    memcpy(header.bus_info, vd->caps.bus_info, sizeof(header.bus_info));
+
+    FILE* file = fopen(path, "wb");
+
+    if (!file)
+    {
+        vcap_set_error_errno(vd, "Unable to open cache file %s", path);
+        return VCAP_ERROR;
+    }
+
+    // Entries are written as records without pointers or padding bytes
+    fwrite(&header, sizeof(header), 1, file);
+
+    for (uint32_t i = 0; i < vd->fmt_count; i++)
+    {
+        const vcap_format_cache* fmt = &vd->fmts[i];
+
+        vcap_format_cache fmt_record;
+        vcap_format_record(fmt, &fmt_record);
+
+        fwrite(&fmt_record, sizeof(vcap_format_cache), 1, file);
+
+        for (uint32_t j = 0; j < fmt->size_count; j++)
+        {
+            const vcap_size_cache* size = &fmt->sizes[j];
+
+            vcap_size_cache size_record;
+            vcap_size_record(size, &size_record);
+
+            fwrite(&size_record, sizeof(vcap_size_cache), 1, file);
+
+            if (size->rate_count > 0)
+                fwrite(size->rates, sizeof(vcap_rate), size->rate_count, file);
+        }
+    }
+
+    for (uint32_t i = 0; i < vd->ctrl_count; i++)
+    {
+        const vcap_control_cache* ctrl = &vd->ctrls[i];
+
+        vcap_control_cache ctrl_record;
+        vcap_control_record(ctrl, &ctrl_record);
+
+        fwrite(&ctrl_record, sizeof(vcap_control_cache), 1, file);
+
+        if (ctrl->menu_count > 0)
+            fwrite(ctrl->menu, sizeof(vcap_menu_item), ctrl->menu_count, file);
+    }
+
+    bool failed = ferror(file);
+
+    if (fclose(file) != 0 || failed)
+    {
+        vcap_set_error(vd, "Unable to write cache file %s", path);
+        return VCAP_ERROR;
+    }
+
+    return VCAP_OK;
+}
+
+int vcap_load_cache(vcap_device* vd, const char* path)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(path != NULL);
+
+    if (!path)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    FILE* file = fopen(path, "rb");
+
+    if (!file)
+    {
+        if (errno == ENOENT)
+        {
+            vcap_set_error(vd, "Cache file %s doesn't exist", path);
+            return VCAP_INVALID;
+        }
+
+        vcap_set_error_errno(vd, "Unable to open cache file %s", path);
+        return VCAP_ERROR;
+    }
+
+    // Read the whole file at once
+    long length = -1;
+
+    if (fseek(file, 0, SEEK_END) == 0)
+        length = ftell(file);
+
+    if (length < 0 || fseek(file, 0, SEEK_SET) != 0)
+    {
+        vcap_set_error_errno(vd, "Unable to read cache file %s", path);
+        fclose(file);
+        return VCAP_ERROR;
+    }
+
+    uint8_t* data = (uint8_t*)vcap_malloc((size_t)length + 1);
+
+    if (!data)
+    {
+        vcap_set_error(vd, "Out of memory while loading cache file %s", path);
+        fclose(file);
+        return VCAP_ERROR;
+    }
+
+    size_t read = fread(data, 1, (size_t)length, file);
+
+    fclose(file);
+
+    if (read != (size_t)length)
+    {
+        vcap_set_error(vd, "Unable to read cache file %s", path);
+        vcap_free(data);
+        return VCAP_ERROR;
+    }
+
+    // Check the header against the open device
+    const uint8_t* pos = data;
+    const uint8_t* end = data + length;
+
+    vcap_cache_header header;
+
+    if (!vcap_read_cache(&pos, end, &header, sizeof(header)) ||
+        header.magic != VCAP_CACHE_FILE_MAGIC ||
+        header.version != VCAP_CACHE_FILE_VERSION ||
+        header.fmt_size != sizeof(vcap_format_cache) ||
+        header.size_size != sizeof(vcap_size_cache) ||
+        header.ctrl_size != sizeof(vcap_control_cache))
+    {
+        vcap_set_error(vd, "Cache file %s is not compatible", path);
+        vcap_free(data);
+        return VCAP_INVALID;
+    }
+
+    if (header.driver_version != vd->caps.version ||
+        header.convert != (uint32_t)vd->convert ||
+        memcmp(header.driver, vd->caps.driver, sizeof(header.driver)) != 0 ||
+        memcmp(header.card, vd->caps.card, sizeof(header.card)) != 0 ||
+        memcmp(header.bus_info, vd->caps.bus_info, sizeof(header.bus_info)) != 0)
+    {
+        vcap_set_error(vd, "Cache file %s doesn't match device %s", path, vd->path);
+        vcap_free(data);
+        return VCAP_INVALID;
+    }
+
+    int result = vcap_parse_cache(vd, &header, pos, end);
+
+    vcap_free(data);
+
+    if (result == VCAP_INVALID)
+        vcap_set_error(vd, "Cache file %s is corrupt", path);
+    else if (result == VCAP_ERROR)
+        vcap_set_error(vd, "Out of memory while loading cache file %s", path);
+
+    return result;
+}
+
+//==============================================================================
+// Crop functions
+//==============================================================================
+
+int vcap_get_crop_bounds(vcap_device* vd, vcap_rect* rect)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(rect != NULL);
+
+    if (!rect)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    // Get crop rectangle
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-cropcap.html
+    struct v4l2_cropcap cropcap;
+    VCAP_CLEAR(cropcap);
+
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_CROPCAP, &cropcap) == -1)
+    {
+        if (errno == ENODATA || errno == EINVAL)
+        {
+            vcap_set_error(vd, "Cropping is not supported on device '%s'", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+
+    // Copy rectangle bounds
+    rect->top = cropcap.bounds.top;
+    rect->left = cropcap.bounds.left;
+    rect->width = cropcap.bounds.width;
+    rect->height = cropcap.bounds.height;
+
+    return VCAP_OK;
+}
+
+int vcap_reset_crop(vcap_device* vd)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-cropcap.html
+    struct v4l2_cropcap cropcap;
+    VCAP_CLEAR(cropcap);
+
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_CROPCAP, &cropcap) == -1)
+    {
+        if (errno == ENODATA || errno == EINVAL)
+        {
+            vcap_set_error(vd, "Cropping is not supported on device '%s'", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-crop.html
+    struct v4l2_crop crop;
+    VCAP_CLEAR(crop);
+
+    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    crop.c = cropcap.defrect;
+
+    // Drivers that can't scale change the frame size to match
+    vd->fmt_valid = false;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_S_CROP, &crop) == -1)
+    {
+        vcap_set_error_errno(vd, "Unable to set crop window on device '%s'", vd->path);
+        return VCAP_ERROR;
+    }
+
+    return VCAP_OK;
+}
+
+int vcap_get_crop(vcap_device* vd, vcap_rect* rect)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(rect != NULL);
+
+    if (!rect)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-crop.html
+    struct v4l2_crop crop;
+    VCAP_CLEAR(crop);
+
+    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_G_CROP, &crop) == -1)
+    {
+        if (errno == ENODATA || errno == EINVAL)
+        {
+            vcap_set_error(vd, "Cropping is not supported on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+        else
+        {
+            vcap_set_error(vd, "Unable to get crop window on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+
+    rect->top = crop.c.top;
+    rect->left = crop.c.left;
+    rect->width = crop.c.width;
+    rect->height = crop.c.height;
+
+    return VCAP_OK;
+}
+
+int vcap_set_crop(vcap_device* vd, vcap_rect rect)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-crop.html
+    struct v4l2_crop crop;
+    VCAP_CLEAR(crop);
+
+    crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    crop.c.left = rect.left;
+    crop.c.top = rect.top;
+    crop.c.width = rect.width;
+    crop.c.height = rect.height;
+
+    // Drivers that can't scale change the frame size to match
+    vd->fmt_valid = false;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_S_CROP, &crop) == -1)
+    {
+        if (errno == ENODATA || errno == EINVAL)
+        {
+            vcap_set_error(vd, "Cropping is not supported on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+        else
+        {
+            vcap_set_error(vd, "Unable to set crop window on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+
+    return VCAP_OK;
+}
+
+//==============================================================================
+// Selection functions
+//==============================================================================
+
+int vcap_get_selection(vcap_device* vd, vcap_selection_target target, vcap_rect* rect)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(rect != NULL);
+
+    if (!rect)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    // Ensure selection target is within the proper range
+    assert(target < VCAP_SEL_COUNT);
+
+    if (target >= VCAP_SEL_COUNT)
+    {
+        vcap_set_error(vd, "Invalid argument (out of range)");
+        return VCAP_ERROR;
+    }
+
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-selection.html
+    struct v4l2_selection sel;
+    VCAP_CLEAR(sel);
+
+    sel.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = vcap_map_sel_target(target);
+
+    if (vcap_ioctl(vd->fd, VIDIOC_G_SELECTION, &sel) == -1)
+    {
+        if (errno == EINVAL || errno == ENODATA || errno == ENOTTY)
+        {
+            vcap_set_error(vd, "Selection target is not supported on device %s", vd->path);
+            return VCAP_INVALID;
+        }
+        else
+        {
+            vcap_set_error_errno(vd, "Unable to get selection on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+
+    rect->top    = sel.r.top;
+    rect->left   = sel.r.left;
+    rect->width  = (int32_t)sel.r.width;
+    rect->height = (int32_t)sel.r.height;
+
+    return VCAP_OK;
+}
+
+int vcap_set_selection(vcap_device* vd, vcap_selection_target target, vcap_rect* rect, uint32_t flags)
+{
+    assert(vd != NULL);
+    assert(vcap_is_open(vd));
+
+    if (!vcap_is_open(vd))
+    {
+        vcap_set_error(vd, "Device %s must be open", vd->path);
+        return VCAP_ERROR;
+    }
+
+    assert(rect != NULL);
+
+    if (!rect)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    // Bounds and defaults are read-only
+    if (target != VCAP_SEL_CROP && target != VCAP_SEL_COMPOSE)
+    {
+        vcap_set_error(vd, "Selection target can't be set");
+        return VCAP_ERROR;
+    }
+
+    if (rect->width < 0 || rect->height < 0)
+    {
+        vcap_set_error(vd, "Invalid argument (negative size)");
+        return VCAP_ERROR;
+    }
+
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-selection.html
+    struct v4l2_selection sel;
+    VCAP_CLEAR(sel);
+
+    sel.type     = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target   = vcap_map_sel_target(target);
+    sel.r.top    = rect->top;
+    sel.r.left   = rect->left;
+    sel.r.width  = (uint32_t)rect->width;
+    sel.r.height = (uint32_t)rect->height;
+
+    if (flags & VCAP_SEL_FLAG_GE)
+        sel.flags |= V4L2_SEL_FLAG_GE;
+
+    if (flags & VCAP_SEL_FLAG_LE)
+        sel.flags |= V4L2_SEL_FLAG_LE;
+
+    // Drivers may adjust the frame size to match
+    vd->fmt_valid = false;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_S_SELECTION, &sel) == -1)
+    {
+        if (errno == EINVAL || errno == ENODATA || errno == ENOTTY)
+        {
+            vcap_set_error(vd, "Selection target is not supported on device %s", vd->path);
+            return VCAP_INVALID;
+        }
+        else if (errno == ERANGE)
+        {
+            vcap_set_error(vd, "Selection rectangle doesn't satisfy the constraints on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+        else
+        {
+            vcap_set_error_errno(vd, "Unable to set selection on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+
+    // Report the rectangle actually applied
+    rect->top    = sel.r.top;
+    rect->left   = sel.r.left;
+    rect->width  = (int32_t)sel.r.width;
+    rect->height = (int32_t)sel.r.height;
+
+    return VCAP_OK;
+}
+
+//==============================================================================
+// Internal Functions
+//==============================================================================
+
+void* vcap_malloc(size_t size)
+{
+    return global_malloc_fp(size);
+}
+
+void vcap_free(void* ptr)
+{
+    if (ptr)
+        global_free_fp(ptr);
+}
+
+static void vcap_fourcc_str(uint32_t code, uint8_t* str)
+{
+    assert(str);
+
+    str[0] = (code >> 0) & 0xFF;
+    str[1] = (code >> 8) & 0xFF;
+    str[2] = (code >> 16) & 0xFF;
+    str[3] = (code >> 24) & 0xFF;
+    str[4] = '\0';
+}
+
+static int vcap_ioctl(int fd, long unsigned request, void *arg)
+{
+    assert(arg != NULL);
+
+    int result;
+
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/func-ioctl.html#func-ioctl
+
+    do
+    {
+        result = v4l2_ioctl(fd, (int)request, arg);
+    }
+    while (result == -1 && (errno == EINTR || errno == EAGAIN));
+
+    return result;
+}
+
+static int vcap_query_caps(const char* path, struct v4l2_capability* caps)
+{
+    assert(path != NULL);
+    assert(caps != NULL);
+
+    struct stat st;
+    int fd = -1;
+
+    // Device must exist
+    if (stat(path, &st) == -1)
+       return VCAP_ERROR;
+
+    // Device must be a character device
+    if (!S_ISCHR(st.st_mode))
+        return VCAP_ERROR;
+
+    // Open the video device
+    fd = v4l2_open(path, O_RDWR | O_NONBLOCK, 0);
+
+    if (fd == -1)
+        return VCAP_ERROR;
+
+    // Obtain device capabilities
+    if (vcap_ioctl(fd, VIDIOC_QUERYCAP, caps) == -1)
+    {
+        v4l2_close(fd);
+        return VCAP_ERROR;
+    }
+
+    // Ensure video capture is supported
+    if (!(caps->capabilities & V4L2_CAP_VIDEO_CAPTURE))
+    {
+        v4l2_close(fd);
+        return VCAP_ERROR;
+    }
+
+    if (!(caps->capabilities & V4L2_CAP_STREAMING) &&
+        !(caps->capabilities & V4L2_CAP_READWRITE))
+    {
+        v4l2_close(fd);
+        return VCAP_ERROR;
+    }
+
+    v4l2_close(fd);
+
+    return VCAP_OK;
+}
+
+static int vcap_video_device_filter(const struct dirent* a)
+{
+    assert(a != NULL);
+
+    if (0 == strncmp(a->d_name, "video", 5))
+        return 1;
+    else
+        return 0;
+}
+
+static void vcap_caps_to_info(const char* path, const struct v4l2_capability caps, vcap_device_info* info)
+{
+    assert(path != NULL);
+    assert(info != NULL);
+
+    // Copy device information
+    vcap_strcpy(info->path, path, sizeof(info->path));
+    vcap_ustrcpy(info->driver, caps.driver, sizeof(info->driver));
+    vcap_ustrcpy(info->card, caps.card, sizeof(info->card));
+    vcap_ustrcpy(info->bus_info, caps.bus_info, sizeof(info->bus_info));
+    info->version = caps.version;
+
+    // Decode version
+    snprintf((char*)info->version_str, sizeof(info->version_str), "%u.%u.%u",
+            (caps.version >> 16) & 0xFF,
+            (caps.version >> 8) & 0xFF,
+            (caps.version & 0xFF));
+
+    // Determines which output modes are available
+    info->streaming = (bool)(caps.capabilities & V4L2_CAP_STREAMING);
+    info->read = (bool)(caps.capabilities & V4L2_CAP_READWRITE);
+}
+
+static int vcap_request_buffers(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    // Requests the specified number of buffers, returning the number of
+    // available buffers
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-reqbufs.html
+    struct v4l2_requestbuffers req;
+    VCAP_CLEAR(req);
+
+    req.count  = vd->buffer_count;
+    req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+
+	if (vcap_ioctl(vd->fd, VIDIOC_REQBUFS, &req) == -1)
+	{
+    	vcap_set_error_errno(vd, "Unable to request buffers on %s", vd->path);
+		return VCAP_ERROR;
+    }
+
+    if (req.count == 0)
+    {
+        vcap_set_error(vd, "Invalid buffer count on %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    // Changes the number of buffer in the video device to match the number of
+    // available buffers
+    vd->buffer_count = req.count;
+
+    return VCAP_OK;
+}
+
+static int vcap_init_stream(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    if (vd->buffer_count > 0)
+    {
+        if (vcap_request_buffers(vd) == VCAP_ERROR)
+            return VCAP_ERROR;
+
+        if (vcap_map_buffers(vd) == VCAP_ERROR)
+            return VCAP_ERROR;
+
+        if (vcap_queue_buffers(vd) == VCAP_ERROR)
+            return VCAP_ERROR; // TODO: Unmap buffers on error
+    }
+
+    return VCAP_OK;
+}
+
+static int vcap_release_buffers(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    struct v4l2_requestbuffers req;
+    VCAP_CLEAR(req);
+
+    req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    req.count  = 0;
+
+	if (vcap_ioctl(vd->fd, VIDIOC_REQBUFS, &req) == -1)
+	{
+    	vcap_set_error_errno(vd, "Unable to request buffers on %s", vd->path);
+		return VCAP_ERROR;
+    }
+
+    return VCAP_OK;
+}
+
+static int vcap_shutdown_stream(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    if (vd->buffer_count > 0)
+    {
+        if (vcap_unmap_buffers(vd) == VCAP_ERROR)
+            return VCAP_ERROR;
+
+        if (vcap_release_buffers(vd) == VCAP_ERROR)
+            return VCAP_ERROR;
+    }
+
+    return VCAP_OK;
+}
+
+static int vcap_map_buffers(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    // Allocates the buffer objects
+    vd->buffers = (vcap_buffer*)vcap_malloc(vd->buffer_count * sizeof(vcap_buffer));
+
+     for (uint32_t i = 0; i < vd->buffer_count; i++)
+     {
+        // Query buffers, returning their size and other information
+        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-querybuf.html
+        struct v4l2_buffer buf;
+        VCAP_CLEAR(buf);
+
+        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index  = i;
+
+        if (vcap_ioctl(vd->fd, VIDIOC_QUERYBUF, &buf) == -1)
+        {
+            vcap_set_error_errno(vd, "Unable to query buffers on %s", vd->path);
+            return VCAP_ERROR;
+        }
+
+        // Map buffers
+        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/func-mmap.html
+        vd->buffers[i].size = buf.length;
+        vd->buffers[i].data = v4l2_mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, vd->fd, buf.m.offset);
+
+        if (vd->buffers[i].data == MAP_FAILED)
+        {
+            vcap_set_error(vd, "MMAP failed on %s", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+
+    return VCAP_OK;
+}
+
+static int vcap_unmap_buffers(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    // Unmap and free buffers
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/func-munmap.html
+    for (uint32_t i = 0; i < vd->buffer_count; i++)
+    {
+        if (v4l2_munmap(vd->buffers[i].data, vd->buffers[i].size) == -1)
+        {
+            vcap_set_error_errno(vd, "Unmapping buffers failed on %s", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+
+    vcap_free(vd->buffers);
+
+    return VCAP_OK;
+}
+
+static int vcap_queue_buffers(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    for (uint32_t i = 0; i < vd->buffer_count; i++)
+    {
+        // Places a buffer in the queue
+        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-qbuf.html
+        struct v4l2_buffer buf;
+        VCAP_CLEAR(buf);
+
+        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index  = i;
+
+        if (vcap_ioctl(vd->fd, VIDIOC_QBUF, &buf) == -1)
+        {
+            vcap_set_error_errno(vd, "Unable to queue buffers on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+	}
+
+	return VCAP_OK;
+}
+
+static int vcap_reset_controls_batch(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    if (vd->ctrl_count == 0)
+        return VCAP_OK;
+
+    // Controls may have become active since their flags were read
+    if (vd->ctrl_flags_stale && vcap_refresh_control_flags(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    vcap_control_value* values = (vcap_control_value*)vcap_malloc(vd->ctrl_count * sizeof(vcap_control_value));
+
+    if (!values)
+    {
+        vcap_set_error(vd, "Out of memory");
+        return VCAP_ERROR;
+    }
+
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < vd->ctrl_count; i++)
+    {
+        const vcap_control_cache* entry = &vd->ctrls[i];
+
+        // Buttons perform an action rather than hold a value
+        if (entry->info.type == VCAP_CTRL_TYPE_BUTTON)
+            continue;
+
+        if (entry->flags & (V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_DISABLED |
+                            V4L2_CTRL_FLAG_INACTIVE  | V4L2_CTRL_FLAG_GRABBED))
+            continue;
+
+        values[count].id    = entry->info.id;
+        values[count].value = entry->info.default_value;
+        count++;
+    }
+
+    int result = vcap_set_controls(vd, values, count, NULL);
+
+    vcap_free(values);
+
+    return result;
+}
+
+static int vcap_queue_control_value(vcap_device* vd, vcap_control_id ctrl, int32_t value, bool notify)
+{
+    assert(vd != NULL);
+    assert(vd->writer != NULL);
+
+    if (vcap_cache_controls(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    vcap_control_cache* entry = vcap_ctrl_valid(ctrl) ? vcap_find_control(vd, ctrl) : NULL;
+
+    if (!entry)
+    {
+        vcap_set_error(vd, "Invalid control ID (%u)", ctrl);
+        return VCAP_INVALID;
+    }
+
+    // The value will change behind the value cache
+    entry->value_valid = false;
+
+    vcap_note_write(vd, entry);
+
+    // A value that supersedes an asynchronous write completes it instead
+    vcap_async_wait* wait = NULL;
+
+    for (uint32_t i = 0; i < vd->wait_count && !wait; i++)
+    {
+        if (vd->waits[i].id == ctrl)
+            wait = &vd->waits[i];
+    }
+
+    if (wait)
+        notify = true;
+
+    vcap_control_writer* writer = vd->writer;
+
+    pthread_mutex_lock(&writer->mutex);
+
+    // The value stays uncacheable until the writer has applied it
+    entry->write_seq = ++writer->queued_seq;
+
+    // Replace the pending value of the control, if any
+    uint32_t i = 0;
+
+    while (i < writer->pending_count && writer->pending_ids[i] != ctrl)
+        i++;
+
+    if (i == VCAP_WRITER_SLOT_COUNT)
+    {
+        pthread_mutex_unlock(&writer->mutex);
+
+        vcap_set_error(vd, "Too many pending controls on device %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    if (i == writer->pending_count)
+    {
+        writer->pending_ids[i] = ctrl;
+        writer->pending_notify[i] = false;
+        writer->pending_count++;
+    }
+
+    // A replaced value still completes the requested operation
+    writer->pending_notify[i] = writer->pending_notify[i] || notify;
+
+    VCAP_CLEAR(writer->pending[i]);
+
+    writer->pending[i].id    = entry->v4l2_id;
+    writer->pending[i].value = value;
+
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->mutex);
+
+    if (wait)
+    {
+        wait->value      = value;
+        wait->written    = false;
+        wait->event_seen = false;
+    }
+
+    return VCAP_OK;
+}
+
+//
+// The writer never touches the device structure, only the file descriptor, so
+// the caller can keep using the device while values are applied. Each round
+// takes all pending values and writes them with a single ioctl, so updates
+// are coalesced at whatever rate the device can sustain.
+//
+static void* vcap_control_writer_main(void* arg)
+{
+    vcap_control_writer* writer = (vcap_control_writer*)arg;
+
+    assert(writer != NULL);
+
+    struct v4l2_ext_control ctrls[VCAP_WRITER_SLOT_COUNT];
+    vcap_control_id ids[VCAP_WRITER_SLOT_COUNT];
+    bool notify[VCAP_WRITER_SLOT_COUNT];
+    bool changed[VCAP_WRITER_SLOT_COUNT];
+    int results[VCAP_WRITER_SLOT_COUNT];
+
+    pthread_mutex_lock(&writer->mutex);
+
+    while (true)
+    {
+        while (writer->running && writer->pending_count == 0)
+        {
+            writer->busy = false;
+            pthread_cond_broadcast(&writer->idle);
+            pthread_cond_wait(&writer->wake, &writer->mutex);
+        }
+
+        if (writer->pending_count == 0)
+            break;
+
+        uint32_t count = writer->pending_count;
+
+        memcpy(ctrls, writer->pending, count * sizeof(struct v4l2_ext_control));
+        memcpy(ids, writer->pending_ids, count * sizeof(vcap_control_id));
+        memcpy(notify, writer->pending_notify, count * sizeof(bool));
+
+        // Every value queued so far is part of this round
+        uint64_t round_seq = writer->queued_seq;
+
+        writer->pending_count = 0;
+        writer->busy = true;
+
+        pthread_mutex_unlock(&writer->mutex);
+
+        // Writing the current value doesn't generate a control event, so
+        // asynchronous writes check whether they change anything first
+        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-ctrl.html
+        for (uint32_t i = 0; i < count; i++)
+        {
+            changed[i] = true;
+
+            if (!notify[i])
+                continue;
+
+            struct v4l2_control gctrl;
+            VCAP_CLEAR(gctrl);
+
+            gctrl.id = ctrls[i].id;
+
+            if (vcap_ioctl(writer->fd, VIDIOC_G_CTRL, &gctrl) == 0)
+                changed[i] = (gctrl.value != ctrls[i].value);
+        }
+
+        uint32_t failed_id = 0;
+        int error = vcap_write_controls(writer->fd, ctrls, count, results, &failed_id);
+
+        pthread_mutex_lock(&writer->mutex);
+
+        writer->applied_seq = round_seq;
+
+        // Keep the first error until it is reported
+        if (error != 0 && !writer->failed)
+        {
+            snprintf(writer->error_msg, sizeof(writer->error_msg), "Control (0x%08x) failed: %s",
+                     failed_id, strerror(error));
+
+            writer->failed = true;
+        }
+
+        // Report asynchronous writes to the device
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!notify[i])
+                continue;
+
+            vcap_control_written written;
+
+            written.id      = ids[i];
+            written.value   = ctrls[i].value;
+            written.result  = results[i];
+            written.changed = changed[i];
+
+            vcap_post_written(writer, &written);
+        }
+    }
+
+    writer->busy = false;
+    pthread_cond_broadcast(&writer->idle);
+    pthread_mutex_unlock(&writer->mutex);
+
+    return NULL;
+}
+
+static int vcap_write_controls(int fd, const struct v4l2_ext_control* ctrls, uint32_t count, int* results, uint32_t* failed_id)
+{
+    assert(ctrls != NULL);
+    assert(results != NULL);
+    assert(failed_id != NULL);
+    assert(count <= VCAP_WRITER_SLOT_COUNT);
+
+    struct v4l2_ext_control batch[VCAP_WRITER_SLOT_COUNT];
+    uint32_t index[VCAP_WRITER_SLOT_COUNT];
+
+    int first_error = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        results[i] = VCAP_OK;
+        index[i] = i;
+    }
+
+    uint32_t remaining = count;
+
+    while (remaining > 0)
+    {
+        // The driver may have modified the values of a failed batch
+        for (uint32_t i = 0; i < remaining; i++)
+            batch[i] = ctrls[index[i]];
+
+        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-ext-ctrls.html
+        struct v4l2_ext_controls ext;
+        VCAP_CLEAR(ext);
+
+        ext.which     = V4L2_CTRL_WHICH_CUR_VAL;
+        ext.count     = remaining;
+        ext.controls  = batch;
+        ext.error_idx = remaining;
+
+        if (vcap_ioctl(fd, VIDIOC_S_EXT_CTRLS, &ext) == 0)
+            break;
+
+        int error = errno;
+
+        if (ext.error_idx < remaining)
+        {
+            // Only the rejected control fails, the rest are written again
+            uint32_t failed = index[ext.error_idx];
+
+            results[failed] = VCAP_ERROR;
+
+            if (first_error == 0)
+            {
+                first_error = error;
+                *failed_id = ctrls[failed].id;
+            }
+
+            memmove(&index[ext.error_idx], &index[ext.error_idx + 1], (remaining - ext.error_idx - 1) * sizeof(uint32_t));
+            remaining--;
+            continue;
+        }
+
+        // Validation failed without identifying the control, so each control
+        // is written on its own
+        for (uint32_t i = 0; i < remaining; i++)
+        {
+            batch[0] = ctrls[index[i]];
+
+            ext.count     = 1;
+            ext.controls  = batch;
+            ext.error_idx = 1;
+
+            if (vcap_ioctl(fd, VIDIOC_S_EXT_CTRLS, &ext) == -1)
+            {
+                results[index[i]] = VCAP_ERROR;
+
+                if (first_error == 0)
+                {
+                    first_error = errno;
+                    *failed_id = ctrls[index[i]].id;
+                }
+            }
+        }
+
+        break;
+    }
+
+    return first_error;
+}
+
+static void vcap_post_written(vcap_control_writer* writer, const vcap_control_written* written)
+{
+    assert(writer != NULL);
+    assert(written != NULL);
+
+    // Called with the writer locked. A newer write of the same control
+    // supersedes the older one, which no longer has a waiting write.
+    uint32_t i = 0;
+
+    while (i < writer->done_count && writer->done[i].id != written->id)
+        i++;
+
+    if (i < writer->done_count)
+    {
+        writer->done[i] = *written;
+    }
+    else if (writer->done_count < VCAP_WRITER_SLOT_COUNT)
+    {
+        writer->done[writer->done_count++] = *written;
+    }
+    else
+    {
+        // The collector fails the writes whose result was lost
+        writer->overflowed = true;
+    }
+
+    uint64_t signal = 1;
+
+    if (write(writer->done_fd, &signal, sizeof(signal)) == -1)
+    {
+        // The counter can't overflow in practice, the fd is readable either way
+    }
+}
+
+static void vcap_collect_completions(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    vcap_control_writer* writer = vd->writer;
+
+    if (writer)
+    {
+        pthread_mutex_lock(&writer->mutex);
+
+        // Reset the signals, completions are then returned from the event queue
+        uint64_t signal;
+
+        if (read(writer->done_fd, &signal, sizeof(signal)) == -1)
+        {
+            // Nothing was signaled (EAGAIN)
+        }
+
+        if (read(writer->timer_fd, &signal, sizeof(signal)) == -1)
+        {
+            // The timer hasn't expired (EAGAIN)
+        }
+
+        // Before storing written values, which must not be cached while a
+        // newer value is still queued
+        vcap_settle_writes(vd);
+
+        for (uint32_t i = 0; i < writer->done_count; i++)
+        {
+            const vcap_control_written* written = &writer->done[i];
+
+            uint32_t j = 0;
+
+            while (j < vd->wait_count && vd->waits[j].id != written->id)
+                j++;
+
+            // Superseded by a newer value, which completes instead (queued
+            // values that supersede a wait are always reported)
+            if (j == vd->wait_count || vd->waits[j].value != written->value)
+                continue;
+
+            vcap_control_cache* entry = vcap_find_control(vd, written->id);
+
+            // Done unless a control event will signal completion
+            if (written->result == VCAP_OK && written->changed && entry && entry->feedback && !vd->waits[j].event_seen)
+                vd->waits[j].written = true;
+            else
+                vcap_push_completion(vd, written->id, written->value, written->result);
+        }
+
+        writer->done_count = 0;
+
+        // Once the writer is idle, every write has been reported, so writes
+        // still waiting for a result lost it when the results overflowed
+        if (writer->overflowed && !writer->busy && writer->pending_count == 0)
+        {
+            uint32_t i = 0;
+
+            while (i < vd->wait_count)
+            {
+                if (!vd->waits[i].written)
+                    vcap_push_completion(vd, vd->waits[i].id, vd->waits[i].value, VCAP_ERROR);
+                else
+                    i++;
+            }
+
+            writer->overflowed = false;
+        }
+
+        pthread_mutex_unlock(&writer->mutex);
+    }
+
+    // Writes that weren't applied or whose control event never arrived in
+    // time, measured from when they were queued
+    uint64_t now = vcap_monotonic_ms();
+
+    uint32_t i = 0;
+
+    while (i < vd->wait_count)
+    {
+        // Completing removes the write from the list
+        if (now >= vd->waits[i].deadline)
+            vcap_push_completion(vd, vd->waits[i].id, vd->waits[i].value, VCAP_ERROR);
+        else
+            i++;
+    }
+
+    vcap_arm_async_timer(vd);
+}
+
+static void vcap_complete_async(vcap_device* vd, vcap_control_id ctrl)
+{
+    assert(vd != NULL);
+
+    for (uint32_t i = 0; i < vd->wait_count; i++)
+    {
+        if (vd->waits[i].id != ctrl)
+            continue;
+
+        // The event may arrive before the writer reports the write
+        if (vd->waits[i].written)
+        {
+            vcap_push_completion(vd, ctrl, vd->waits[i].value, VCAP_OK);
+            vcap_arm_async_timer(vd);
+        }
+        else
+        {
+            vd->waits[i].event_seen = true;
+        }
+
+        return;
+    }
+}
+
+static void vcap_arm_async_timer(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    if (!vd->writer)
+        return;
+
+    uint64_t deadline = 0;
+
+    for (uint32_t i = 0; i < vd->wait_count; i++)
+    {
+        if (deadline == 0 || vd->waits[i].deadline < deadline)
+            deadline = vd->waits[i].deadline;
+    }
+
+    // A zero expiry disarms the timer when no writes are waiting
+    struct itimerspec spec;
+    VCAP_CLEAR(spec);
+
+    spec.it_value.tv_sec  = (time_t)(deadline / 1000);
+    spec.it_value.tv_nsec = (long)(deadline % 1000) * 1000000;
+
+    if (timerfd_settime(vd->writer->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+    {
+        // Timeouts are then only noticed when the event fd wakes up otherwise
+    }
+}
+
+static int vcap_watch_writer(int event_fd, vcap_control_writer* writer)
+{
+    assert(writer != NULL);
+
+    struct epoll_event ev;
+    VCAP_CLEAR(ev);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = writer->done_fd;
+
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, writer->done_fd, &ev) == -1)
+        return -1;
+
+    VCAP_CLEAR(ev);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = writer->timer_fd;
+
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, writer->timer_fd, &ev) == -1)
+    {
+        epoll_ctl(event_fd, EPOLL_CTL_DEL, writer->done_fd, NULL);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void vcap_push_completion(vcap_device* vd, vcap_control_id ctrl, int32_t value, int result)
+{
+    assert(vd != NULL);
+
+    // Remove the pending write
+    for (uint32_t i = 0; i < vd->wait_count; i++)
+    {
+        if (vd->waits[i].id == ctrl)
+        {
+            vd->waits[i] = vd->waits[--vd->wait_count];
+            break;
+        }
+    }
+
+    vcap_event event;
+    VCAP_CLEAR(event);
+
+    event.type = VCAP_EVENT_CTRL_COMPLETE;
+
+    event.data.complete.id     = ctrl;
+    event.data.complete.value  = value;
+    event.data.complete.result = result;
+
+    // Value changes made through the writer bypass the value cache
+    vcap_control_cache* entry = vcap_find_control(vd, ctrl);
+
+    if (entry && result == VCAP_OK)
+        vcap_store_value(vd, entry, value, true);
+
+    vcap_push_event(vd, &event);
+}
+
+static uint64_t vcap_monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t vcap_monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint32_t vcap_format_field(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    if (!vd->fmt_valid && vcap_get_format(vd, NULL, NULL) == VCAP_ERROR)
+        return V4L2_FIELD_NONE;
+
+    return vd->fmt.fmt.pix.field;
+}
+
+static int vcap_ext_ctrls(vcap_device* vd, long unsigned request, vcap_control_value* ctrls, uint32_t count, uint32_t* error_index)
+{
+    assert(vd != NULL);
+    assert(ctrls != NULL || count == 0);
+
+    if (error_index)
+        *error_index = count;
+
+    if (!ctrls && count > 0)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    if (count == 0)
+        return VCAP_OK;
+
+    if (vcap_cache_controls(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
+
+    vcap_sync_writer(vd);
+
+    // Small batches don't require an allocation
+    struct v4l2_ext_control stack_ctrls[VCAP_EXT_CTRL_STACK_COUNT];
+    struct v4l2_ext_control* ext_ctrls = stack_ctrls;
+
+    if (count > VCAP_EXT_CTRL_STACK_COUNT)
+    {
+        ext_ctrls = (struct v4l2_ext_control*)vcap_malloc(count * sizeof(struct v4l2_ext_control));
+
+        if (!ext_ctrls)
+        {
+            vcap_set_error(vd, "Out of memory");
+            return VCAP_ERROR;
+        }
+    }
+
+    memset(ext_ctrls, 0, count * sizeof(struct v4l2_ext_control));
+
+    bool cached = vd->value_cache;
+
+    // Map control IDs
+    for (uint32_t i = 0; i < count; i++)
+    {
+        vcap_control_cache* entry = vcap_ctrl_valid(ctrls[i].id) ? vcap_find_control(vd, ctrls[i].id) : NULL;
+
+        if (!entry)
+        {
+            vcap_set_error(vd, "Invalid control ID (%u)", ctrls[i].id);
+
+            if (error_index)
+                *error_index = i;
+
+            if (ext_ctrls != stack_ctrls)
+                vcap_free(ext_ctrls);
+
+            return VCAP_INVALID;
+        }
+
+        ext_ctrls[i].id    = entry->v4l2_id;
+        ext_ctrls[i].value = ctrls[i].value;
+
+        // Track whether the value cache can answer the whole batch
+        if (!entry->value_valid || !vcap_value_cacheable(vd, entry))
+            cached = false;
+        else if (request == VIDIOC_S_EXT_CTRLS && entry->value != ctrls[i].value)
+            cached = false;
+    }
+
+    // Every value is already known (get) or already set (set)
+    if (cached && request != VIDIOC_TRY_EXT_CTRLS)
+    {
+        if (request == VIDIOC_G_EXT_CTRLS)
+        {
+            for (uint32_t i = 0; i < count; i++)
+                ctrls[i].value = vcap_find_control(vd, ctrls[i].id)->value;
+        }
+
+        if (ext_ctrls != stack_ctrls)
+            vcap_free(ext_ctrls);
+
+        return VCAP_OK;
+    }
+
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-ext-ctrls.html
+    struct v4l2_ext_controls ext;
+    VCAP_CLEAR(ext);
+
+    ext.which     = V4L2_CTRL_WHICH_CUR_VAL;
+    ext.count     = count;
+    ext.controls  = ext_ctrls;
+    ext.error_idx = count;
+
+    if (vcap_ioctl(vd->fd, request, &ext) == -1)
+    {
+        uint32_t failed = ext.error_idx;
+
+        // A set that fails validation reports no index, a try locates it
+        if (failed >= count && request == VIDIOC_S_EXT_CTRLS)
+        {
+            int error = errno;
+
+            for (uint32_t i = 0; i < count; i++)
+                ext_ctrls[i].value = ctrls[i].value;
+
+            ext.error_idx = count;
+
+            if (vcap_ioctl(vd->fd, VIDIOC_TRY_EXT_CTRLS, &ext) == -1 && ext.error_idx < count)
+                failed = ext.error_idx;
+
+            errno = error;
+        }
+
+        if (failed < count)
+        {
+            vcap_set_error_errno(vd, "Control (%u) failed on device %s", ctrls[failed].id, vd->path);
+
+            if (error_index)
+                *error_index = failed;
+        }
+        else
+        {
+            vcap_set_error_errno(vd, "Unable to access controls on device %s", vd->path);
+        }
+
+        // A failed set may have been partially applied
+        if (request == VIDIOC_S_EXT_CTRLS)
+            vcap_invalidate_values(vd);
+
+        if (ext_ctrls != stack_ctrls)
+            vcap_free(ext_ctrls);
+
+        return VCAP_ERROR;
+    }
+
+    // Copy values back (set doesn't modify them)
+    if (request != VIDIOC_S_EXT_CTRLS)
+    {
+        for (uint32_t i = 0; i < count; i++)
+            ctrls[i].value = ext_ctrls[i].value;
+    }
+
+    if (request == VIDIOC_S_EXT_CTRLS)
+    {
+        for (uint32_t i = 0; i < count; i++)
+            vcap_note_write(vd, vcap_find_control(vd, ctrls[i].id));
+    }
+
+    // Remember the values read or written
+    if (vd->value_cache && request != VIDIOC_TRY_EXT_CTRLS)
+    {
+        // A batch that changes other controls invalidates them once, so the
+        // values of the batch itself are kept
+        if (request == VIDIOC_S_EXT_CTRLS)
+        {
+            for (uint32_t i = 0; i < count; i++)
+            {
+                if (vcap_find_control(vd, ctrls[i].id)->flags & V4L2_CTRL_FLAG_UPDATE)
+                {
+                    vcap_invalidate_values(vd);
+                    break;
+                }
+            }
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+            vcap_store_value(vd, vcap_find_control(vd, ctrls[i].id), ext_ctrls[i].value, false);
+    }
+
+    if (ext_ctrls != stack_ctrls)
+        vcap_free(ext_ctrls);
+
+    return VCAP_OK;
+}
+
+static int vcap_capture_mmap(vcap_device* vd, size_t size, uint8_t* data)
+{
+    assert(vd != NULL);
+    assert(data != NULL);
+
+    if (!data)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    if (!vcap_is_streaming(vd))
+    {
+        vcap_set_error(vd, "Stream on %s must be active in order to grab frame", vd->path);
+        return VCAP_ERROR;
+    }
+
+    struct v4l2_buffer buf;
+    VCAP_CLEAR(buf);
+
+    while (true)
+    {
+        int result = vcap_wait_frame(vd);
+
+        if (result != VCAP_OK)
+            return result;
+
+	    // Dequeue buffer
+	    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-qbuf.htm
+
+        VCAP_CLEAR(buf);
+
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+
+        if (vcap_ioctl(vd->fd, VIDIOC_DQBUF, &buf) == -1)
+        {
+            if (errno == EAGAIN)
+            {
+                continue;
+            }
+            else if (errno == EPIPE)
+            {
+                // The last buffer was already dequeued
+                vcap_set_error(vd, "End of stream on device %s", vd->path);
+                return VCAP_END_OF_STREAM;
+            }
+            else
+            {
+                vcap_set_error_errno(vd, "Could not dequeue buffer on %s", vd->path);
+                return VCAP_ERROR;
+            }
+        }
+
+        break;
+    }
+
+    // Copy buffer data
+    memcpy(data, vd->buffers[buf.index].data, size);
+
+    // Drivers that don't report the field of each buffer use the format's
+    vd->frame_info.sequence   = buf.sequence;
+    vd->frame_info.field      = (buf.field == V4L2_FIELD_ANY) ? vcap_format_field(vd) : buf.field;
+    vd->frame_info.timestamp  = (uint64_t)buf.timestamp.tv_sec * 1000000 + (uint64_t)buf.timestamp.tv_usec;
+    vd->frame_info.bytes_used = buf.bytesused;
+
+    // Requeue buffer
+	// https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-qbuf.html
+    if (vcap_ioctl(vd->fd, VIDIOC_QBUF, &buf) == -1)
+    {
+        // The capture failed, so there is no frame to describe
+        vd->frame_info_valid = false;
+        vcap_set_error_errno(vd, "Could not requeue buffer on %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    vd->frame_info_valid = true;
+
+    return VCAP_OK;
+}
+
+static int vcap_capture_read(vcap_device* vd, size_t size, uint8_t* data)
+{
+    assert(vd != NULL);
+    assert(data != NULL);
+
+    if (!data)
+    {
+        vcap_set_error(vd, "Argument can't be null");
+        return VCAP_ERROR;
+    }
+
+    while (true)
+    {
+        int result = vcap_wait_frame(vd);
+
+        if (result != VCAP_OK)
+            return result;
+
+        ssize_t bytes = v4l2_read(vd->fd, data, size);
+
+        if (bytes == -1)
+        {
+            if (errno == EAGAIN)
+            {
+                continue;
+            }
+            else
+            {
+                vcap_set_error_errno(vd, "Reading from device %s failed", vd->path);
+                return VCAP_ERROR;
+            }
+        }
+
+        // Read/write I/O carries no metadata
+        vd->frame_info.sequence   = vd->frame_info_valid ? vd->frame_info.sequence + 1 : 0;
+        vd->frame_info.field      = vcap_format_field(vd);
+        vd->frame_info.timestamp  = vcap_monotonic_us();
+        vd->frame_info.bytes_used = (uint32_t)bytes;
+        vd->frame_info_valid = true;
+
+        return VCAP_OK; // Break out of loop
+    }
+
+    return VCAP_ERROR;
+}
+
+static void vcap_ustrcpy(uint8_t* dst, const uint8_t* src, size_t size)
+{
+    assert(dst != NULL);
+    assert(src != NULL);
+
+    snprintf((char*)dst, size, "%s", (char*)src);
+}
+
+static void vcap_strcpy(char* dst, const char* src, size_t size)
+{
+    assert(dst != NULL);
+    assert(src != NULL);
+
+    snprintf(dst, size, "%s", src);
+}
+
+void vcap_set_error_str(const char* func, int line, vcap_device* vd, const char* fmt, ...)
+{
+    assert(vd != NULL);
+    assert(fmt != NULL);
+
+    char error_msg1[512];
+    char error_msg2[512];
+
+    snprintf(error_msg1, sizeof(error_msg1), "[%s:%d]", func, line);
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(error_msg2, sizeof(error_msg2), fmt, args);
+    va_end(args);
+
+    snprintf(vd->error_msg, sizeof(vd->error_msg), "%s %s", error_msg1, error_msg2);
+}
+
+void vcap_set_error_errno_str(const char* func, int line, vcap_device* vd, const char* fmt, ...)
+{
+    assert(vd != NULL);
+    assert(fmt != NULL);
+
+    char error_msg1[512];
+    char error_msg2[512];
+
+    snprintf(error_msg1, sizeof(error_msg1), "[%s:%d]", func, line);
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(error_msg2, sizeof(error_msg2), fmt, args);
+    va_end(args);
+
+    snprintf(vd->error_msg, sizeof(vd->error_msg), "%s %s (%s)", error_msg1, error_msg2, strerror(errno));
+}
+
+//==============================================================================
+// Capability Cache Functions
+//==============================================================================
+
+static void* vcap_grow_array(void* array, uint32_t count, uint32_t* capacity, size_t elem_size)
+{
+    assert(capacity != NULL);
+
+    if (count < *capacity)
+        return array;
+
+    uint32_t new_capacity = (*capacity > 0) ? *capacity * 2 : 8;
+    void* new_array = vcap_malloc(new_capacity * elem_size);
+
+    if (!new_array)
+        return NULL;
+
+    if (array)
+    {
+        memcpy(new_array, array, count * elem_size);
+        vcap_free(array);
+    }
+
+    *capacity = new_capacity;
+
+    return new_array;
+}
+
+//
+// Builds the entire format -> size -> rate tree in one pass. All format, size
+// and rate enumeration is served from this tree until the cache is invalidated.
+//
+static int vcap_cache_formats(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    if (vd->fmts_cached)
+        return VCAP_OK;
+
+    vcap_free_format_cache(vd);
+
+    uint32_t capacity = 0;
+    vcap_format_info info;
+    uint32_t pixelformat;
+    uint32_t flags;
+    int result;
+
+    for (uint32_t i = 0; (result = vcap_query_fmt(vd, i, &info, &pixelformat, &flags)) == VCAP_OK; i++)
+    {
+        vcap_format_cache* fmts = (vcap_format_cache*)vcap_grow_array(vd->fmts, vd->fmt_count, &capacity, sizeof(vcap_format_cache));
+
+        if (!fmts)
+        {
+            vcap_set_error(vd, "Out of memory while caching formats on device %s", vd->path);
+            vcap_free_format_cache(vd);
+            return VCAP_ERROR;
+        }
+
+        vd->fmts = fmts;
+
+        vcap_format_cache* entry = &vd->fmts[vd->fmt_count++];
+        VCAP_CLEAR(*entry);
+
+        entry->info = info;
+        entry->pixelformat = pixelformat;
+        entry->flags = flags;
+
+        if (vcap_cache_sizes(vd, entry) == VCAP_ERROR)
+        {
+            vcap_free_format_cache(vd);
+            return VCAP_ERROR;
+        }
+    }
+
+    if (result == VCAP_ERROR)
+    {
+        vcap_free_format_cache(vd);
+        return VCAP_ERROR;
+    }
+
+    vd->fmts_cached = true;
+
+    return VCAP_OK;
+}
+
+static int vcap_cache_sizes(vcap_device* vd, vcap_format_cache* fmt)
+{
+    assert(vd != NULL);
+    assert(fmt != NULL);
+
+    uint32_t capacity = 0;
+    vcap_size size;
+    vcap_size_range range;
+    bool stepwise;
+    int result;
+
+    for (uint32_t i = 0; (result = vcap_query_size(vd, fmt->pixelformat, i, &size, &range, &stepwise)) == VCAP_OK; i++)
+    {
+        // Stepwise and continuous sizes are reported once, as a range
+        if (stepwise)
+        {
+            fmt->has_size_range = true;
+            fmt->size_range = range;
+            break;
+        }
+
+        vcap_size_cache* sizes = (vcap_size_cache*)vcap_grow_array(fmt->sizes, fmt->size_count, &capacity, sizeof(vcap_size_cache));
+
+        if (!sizes)
+        {
+            vcap_set_error(vd, "Out of memory while caching frame sizes on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+
+        fmt->sizes = sizes;
+
+        vcap_size_cache* entry = &fmt->sizes[fmt->size_count++];
+        VCAP_CLEAR(*entry);
+
+        entry->size = size;
+
+        if (vcap_cache_rates(vd, fmt->pixelformat, entry) == VCAP_ERROR)
+            return VCAP_ERROR;
+    }
+
+    return (result == VCAP_ERROR) ? VCAP_ERROR : VCAP_OK;
+}
+
+static int vcap_cache_rates(vcap_device* vd, uint32_t pixelformat, vcap_size_cache* size)
+{
+    assert(vd != NULL);
+    assert(size != NULL);
+
+    uint32_t capacity = 0;
+    vcap_rate rate;
+    vcap_rate_range range;
+    bool stepwise;
+    int result;
+
+    for (uint32_t i = 0; (result = vcap_query_rate(vd, pixelformat, size->size, i, &rate, &range, &stepwise)) == VCAP_OK; i++)
+    {
+        // Stepwise and continuous rates are reported once, as a range
+        if (stepwise)
+        {
+            size->has_rate_range = true;
+            size->rate_range = range;
+            break;
+        }
+
+        vcap_rate* rates = (vcap_rate*)vcap_grow_array(size->rates, size->rate_count, &capacity, sizeof(vcap_rate));
+
+        if (!rates)
+        {
+            vcap_set_error(vd, "Out of memory while caching frame rates on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+
+        size->rates = rates;
+        size->rates[size->rate_count++] = rate;
+    }
+
+    return (result == VCAP_ERROR) ? VCAP_ERROR : VCAP_OK;
+}
+
+static void vcap_free_formats(vcap_format_cache* fmts, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        vcap_format_cache* fmt = &fmts[i];
+
+        for (uint32_t j = 0; j < fmt->size_count; j++)
+            vcap_free(fmt->sizes[j].rates);
+
+        vcap_free(fmt->sizes);
+    }
+
+    vcap_free(fmts);
+}
+
+static void vcap_free_format_cache(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    vcap_free_formats(vd->fmts, vd->fmt_count);
+
+    vd->fmts = NULL;
+    vd->fmt_count = 0;
+    vd->fmts_cached = false;
+}
+
+static vcap_format_cache* vcap_find_format(vcap_device* vd, vcap_format_id fmt)
+{
+    assert(vd != NULL);
+
+    for (uint32_t i = 0; i < vd->fmt_count; i++)
+    {
+        if (vd->fmts[i].info.id == fmt)
+            return &vd->fmts[i];
+    }
+
+    return NULL;
+}
+
+static vcap_size_cache* vcap_find_size(vcap_format_cache* fmt, vcap_size size)
+{
+    assert(fmt != NULL);
+
+    for (uint32_t i = 0; i < fmt->size_count; i++)
+    {
+        if (fmt->sizes[i].size.width == size.width && fmt->sizes[i].size.height == size.height)
+            return &fmt->sizes[i];
+    }
+
+    return NULL;
+}
+
+static int vcap_query_fmt(vcap_device* vd, uint32_t index, vcap_format_info* info, uint32_t* pixelformat, uint32_t* flags)
+{
+    assert(vd != NULL);
+    assert(info != NULL);
+    assert(pixelformat != NULL);
+    assert(flags != NULL);
+
+    // Enumerate formats
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-enum-fmt.html
+    struct v4l2_fmtdesc fmtd;
+    VCAP_CLEAR(fmtd);
+
+    fmtd.type  = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmtd.index = index;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_ENUM_FMT, &fmtd) == -1)
+    {
+        if (errno == EINVAL)
+        {
+            return VCAP_INVALID;
+        }
+        else
+        {
+            vcap_set_error_errno(vd, "Unable to enumerate formats on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+
+    // Copy description
+    vcap_ustrcpy(info->name, fmtd.description, sizeof(info->name));
+
+    // Convert FOURCC code
+    vcap_fourcc_str(fmtd.pixelformat, info->fourcc);
+
+    // Copy pixel format
+    info->id = vcap_convert_fmt(fmtd.pixelformat);
+    *pixelformat = fmtd.pixelformat;
+    *flags = fmtd.flags;
+
+    return VCAP_OK;
+}
+
+static int vcap_query_size(vcap_device* vd, uint32_t pixelformat, uint32_t index, vcap_size* size, vcap_size_range* range, bool* stepwise)
+{
+    assert(vd != NULL);
+    assert(size != NULL);
+    assert(range != NULL);
+    assert(stepwise != NULL);
+
+    // Enumerate frame sizes
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-enum-framesizes.html
+    struct v4l2_frmsizeenum fenum;
+    VCAP_CLEAR(fenum);
+
+    fenum.pixel_format = pixelformat;
+    fenum.index = index;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_ENUM_FRAMESIZES, &fenum) == -1)
+    {
+        if (errno == EINVAL)
+        {
+            return VCAP_INVALID;
+        }
+        else
+        {
+            vcap_set_error_errno(vd, "Unable to enumerate sizes on device '%s'", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+
+    *stepwise = (fenum.type != V4L2_FRMSIZE_TYPE_DISCRETE);
+
+    if (*stepwise)
+    {
+        range->min.width   = fenum.stepwise.min_width;
+        range->min.height  = fenum.stepwise.min_height;
+        range->max.width   = fenum.stepwise.max_width;
+        range->max.height  = fenum.stepwise.max_height;
+
+        // Continuous ranges have a step of one pixel
+        range->step.width  = (fenum.type == V4L2_FRMSIZE_TYPE_CONTINUOUS) ? 1 : fenum.stepwise.step_width;
+        range->step.height = (fenum.type == V4L2_FRMSIZE_TYPE_CONTINUOUS) ? 1 : fenum.stepwise.step_height;
+    }
+    else
+    {
+        size->width  = fenum.discrete.width;
+        size->height = fenum.discrete.height;
+    }
+
+    return VCAP_OK;
+}
+
+static int vcap_query_rate(vcap_device* vd, uint32_t pixelformat, vcap_size size, uint32_t index, vcap_rate* rate, vcap_rate_range* range, bool* stepwise)
+{
+    assert(vd != NULL);
+    assert(rate != NULL);
+    assert(range != NULL);
+    assert(stepwise != NULL);
+
+    // Enumerate frame rates
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-enum-frameintervals.html
+    struct v4l2_frmivalenum frenum;
+    VCAP_CLEAR(frenum);
+
+    frenum.pixel_format = pixelformat;
+    frenum.index  = index;
+    frenum.width  = size.width;
+    frenum.height = size.height;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_ENUM_FRAMEINTERVALS, &frenum) == -1)
+    {
+        if (errno == EINVAL)
+        {
+            return VCAP_INVALID;
+        }
+        else
+        {
+            vcap_set_error_errno(vd, "Unable to enumerate frame rates on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+
+    *stepwise = (frenum.type != V4L2_FRMIVAL_TYPE_DISCRETE);
+
+    // NOTE: We swap the numerator and denominator because Vcap uses frame rates
+    // instead of intervals. The longest interval is the slowest rate.
+    if (*stepwise)
+    {
+        range->min.numerator   = frenum.stepwise.max.denominator;
+        range->min.denominator = frenum.stepwise.max.numerator;
+        range->max.numerator   = frenum.stepwise.min.denominator;
+        range->max.denominator = frenum.stepwise.min.numerator;
+
+        if (frenum.type == V4L2_FRMIVAL_TYPE_CONTINUOUS)
+        {
+            range->step.numerator   = 0;
+            range->step.denominator = 1;
+        }
+        else
+        {
+            range->step.numerator   = frenum.stepwise.step.numerator;
+            range->step.denominator = frenum.stepwise.step.denominator;
+        }
+    }
+    else
+    {
+        rate->numerator   = frenum.discrete.denominator;
+        rate->denominator = frenum.discrete.numerator;
+    }
+
+    return VCAP_OK;
+}
+
+static bool vcap_size_in_range(const vcap_size_range* range, vcap_size size)
+{
+    assert(range != NULL);
+
+    if (size.width < range->min.width || size.width > range->max.width ||
+        size.height < range->min.height || size.height > range->max.height)
+    {
+        return false;
+    }
+
+    if (range->step.width > 1 && (size.width - range->min.width) % range->step.width != 0)
+        return false;
+
+    if (range->step.height > 1 && (size.height - range->min.height) % range->step.height != 0)
+        return false;
+
+    return true;
+}
+
+static bool vcap_rate_from_range(const vcap_rate_range* range, vcap_rate min, vcap_rate* rate)
+{
+    assert(range != NULL);
+    assert(rate != NULL);
+
+    if (range->min.numerator == 0 || range->min.denominator == 0 ||
+        range->max.numerator == 0 || range->max.denominator == 0)
+    {
+        return false;
+    }
+
+    // Any rate will do, so take the slowest
+    if (min.numerator == 0 || min.denominator == 0 ||
+        (uint64_t)range->min.numerator * min.denominator >= (uint64_t)min.numerator * range->min.denominator)
+    {
+        *rate = range->min;
+        return true;
+    }
+
+    // Too fast for the device
+    if ((uint64_t)range->max.numerator * min.denominator < (uint64_t)min.numerator * range->max.denominator)
+        return false;
+
+    // Any rate in a continuous range is valid
+    if (range->step.numerator == 0 || range->step.denominator == 0)
+    {
+        *rate = min;
+        return true;
+    }
+
+    // Otherwise take the longest interval on the grid (shortest interval plus
+    // a multiple of the step) that isn't longer than the requested one, all
+    // intervals as fractions over a common denominator
+    uint64_t den = (uint64_t)range->max.numerator * range->step.denominator;
+    uint64_t base = (uint64_t)range->max.denominator * range->step.denominator;
+    uint64_t step = (uint64_t)range->step.numerator * range->max.numerator;
+
+    // Fall back to the fastest rate rather than overflow
+    if (den > UINT32_MAX || base > UINT32_MAX || step > UINT32_MAX)
+    {
+        *rate = range->max;
+        return true;
+    }
+
+    // Requested interval is min.denominator / min.numerator
+    uint64_t limit = (uint64_t)min.denominator * den;
+    uint64_t k = (limit / min.numerator - base) / step;
+    uint64_t num = base + k * step;
+
+    // Reduce the fraction so that it fits the rate
+    uint64_t a = num, b = den;
+
+    while (b != 0)
+    {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+
+    num /= a;
+    den /= a;
+
+    if (num > UINT32_MAX || den > UINT32_MAX)
+        return false;
+
+    rate->numerator   = (uint32_t)den;
+    rate->denominator = (uint32_t)num;
+
+    return true;
+}
+
+static int vcap_try_format(vcap_device* vd, vcap_format_id fmt, vcap_size size, vcap_format_id* actual_fmt, vcap_size* actual_size)
+{
+    assert(vd != NULL);
+    assert(actual_fmt != NULL);
+    assert(actual_size != NULL);
+
+    // Try format without changing the device state
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-fmt.html
+    struct v4l2_format tfmt;
+    VCAP_CLEAR(tfmt);
+
+    tfmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    tfmt.fmt.pix.pixelformat = vcap_map_fmt(fmt);
+    tfmt.fmt.pix.width       = size.width;
+    tfmt.fmt.pix.height      = size.height;
+    tfmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
+
+    if (vcap_ioctl(vd->fd, VIDIOC_TRY_FMT, &tfmt) == -1)
+    {
+        if (errno == EINVAL)
+            return VCAP_INVALID;
+
+        vcap_set_error_errno(vd, "Unable to try format on device %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    *actual_fmt = vcap_convert_fmt(tfmt.fmt.pix.pixelformat);
+    actual_size->width  = tfmt.fmt.pix.width;
+    actual_size->height = tfmt.fmt.pix.height;
+
+    return VCAP_OK;
+}
+
+static int vcap_try_native_format(vcap_device* vd, vcap_format_id fmt, vcap_size size, vcap_format_id* actual_fmt, vcap_size* actual_size)
+{
+    assert(vd != NULL);
+    assert(actual_fmt != NULL);
+    assert(actual_size != NULL);
+
+    // Same as vcap_try_format, but bypasses libv4l2 so the driver answers
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-g-fmt.html
+    struct v4l2_format tfmt;
+    VCAP_CLEAR(tfmt);
+
+    tfmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    tfmt.fmt.pix.pixelformat = vcap_map_fmt(fmt);
+    tfmt.fmt.pix.width       = size.width;
+    tfmt.fmt.pix.height      = size.height;
+    tfmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
+
+    int result;
+
+    do
+    {
+        result = ioctl(vd->fd, VIDIOC_TRY_FMT, &tfmt);
+    }
+    while (result == -1 && (errno == EINTR || errno == EAGAIN));
+
+    if (result == -1)
+    {
+        if (errno == EINVAL)
+            return VCAP_INVALID;
+
+        vcap_set_error_errno(vd, "Unable to try format on device %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    *actual_fmt = vcap_convert_fmt(tfmt.fmt.pix.pixelformat);
+    actual_size->width  = tfmt.fmt.pix.width;
+    actual_size->height = tfmt.fmt.pix.height;
+
+    return VCAP_OK;
+}
+
+static int vcap_add_candidate(vcap_device* vd, const vcap_format_request* request, vcap_format_cache* fmt,
+                              const vcap_size_cache* size_entry, vcap_format_candidate** candidates,
+                              uint32_t* count, uint32_t* capacity)
+{
+    assert(vd != NULL);
+    assert(request != NULL);
+    assert(fmt != NULL);
+    assert(size_entry != NULL);
+    assert(candidates != NULL);
+
+    vcap_size size = size_entry->size;
+
+    // The frame must be at least as large as requested
+    if (size.width < request->size.width || size.height < request->size.height)
+        return VCAP_OK;
+
+    // The lowest rate that is fast enough uses the least bandwidth
+    bool any_rate = (request->rate.numerator == 0 || request->rate.denominator == 0);
+    bool found = false;
+    vcap_rate best = { 0, 0 };
+
+    if (size_entry->has_rate_range)
+        found = vcap_rate_from_range(&size_entry->rate_range, request->rate, &best);
+
+    for (uint32_t i = 0; i < size_entry->rate_count; i++)
+    {
+        vcap_rate rate = size_entry->rates[i];
+
+        if (rate.numerator == 0 || rate.denominator == 0)
+            continue;
+
+        if (!any_rate && (uint64_t)rate.numerator * request->rate.denominator <
+                         (uint64_t)request->rate.numerator * rate.denominator)
+        {
+            continue;
+        }
+
+        if (!found || (uint64_t)rate.numerator * best.denominator < (uint64_t)best.numerator * rate.denominator)
+        {
+            best = rate;
+            found = true;
+        }
+    }
+
+    if (!found)
+        return VCAP_OK;
+
+    vcap_format_candidate* array = (vcap_format_candidate*)vcap_grow_array(*candidates, *count, capacity, sizeof(vcap_format_candidate));
+
+    if (!array)
+    {
+        vcap_set_error(vd, "Out of memory while negotiating format on device %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    *candidates = array;
+
+    vcap_format_candidate* candidate = &array[(*count)++];
+
+    double pixels = (double)size.width * size.height * best.numerator / best.denominator;
+
+    candidate->fmt = fmt;
+    candidate->size = size;
+    candidate->rate = best;
+    candidate->bandwidth = pixels * vcap_get_format_entry(fmt->info.id)->bits / 8.0;
+    candidate->cpu = pixels * vcap_conversion_cost(fmt->info.id, request->format);
+
+    // One unit of CPU cost is weighted like one byte of bus traffic
+    candidate->cost = candidate->bandwidth + candidate->cpu;
+
+    return VCAP_OK;
+}
+
+static int vcap_add_range_candidate(vcap_device* vd, const vcap_format_request* request, vcap_format_cache* fmt,
+                                    vcap_format_candidate** candidates, uint32_t* count, uint32_t* capacity)
+{
+    assert(vd != NULL);
+    assert(request != NULL);
+    assert(fmt != NULL);
+
+    const vcap_size_range* range = &fmt->size_range;
+
+    // Round the requested size up to the next step
+    uint32_t dims[2] = { request->size.width, request->size.height };
+    uint32_t mins[2] = { range->min.width, range->min.height };
+    uint32_t maxs[2] = { range->max.width, range->max.height };
+    uint32_t steps[2] = { range->step.width, range->step.height };
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (dims[i] <= mins[i])
+        {
+            dims[i] = mins[i];
+        }
+        else if (steps[i] > 1)
+        {
+            dims[i] = mins[i] + (dims[i] - mins[i] + steps[i] - 1) / steps[i] * steps[i];
+        }
+
+        if (dims[i] > maxs[i])
+            return VCAP_OK;
+    }
+
+    // Frame rates depend on the size, so they are enumerated on demand
+    vcap_size_cache entry;
+    VCAP_CLEAR(entry);
+
+    entry.size.width  = dims[0];
+    entry.size.height = dims[1];
+
+    int result = vcap_cache_rates(vd, fmt->pixelformat, &entry);
+
+    if (result == VCAP_OK)
+        result = vcap_add_candidate(vd, request, fmt, &entry, candidates, count, capacity);
+
+    vcap_free(entry.rates);
+
+    return result;
+}
+
+static int vcap_compare_candidates(const void* a, const void* b)
+{
+    const vcap_format_candidate* ca = (const vcap_format_candidate*)a;
+    const vcap_format_candidate* cb = (const vcap_format_candidate*)b;
+
+    if (ca->cost < cb->cost)
+        return -1;
+
+    if (ca->cost > cb->cost)
+        return 1;
+
+    return 0;
+}
+
+static double vcap_conversion_cost(vcap_format_id from, vcap_format_id to)
+{
+    assert(from < VCAP_FMT_COUNT);
+    assert(to < VCAP_FMT_COUNT);
+
+    if (from == to)
+        return 0.0;
+
+    return vcap_get_format_entry(from)->cpu + vcap_get_format_entry(to)->cpu;
+}
+
+//
+// Builds the control metadata cache. Controls are walked with the NEXT_CTRL
+// flag so that a full walk costs one ioctl per control, and driver-private
+// controls are included.
+//
+static int vcap_cache_controls(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    if (vd->ctrls_cached)
+        return VCAP_OK;
+
+    vcap_free_control_cache(vd);
+
+    // Prefer VIDIOC_QUERY_EXT_CTRL, then fall back to VIDIOC_QUERYCTRL and
+    // finally to probing every known control
+    int result = vcap_cache_next_controls(vd, true);
+
+    if (result == VCAP_INVALID)
+        result = vcap_cache_next_controls(vd, false);
+
+    if (result == VCAP_INVALID)
+        result = vcap_cache_known_controls(vd);
+
+    if (result == VCAP_ERROR)
+    {
+        vcap_free_control_cache(vd);
+        return VCAP_ERROR;
+    }
+
+    vd->ctrls_cached = true;
+
+    return VCAP_OK;
+}
+
+//
+// Returns VCAP_INVALID if the driver doesn't support the requested ioctl or
+// the NEXT_CTRL flag
+//
+static int vcap_cache_next_controls(vcap_device* vd, bool extended)
+{
+    assert(vd != NULL);
+
+    uint32_t id = 0;
+
+    while (true)
+    {
+        int result;
+
+        if (extended)
+        {
+            // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-queryctrl.html
+            struct v4l2_query_ext_ctrl qctrl;
+            VCAP_CLEAR(qctrl);
+
+            qctrl.id = id | V4L2_CTRL_FLAG_NEXT_CTRL;
+            result = vcap_ioctl(vd->fd, VIDIOC_QUERY_EXT_CTRL, &qctrl);
+
+            if (result == 0)
+            {
+                id = qctrl.id;
+
+                // Arrays and compound controls are not supported
+                if (qctrl.nr_of_dims > 0)
+                    continue;
+
+                if (vcap_add_control(vd, qctrl.id, qctrl.type, qctrl.name,
+                                     qctrl.minimum, qctrl.maximum, qctrl.step,
+                                     qctrl.default_value, qctrl.flags) == VCAP_ERROR)
+                    return VCAP_ERROR;
+            }
+        }
+        else
+        {
+            // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-queryctrl.html
+            struct v4l2_queryctrl qctrl;
+            VCAP_CLEAR(qctrl);
+
+            qctrl.id = id | V4L2_CTRL_FLAG_NEXT_CTRL;
+            result = vcap_ioctl(vd->fd, VIDIOC_QUERYCTRL, &qctrl);
+
+            if (result == 0)
+            {
+                id = qctrl.id;
+
+                if (vcap_add_control(vd, qctrl.id, qctrl.type, (const char*)qctrl.name,
+                                     qctrl.minimum, qctrl.maximum, qctrl.step,
+                                     qctrl.default_value, qctrl.flags) == VCAP_ERROR)
+                    return VCAP_ERROR;
+            }
+        }
+
+        if (result == -1)
+        {
+            // End of the list (or NEXT_CTRL unsupported if nothing was found)
+            if (errno == EINVAL)
+                return (id == 0) ? VCAP_INVALID : VCAP_OK;
+
+            // Ioctl not supported
+            if (errno == ENOTTY)
+                return VCAP_INVALID;
+
+            vcap_set_error_errno(vd, "Unable to enumerate controls on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+    }
+}
+
+static int vcap_cache_known_controls(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    for (vcap_control_id ctrl = 0; ctrl < VCAP_CTRL_COUNT; ctrl++)
+    {
+        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-queryctrl.html
+        struct v4l2_queryctrl qctrl;
+        VCAP_CLEAR(qctrl);
+
+        qctrl.id = vcap_map_ctrl(ctrl);
+
+        if (vcap_ioctl(vd->fd, VIDIOC_QUERYCTRL, &qctrl) == -1)
+        {
+            if (errno == EINVAL)
+                continue;
+
+            vcap_set_error_errno(vd, "Unable to read control info on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+
+        if (vcap_add_control(vd, qctrl.id, qctrl.type, (const char*)qctrl.name,
+                             qctrl.minimum, qctrl.maximum, qctrl.step,
+                             qctrl.default_value, qctrl.flags) == VCAP_ERROR)
+            return VCAP_ERROR;
+    }
+
+    return VCAP_OK;
+}
+
+static int vcap_add_control(vcap_device* vd, uint32_t id, uint32_t type, const char* name,
+                            int64_t min, int64_t max, uint64_t step, int64_t default_value,
+                            uint32_t flags)
+{
+    assert(vd != NULL);
+    assert(name != NULL);
+
+    // Skip control classes and unsupported types
+    if (!vcap_ctrl_type_supported(type))
+        return VCAP_OK;
+
+    vcap_control_cache* ctrls = (vcap_control_cache*)vcap_grow_array(vd->ctrls, vd->ctrl_count, &vd->ctrl_capacity, sizeof(vcap_control_cache));
+
+    if (!ctrls)
+    {
+        vcap_set_error(vd, "Out of memory while caching controls on device %s", vd->path);
+        return VCAP_ERROR;
+    }
+
+    vd->ctrls = ctrls;
+
+    vcap_control_cache* entry = &vd->ctrls[vd->ctrl_count++];
+    VCAP_CLEAR(*entry);
+
+    entry->v4l2_id = id;
+    entry->flags = flags;
+
+    vcap_control_info* info = &entry->info;
+
+    // Copy name
+    vcap_ustrcpy(info->name, (const uint8_t*)name, sizeof(info->name));
+
+    // Copy control ID
+    info->id = vcap_convert_ctrl(id);
+
+    // Copy type
+    info->type = vcap_convert_ctrl_type(type);
+
+    // Copy type string
+    vcap_ustrcpy(info->type_name, (uint8_t*)vcap_ctrl_type_str(info->type), sizeof(info->type_name));
+
+    // Min/Max/Step (supported control types are 32-bit)
+    info->min  = (int32_t)min;
+    info->max  = (int32_t)max;
+    info->step = (int32_t)step;
+
+    // Default
+    info->default_value = (int32_t)default_value;
+
+    // Slider control hint
+    info->slider = (bool)(flags & V4L2_CTRL_FLAG_SLIDER);
+
+    return VCAP_OK;
+}
+
+//
+// Menus are queried once in a single pass over [min, max]
+//
+static int vcap_cache_menu(vcap_device* vd, vcap_control_cache* ctrl)
+{
+    assert(vd != NULL);
+    assert(ctrl != NULL);
+
+    if (ctrl->menu_cached)
+        return VCAP_OK;
+
+    // Discards items left over from an enumeration that failed part way
+    vcap_free(ctrl->menu);
+    ctrl->menu = NULL;
+    ctrl->menu_count = 0;
+
+    vcap_control_info* info = &ctrl->info;
+    uint32_t capacity = 0;
+
+    for (int64_t i = info->min; i <= info->max; i++)
+    {
+        // Query menu
+        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-queryctrl.html
+        struct v4l2_querymenu qmenu;
+        VCAP_CLEAR(qmenu);
+
+        qmenu.id    = ctrl->v4l2_id;
+        qmenu.index = (uint32_t)i;
+
+        if (vcap_ioctl(vd->fd, VIDIOC_QUERYMENU, &qmenu) == -1)
+        {
+            if (errno == EINVAL)
+            {
+                continue;
+            }
+            else
+            {
+                vcap_set_error_errno(vd, "Unable to enumerate menu on device %s", vd->path);
+                return VCAP_ERROR;
+            }
+        }
+
+        vcap_menu_item* menu = (vcap_menu_item*)vcap_grow_array(ctrl->menu, ctrl->menu_count, &capacity, sizeof(vcap_menu_item));
+
+        if (!menu)
+        {
+            vcap_set_error(vd, "Out of memory while caching menu on device %s", vd->path);
+            return VCAP_ERROR;
+        }
+
+        ctrl->menu = menu;
+
+        vcap_menu_item* item = &ctrl->menu[ctrl->menu_count++];
+        VCAP_CLEAR(*item);
+
+        item->index = (uint32_t)i;
+
+        if (info->type == VCAP_CTRL_TYPE_MENU)
+            vcap_ustrcpy(item->label.str, qmenu.name, sizeof(item->label.str));
+        else
+            item->label.num = qmenu.value;
+    }
+
+    ctrl->menu_cached = true;
+
+    return VCAP_OK;
+}
+
+static void vcap_free_controls(vcap_control_cache* ctrls, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        vcap_free(ctrls[i].menu);
+
+    vcap_free(ctrls);
+}
+
+static void vcap_free_control_cache(vcap_device* vd)
+{
+    assert(vd != NULL);
+
+    vcap_free_controls(vd->ctrls, vd->ctrl_count);
+
+    vd->ctrls = NULL;
+    vd->ctrl_count = 0;
+    vd->ctrl_capacity = 0;
+    vd->ctrls_cached = false;
+    vd->ctrl_flags_stale = false;
+}
+
+static void vcap_format_record(const vcap_format_cache* fmt, vcap_format_cache* record)
+{
+    assert(fmt != NULL);
+    assert(record != NULL);
+
+    // Members are copied one by one, struct copies may include padding
+    memset(record, 0, sizeof(vcap_format_cache));
+
+    record->info.id = fmt->info.id;
+    memcpy(record->info.name, fmt->info.name, sizeof(record->info.name));
+    memcpy(record->info.fourcc, fmt->info.fourcc, sizeof(record->info.fourcc));
+
+    record->pixelformat    = fmt->pixelformat;
+    record->flags          = fmt->flags;
+    record->size_count     = fmt->size_count;
+    record->has_size_range = fmt->has_size_range;
+    record->size_range     = fmt->size_range;
+}
+
+static void vcap_size_record(const vcap_size_cache* size, vcap_size_cache* record)
+{
+    assert(size != NULL);
+    assert(record != NULL);
+
+    memset(record, 0, sizeof(vcap_size_cache));
+
+    record->size           = size->size;
+    record->rate_count     = size->rate_count;
+    record->has_rate_range = size->has_rate_range;
+    record->rate_range     = size->rate_range;
+}
+
+static void vcap_control_record(const vcap_control_cache* ctrl, vcap_control_cache* record)
+{
+    assert(ctrl != NULL);
+    assert(record != NULL);
+
+    memset(record, 0, sizeof(vcap_control_cache));
+
+    record->info.id            = ctrl->info.id;
+    record->info.type          = ctrl->info.type;
+    record->info.min           = ctrl->info.min;
+    record->info.max           = ctrl->info.max;
+    record->info.step          = ctrl->info.step;
+    record->info.default_value = ctrl->info.default_value;
+    record->info.slider        = ctrl->info.slider;
+
+    memcpy(record->info.name, ctrl->info.name, sizeof(record->info.name));
+    memcpy(record->info.type_name, ctrl->info.type_name, sizeof(record->info.type_name));
+
+    record->v4l2_id     = ctrl->v4l2_id;
+    record->flags       = ctrl->flags;
+    record->menu_cached = ctrl->menu_cached;
+    record->menu_count  = ctrl->menu_count;
+}
+
+static bool vcap_read_cache(const uint8_t** pos, const uint8_t* end, void* data, size_t size)
+{
+    assert(pos != NULL);
+
+    if ((size_t)(end - *pos) < size)
+        return false;
+
+    if (size > 0)
+        memcpy(data, *pos, size);
+
+    *pos += size;
+
+    return true;
+}
+
+static int vcap_parse_cache_entries(const vcap_cache_header* header, const uint8_t* pos, const uint8_t* end,
+                                    vcap_format_cache** fmts, uint32_t* fmt_count,
+                                    vcap_control_cache** ctrls, uint32_t* ctrl_count)
+{
+    assert(header != NULL);
+    assert(fmts != NULL);
+    assert(fmt_count != NULL);
+    assert(ctrls != NULL);
+    assert(ctrl_count != NULL);
+
+    // Counts are checked against the remaining bytes before allocating
+    if (header->fmt_count > (size_t)(end - pos) / sizeof(vcap_format_cache))
+        return VCAP_INVALID;
+
+    *fmts = (vcap_format_cache*)vcap_malloc(header->fmt_count * sizeof(vcap_format_cache) + 1);
+
+    if (!*fmts)
+        return VCAP_ERROR;
+
+    for (uint32_t i = 0; i < header->fmt_count; i++)
+    {
+        vcap_format_cache* fmt = &(*fmts)[i];
+
+        if (!vcap_read_cache(&pos, end, fmt, sizeof(vcap_format_cache)))
+            return VCAP_INVALID;
+
+        uint32_t size_count = fmt->size_count;
+
+        // IDs are specific to a build, the FourCC is what the driver reported
+        fmt->info.id = vcap_convert_fmt(fmt->pixelformat);
+
+        fmt->sizes = NULL;
+        fmt->size_count = 0;
+        (*fmt_count)++;
+
+        if (size_count > (size_t)(end - pos) / sizeof(vcap_size_cache))
+            return VCAP_INVALID;
+
+        fmt->sizes = (vcap_size_cache*)vcap_malloc(size_count * sizeof(vcap_size_cache) + 1);
+
+        if (!fmt->sizes)
+            return VCAP_ERROR;
+
+        for (uint32_t j = 0; j < size_count; j++)
+        {
+            vcap_size_cache* size = &fmt->sizes[j];
+
+            if (!vcap_read_cache(&pos, end, size, sizeof(vcap_size_cache)))
+                return VCAP_INVALID;
+
+            uint32_t rate_count = size->rate_count;
+
+            size->rates = NULL;
+            size->rate_count = 0;
+            fmt->size_count++;
+
+            if (rate_count > (size_t)(end - pos) / sizeof(vcap_rate))
+                return VCAP_INVALID;
+
+            size->rates = (vcap_rate*)vcap_malloc(rate_count * sizeof(vcap_rate) + 1);
+
+            if (!size->rates)
+                return VCAP_ERROR;
+
+            vcap_read_cache(&pos, end, size->rates, rate_count * sizeof(vcap_rate));
+            size->rate_count = rate_count;
+        }
+    }
+
+    if (header->ctrl_count > (size_t)(end - pos) / sizeof(vcap_control_cache))
+        return VCAP_INVALID;
+
+    *ctrls = (vcap_control_cache*)vcap_malloc(header->ctrl_count * sizeof(vcap_control_cache) + 1);
+
+    if (!*ctrls)
+        return VCAP_ERROR;
+
+    for (uint32_t i = 0; i < header->ctrl_count; i++)
+    {
+        vcap_control_cache* ctrl = &(*ctrls)[i];
+
+        if (!vcap_read_cache(&pos, end, ctrl, sizeof(vcap_control_cache)))
+            return VCAP_INVALID;
+
+        uint32_t menu_count = ctrl->menu_count;
+
+        ctrl->info.id = vcap_convert_ctrl(ctrl->v4l2_id);
+
+        // Values are never persisted
+        ctrl->menu = NULL;
+        ctrl->menu_count = 0;
+        ctrl->value_valid = false;
+        ctrl->write_seq = 0;
+        ctrl->feedback = false;
+        ctrl->subscribed = false;
+        (*ctrl_count)++;
+
+        if (menu_count > (size_t)(end - pos) / sizeof(vcap_menu_item))
+            return VCAP_INVALID;
+
+        if (menu_count > 0)
+        {
+            ctrl->menu = (vcap_menu_item*)vcap_malloc(menu_count * sizeof(vcap_menu_item));
+
+            if (!ctrl->menu)
+                return VCAP_ERROR;
+
+            vcap_read_cache(&pos, end, ctrl->menu, menu_count * sizeof(vcap_menu_item));
+            ctrl->menu_count = menu_count;
+        }
+    }
+
+    if (pos != end)
+        return VCAP_INVALID;
+
+    return VCAP_OK;
+}
+
+static int vcap_parse_cache(vcap_device* vd, const vcap_cache_header* header, const uint8_t* pos, const uint8_t* end)
+{
+    assert(vd != NULL);
+    assert(header != NULL);
+
+    vcap_format_cache* fmts = NULL;
+    vcap_control_cache* ctrls = NULL;
+    uint32_t fmt_count = 0;
+    uint32_t ctrl_count = 0;
+
+    int result = vcap_parse_cache_entries(header, pos, end, &fmts, &fmt_count, &ctrls, &ctrl_count);
+
+    // A corrupt file leaves the current caches untouched
+    if (result != VCAP_OK)
+    {
+        vcap_free_formats(fmts, fmt_count);
+        vcap_free_controls(ctrls, ctrl_count);
+        return result;
+    }
+
+    vcap_free_format_cache(vd);
+    vcap_free_control_cache(vd);
+
+    vd->fmts = fmts;
+    vd->fmt_count = fmt_count;
+    vd->ctrls = ctrls;
+    vd->ctrl_count = ctrl_count;
+    vd->ctrl_capacity = header->ctrl_count;
+
+    vd->fmts_cached = true;
+    vd->ctrls_cached = true;
+
+    // Control flags describe the current state, so they are read again on use
+    vd->ctrl_flags_stale = true;
+
+    return VCAP_OK;
+}
+
+static vcap_control_cache* vcap_find_control(vcap_device* vd, vcap_control_id ctrl)
+{
+    assert(vd != NULL);
+
+    for (uint32_t i = 0; i < vd->ctrl_count; i++)
+    {
+        if (vd->ctrls[i].info.id == ctrl)
+            return &vd->ctrls[i];
+    }
+
+    return NULL;
+}
+
+static bool vcap_value_cacheable(vcap_device* vd, const vcap_control_cache* entry)
+{
+    assert(vd != NULL);
+    assert(entry != NULL);
+
+    // Volatile controls change on their own (e.g. exposure in auto mode) and
+    // write-only controls can't be read back. A value read or written while
+    // the writer still has a value queued would be overwritten behind the cache.
+    return vd->value_cache && entry->write_seq == 0 &&
+           !(entry->flags & (V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_WRITE_ONLY));
+}
+
+static void vcap_settle_writes(vcap_device* vd)
+{
+    assert(vd != NULL);
+    assert(vd->writer != NULL);
+
+    for (uint32_t i = 0; i < vd->ctrl_count; i++)
     {
-        v4l2_close(fd);
-        return VCAP_ERROR;
+        if (vd->ctrls[i].write_seq != 0 && vd->ctrls[i].write_seq <= vd->writer->applied_seq)
+            vd->ctrls[i].write_seq = 0;
     }
+}
 
-    if (!(caps->capabilities & V4L2_CAP_STREAMING) &&
-        !(caps->capabilities & V4L2_CAP_READWRITE))
-    {
-        v4l2_close(fd);
-        return VCAP_ERROR;
-    }
+static void vcap_sync_writer(vcap_device* vd)
+{
+    assert(vd != NULL);
 
-    v4l2_close(fd);
+    vcap_control_writer* writer = vd->writer;
 
-    return VCAP_OK;
+    if (!writer)
+        return;
+
+    pthread_mutex_lock(&writer->mutex);
+    vcap_settle_writes(vd);
+    pthread_mutex_unlock(&writer->mutex);
 }
 
-static int vcap_video_device_filter(const struct dirent* a)
+static void vcap_store_value(vcap_device* vd, vcap_control_cache* entry, int32_t value, bool written)
 {
-    assert(a != NULL);
+    assert(vd != NULL);
+    assert(entry != NULL);
 
-    if (0 == strncmp(a->d_name, "video", 5))
-        return 1;
-    else
-        return 0;
+    // Setting this control may change other controls, reading it doesn't
+    if (written && (entry->flags & V4L2_CTRL_FLAG_UPDATE))
+        vcap_invalidate_values(vd);
+
+    entry->value = value;
+    entry->value_valid = vcap_value_cacheable(vd, entry);
 }
 
-static void vcap_caps_to_info(const char* path, const struct v4l2_capability caps, vcap_device_info* info)
+static void vcap_invalidate_values(vcap_device* vd)
 {
-    assert(path != NULL);
-    assert(info != NULL);
+    assert(vd != NULL);
 
-    // Copy device information
-    vcap_strcpy(info->path, path, sizeof(info->path));
-    vcap_ustrcpy(info->driver, caps.driver, sizeof(info->driver));
-    vcap_ustrcpy(info->card, caps.card, sizeof(info->card));
-    vcap_ustrcpy(info->bus_info, caps.bus_info, sizeof(info->bus_info));
-    info->version = caps.version;
+    for (uint32_t i = 0; i < vd->ctrl_count; i++)
+        vd->ctrls[i].value_valid = false;
+}
 
-    // Decode version
-    snprintf((char*)info->version_str, sizeof(info->version_str), "%u.%u.%u",
-            (caps.version >> 16) & 0xFF,
-            (caps.version >> 8) & 0xFF,
-            (caps.version & 0xFF));
+static void vcap_note_write(vcap_device* vd, const vcap_control_cache* entry)
+{
+    assert(vd != NULL);
 
-    // Determines which output modes are available
-    info->streaming = (bool)(caps.capabilities & V4L2_CAP_STREAMING);
-    info->read = (bool)(caps.capabilities & V4L2_CAP_READWRITE);
+    // E.g. enabling auto white balance makes the temperature control inactive
+    if (entry && (entry->flags & V4L2_CTRL_FLAG_UPDATE))
+        vd->ctrl_flags_stale = true;
 }
 
-static int vcap_request_buffers(vcap_device* vd)
+static int32_t vcap_clamp_value(const vcap_control_info* info, int32_t value)
 {
-    assert(vd != NULL);
+    assert(info != NULL);
 
-    // Requests the specified number of buffers, returning the number of
-    // available buffers
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-reqbufs.html
-    struct v4l2_requestbuffers req;
-    VCAP_CLEAR(req);
+    if (info->type == VCAP_CTRL_TYPE_BOOLEAN)
+        return value ? 1 : 0;
 
-    req.count  = vd->buffer_count;
-    req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+    if (value < info->min)
+        value = info->min;
 
-	if (vcap_ioctl(vd->fd, VIDIOC_REQBUFS, &req) == -1)
-	{
-    	vcap_set_error_errno(vd, "Unable to request buffers on %s", vd->path);
-		return VCAP_ERROR;
-    }
+    if (value > info->max)
+        value = info->max;
 
-    if (req.count == 0)
+    // Round to the nearest step, staying within range
+    if (info->step > 1)
     {
-        vcap_set_error(vd, "Invalid buffer count on %s", vd->path);
-        return VCAP_ERROR;
-    }
+        int64_t offset = ((int64_t)value - info->min + info->step / 2) / info->step * info->step;
 
-    // Changes the number of buffer in the video device to match the number of
-    // available buffers
-    vd->buffer_count = req.count;
+        if (info->min + offset > info->max)
+            offset -= info->step;
 
-    return VCAP_OK;
+        value = (int32_t)(info->min + offset);
+    }
+
+    return value;
 }
 
-static int vcap_init_stream(vcap_device* vd)
+static int vcap_refresh_control_flags(vcap_device* vd)
 {
     assert(vd != NULL);
 
-    if (vd->buffer_count > 0)
+    for (uint32_t i = 0; i < vd->ctrl_count; i++)
     {
-        if (vcap_request_buffers(vd) == VCAP_ERROR)
-            return VCAP_ERROR;
-
-        if (vcap_map_buffers(vd) == VCAP_ERROR)
+        if (vcap_query_control_flags(vd, &vd->ctrls[i]) == VCAP_ERROR)
             return VCAP_ERROR;
-
-        if (vcap_queue_buffers(vd) == VCAP_ERROR)
-            return VCAP_ERROR; // TODO: Unmap buffers on error
     }
 
+    vd->ctrl_flags_stale = false;
+
     return VCAP_OK;
 }
 
-static int vcap_release_buffers(vcap_device* vd)
+static int vcap_query_control_flags(vcap_device* vd, vcap_control_cache* entry)
 {
     assert(vd != NULL);
+    assert(entry != NULL);
 
-    struct v4l2_requestbuffers req;
-    VCAP_CLEAR(req);
+    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-queryctrl.html
+    struct v4l2_queryctrl qctrl;
+    VCAP_CLEAR(qctrl);
 
-    req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
-    req.count  = 0;
+    qctrl.id = entry->v4l2_id;
 
-	if (vcap_ioctl(vd->fd, VIDIOC_REQBUFS, &req) == -1)
-	{
-    	vcap_set_error_errno(vd, "Unable to request buffers on %s", vd->path);
-		return VCAP_ERROR;
+    if (vcap_ioctl(vd->fd, VIDIOC_QUERYCTRL, &qctrl) == -1)
+    {
+        vcap_set_error_errno(vd, "Unable to read control status on device %s", vd->path);
+        return VCAP_ERROR;
     }
 
+    entry->flags = qctrl.flags;
+
     return VCAP_OK;
 }
 
-static int vcap_shutdown_stream(vcap_device* vd)
+//==============================================================================
+// Enumeration Functions
+//==============================================================================
+
+static void vcap_flags_to_status(uint32_t flags, vcap_control_status* status)
+{
+    assert(status != NULL);
+
+    status->read_only  = (bool)(flags & V4L2_CTRL_FLAG_READ_ONLY);
+    status->write_only = (bool)(flags & V4L2_CTRL_FLAG_WRITE_ONLY);
+    status->disabled   = (bool)(flags & V4L2_CTRL_FLAG_DISABLED);
+    status->inactive   = (bool)(flags & V4L2_CTRL_FLAG_INACTIVE) ||
+                         (bool)(flags & V4L2_CTRL_FLAG_GRABBED);
+}
+
+//
+// Control events carry the new flags and range of the control, so the cached
+// metadata is updated here rather than re-queried
+//
+static void vcap_convert_ctrl_event(vcap_device* vd, const struct v4l2_event* ev, vcap_event* event)
 {
     assert(vd != NULL);
+    assert(ev != NULL);
+    assert(event != NULL);
 
-    if (vd->buffer_count > 0)
-    {
-        if (vcap_unmap_buffers(vd) == VCAP_ERROR)
-            return VCAP_ERROR;
+    const struct v4l2_event_ctrl* ctrl = &ev->u.ctrl;
+    vcap_control_event* ctrl_event = &event->data.ctrl;
 
-        if (vcap_release_buffers(vd) == VCAP_ERROR)
-            return VCAP_ERROR;
+    ctrl_event->id            = vcap_convert_ctrl(ev->id);
+    ctrl_event->value         = ctrl->value;
+    ctrl_event->value_changed = (bool)(ctrl->changes & V4L2_EVENT_CTRL_CH_VALUE);
+    ctrl_event->flags_changed = (bool)(ctrl->changes & V4L2_EVENT_CTRL_CH_FLAGS);
+    ctrl_event->range_changed = (bool)(ctrl->changes & V4L2_EVENT_CTRL_CH_RANGE);
+    ctrl_event->min           = ctrl->minimum;
+    ctrl_event->max           = ctrl->maximum;
+    ctrl_event->step          = ctrl->step;
+    ctrl_event->default_value = ctrl->default_value;
+
+    vcap_flags_to_status(ctrl->flags, &ctrl_event->status);
+
+    vcap_control_cache* entry = vcap_find_control(vd, ctrl_event->id);
+
+    if (!entry)
+        return;
+
+    entry->flags = ctrl->flags;
+
+    if (ctrl_event->value_changed)
+    {
+        vcap_store_value(vd, entry, ctrl->value, false);
+        vcap_complete_async(vd, ctrl_event->id);
     }
+    else if (!vcap_value_cacheable(vd, entry))
+        entry->value_valid = false;
 
-    return VCAP_OK;
+    if (ctrl_event->range_changed)
+    {
+        entry->info.min           = ctrl->minimum;
+        entry->info.max           = ctrl->maximum;
+        entry->info.step          = ctrl->step;
+        entry->info.default_value = ctrl->default_value;
+    }
 }
 
-static int vcap_map_buffers(vcap_device* vd)
+static bool vcap_convert_event(vcap_device* vd, const struct v4l2_event* ev, vcap_event* event)
 {
     assert(vd != NULL);
+    assert(ev != NULL);
+    assert(event != NULL);
 
-    // Allocates the buffer objects
-    vd->buffers = (vcap_buffer*)vcap_malloc(vd->buffer_count * sizeof(vcap_buffer));
+    VCAP_CLEAR(*event);
 
-     for (uint32_t i = 0; i < vd->buffer_count; i++)
-     {
-        // Query buffers, returning their size and other information
-        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-querybuf.html
-        struct v4l2_buffer buf;
-        VCAP_CLEAR(buf);
+    event->sequence = ev->sequence;
 
-        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index  = i;
+    switch (ev->type)
+    {
+        case V4L2_EVENT_CTRL:
+            event->type = VCAP_EVENT_CTRL;
+            vcap_convert_ctrl_event(vd, ev, event);
+            return true;
 
-        if (vcap_ioctl(vd->fd, VIDIOC_QUERYBUF, &buf) == -1)
-        {
-            vcap_set_error_errno(vd, "Unable to query buffers on %s", vd->path);
-            return VCAP_ERROR;
-        }
+        case V4L2_EVENT_SOURCE_CHANGE:
+            // The driver may have changed the format
+            vd->fmt_valid = false;
 
-        // Map buffers
-        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/func-mmap.html
-        vd->buffers[i].size = buf.length;
-        vd->buffers[i].data = v4l2_mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, vd->fd, buf.m.offset);
+            event->type = VCAP_EVENT_SOURCE_CHANGE;
+            event->data.source.input = ev->id;
+            event->data.source.resolution_changed = (bool)(ev->u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION);
+            return true;
 
-        if (vd->buffers[i].data == MAP_FAILED)
-        {
-            vcap_set_error(vd, "MMAP failed on %s", vd->path);
-            return VCAP_ERROR;
-        }
+        case V4L2_EVENT_EOS:
+            event->type = VCAP_EVENT_EOS;
+            return true;
     }
 
-    return VCAP_OK;
+    return false;
 }
 
-static int vcap_unmap_buffers(vcap_device* vd)
+static void vcap_push_event(vcap_device* vd, const vcap_event* event)
 {
     assert(vd != NULL);
+    assert(event != NULL);
 
-    // Unmap and free buffers
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/func-munmap.html
-    for (uint32_t i = 0; i < vd->buffer_count; i++)
+    // Drop the oldest event if the queue is full (as V4L2 does)
+    if (vd->event_count == VCAP_EVENT_QUEUE_SIZE)
     {
-        if (v4l2_munmap(vd->buffers[i].data, vd->buffers[i].size) == -1)
-        {
-            vcap_set_error_errno(vd, "Unmapping buffers failed on %s", vd->path);
-            return VCAP_ERROR;
-        }
+        vd->event_head = (vd->event_head + 1) % VCAP_EVENT_QUEUE_SIZE;
+        vd->event_count--;
     }
 
-    vcap_free(vd->buffers);
+    vd->events[(vd->event_head + vd->event_count) % VCAP_EVENT_QUEUE_SIZE] = *event;
+    vd->event_count++;
 
-    return VCAP_OK;
+    vcap_update_notify(vd);
 }
 
-static int vcap_queue_buffers(vcap_device* vd)
+static bool vcap_pop_event(vcap_device* vd, vcap_event* event)
 {
     assert(vd != NULL);
+    assert(event != NULL);
 
-    for (uint32_t i = 0; i < vd->buffer_count; i++)
-    {
-        // Places a buffer in the queue
-        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-qbuf.html
-        struct v4l2_buffer buf;
-        VCAP_CLEAR(buf);
+    if (vd->event_count == 0)
+        return false;
 
-        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index  = i;
+    *event = vd->events[vd->event_head];
 
-        if (vcap_ioctl(vd->fd, VIDIOC_QBUF, &buf) == -1)
-        {
-            vcap_set_error_errno(vd, "Unable to queue buffers on device %s", vd->path);
-            return VCAP_ERROR;
-        }
-	}
+    vd->event_head = (vd->event_head + 1) % VCAP_EVENT_QUEUE_SIZE;
+    vd->event_count--;
 
-	return VCAP_OK;
+    vcap_update_notify(vd);
+
+    return true;
 }
 
-static int vcap_capture_mmap(vcap_device* vd, size_t size, uint8_t* data)
+static void vcap_update_notify(vcap_device* vd)
 {
     assert(vd != NULL);
-    assert(data != NULL);
-
-    if (!data)
-    {
-        vcap_set_error(vd, "Argument can't be null");
-        return VCAP_ERROR;
-    }
 
-    if (!vcap_is_streaming(vd))
-    {
-        vcap_set_error(vd, "Stream on %s must be active in order to grab frame", vd->path);
-        return VCAP_ERROR;
-    }
+    if (vd->notify_fd < 0)
+        return;
 
-    fd_set fds;
-    struct timeval tv;
+    uint64_t value = 1;
 
-    FD_ZERO(&fds);
-    FD_SET(vd->fd, &fds);
+    if (vd->event_count > 0 && !vd->notified)
+        vd->notified = (write(vd->notify_fd, &value, sizeof(value)) == sizeof(value));
+    else if (vd->event_count == 0 && vd->notified)
+        vd->notified = !(read(vd->notify_fd, &value, sizeof(value)) == sizeof(value));
+}
 
-    tv.tv_sec  = 1;
-    tv.tv_usec = 0;
+static int vcap_drain_events(vcap_device* vd)
+{
+    assert(vd != NULL);
 
-    struct v4l2_buffer buf;
-    VCAP_CLEAR(buf);
+    int result = VCAP_OK;
 
     while (true)
     {
-        int result = select(vd->fd + 1, &fds, NULL, NULL, &tv);
+        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-dqevent.html
+        struct v4l2_event ev;
+        VCAP_CLEAR(ev);
 
-        if (result == -1)
+        if (vcap_ioctl(vd->fd, VIDIOC_DQEVENT, &ev) == -1)
         {
-            if (EINTR == errno)
-            {
-                continue;
-            }
-            else
-            {
-                vcap_set_error_errno(vd, "Unable to read frame");
-                return VCAP_ERROR;
-            }
-        }
+            if (errno == ENOENT)
+                return result;
 
-        if (result == 0)
-        {
-            vcap_set_error(vd, "Timeout reached");
+            vcap_set_error_errno(vd, "Unable to dequeue event on device %s", vd->path);
             return VCAP_ERROR;
         }
 
-	    // Dequeue buffer
-	    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-qbuf.htm
-
-        VCAP_CLEAR(buf);
-
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-
-        if (vcap_ioctl(vd->fd, VIDIOC_DQBUF, &buf) == -1)
-        {
-            if (errno == EAGAIN)
-            {
-                continue;
-            }
-            else
-            {
-                vcap_set_error_errno(vd, "Could not dequeue buffer on %s", vd->path);
-                return VCAP_ERROR;
-            }
-        }
+        vcap_event event;
 
-        break;
-    }
+        if (!vcap_convert_event(vd, &ev, &event))
+            continue;
 
-    // Copy buffer data
-    memcpy(data, vd->buffers[buf.index].data, size);
+        vcap_push_event(vd, &event);
 
-    // Requeue buffer
-	// https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-qbuf.html
-    if (vcap_ioctl(vd->fd, VIDIOC_QBUF, &buf) == -1)
-    {
-        vcap_set_error_errno(vd, "Could not requeue buffer on %s", vd->path);
-        return VCAP_ERROR;
+        if (event.type == VCAP_EVENT_SOURCE_CHANGE)
+            result = VCAP_SOURCE_CHANGED;
+        else if (event.type == VCAP_EVENT_EOS && result == VCAP_OK)
+            result = VCAP_END_OF_STREAM;
     }
-
-    return VCAP_OK;
 }
 
-static int vcap_capture_read(vcap_device* vd, size_t size, uint8_t* data)
+static int vcap_wait_frame(vcap_device* vd)
 {
     assert(vd != NULL);
-    assert(data != NULL);
-
-    if (!data)
-    {
-        vcap_set_error(vd, "Argument can't be null");
-        return VCAP_ERROR;
-    }
 
-    fd_set fds;
     struct timeval tv;
 
-    FD_ZERO(&fds);
-    FD_SET(vd->fd, &fds);
-
     tv.tv_sec  = 1;
     tv.tv_usec = 0;
 
     while (true)
     {
-        int result = select(vd->fd + 1, &fds, NULL, NULL, &tv);
+        fd_set fds, except_fds;
+
+        FD_ZERO(&fds);
+        FD_SET(vd->fd, &fds);
+
+        // Pending events are signaled as exceptions
+        FD_ZERO(&except_fds);
+
+        if (vd->source_events)
+            FD_SET(vd->fd, &except_fds);
+
+        int result = select(vd->fd + 1, &fds, NULL, &except_fds, &tv);
 
         if (result == -1)
         {
@@ -2237,81 +6970,37 @@ static int vcap_capture_read(vcap_device* vd, size_t size, uint8_t* data)
             return VCAP_ERROR;
         }
 
-        if (v4l2_read(vd->fd, data, size) == -1)
+        if (FD_ISSET(vd->fd, &except_fds))
         {
-            if (errno == EAGAIN)
+            result = vcap_drain_events(vd);
+
+            if (result == VCAP_SOURCE_CHANGED)
             {
-                continue;
+                if (vd->auto_renegotiate && vcap_renegotiate(vd) == VCAP_ERROR)
+                    return VCAP_ERROR;
+
+                vcap_set_error(vd, "Source changed on device %s", vd->path);
+                return VCAP_SOURCE_CHANGED;
             }
-            else
+
+            if (result == VCAP_END_OF_STREAM)
             {
-                vcap_set_error_errno(vd, "Reading from device %s failed", vd->path);
-                return VCAP_ERROR;
+                vcap_set_error(vd, "End of stream on device %s", vd->path);
+                return VCAP_END_OF_STREAM;
             }
-        }
-
-        return VCAP_OK; // Break out of loop
-    }
-
-    return VCAP_ERROR;
-}
-
-static void vcap_ustrcpy(uint8_t* dst, const uint8_t* src, size_t size)
-{
-    assert(dst != NULL);
-    assert(src != NULL);
-
-    snprintf((char*)dst, size, "%s", (char*)src);
-}
-
-static void vcap_strcpy(char* dst, const char* src, size_t size)
-{
-    assert(dst != NULL);
-    assert(src != NULL);
-
-    snprintf(dst, size, "%s", src);
-}
-
-void vcap_set_error_str(const char* func, int line, vcap_device* vd, const char* fmt, ...)
-{
-    assert(vd != NULL);
-    assert(fmt != NULL);
-
-    char error_msg1[512];
-    char error_msg2[512];
-
-    snprintf(error_msg1, sizeof(error_msg1), "[%s:%d]", func, line);
-
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(error_msg2, sizeof(error_msg2), fmt, args);
-    va_end(args);
-
-    snprintf(vd->error_msg, sizeof(vd->error_msg), "%s %s", error_msg1, error_msg2);
-}
-
-void vcap_set_error_errno_str(const char* func, int line, vcap_device* vd, const char* fmt, ...)
-{
-    assert(vd != NULL);
-    assert(fmt != NULL);
-
-    char error_msg1[512];
-    char error_msg2[512];
 
-    snprintf(error_msg1, sizeof(error_msg1), "[%s:%d]", func, line);
+            if (result == VCAP_ERROR)
+                return VCAP_ERROR;
 
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(error_msg2, sizeof(error_msg2), fmt, args);
-    va_end(args);
+            // Only other events are pending, keep waiting for a frame
+            if (!FD_ISSET(vd->fd, &fds))
+                continue;
+        }
 
-    snprintf(vd->error_msg, sizeof(vd->error_msg), "%s %s (%s)", error_msg1, error_msg2, strerror(errno));
+        return VCAP_OK;
+    }
 }
 
-//==============================================================================
-// Enumeration Functions
-//==============================================================================
-
 static bool vcap_ctrl_type_supported(uint32_t type)
 {
     switch (type)
@@ -2332,35 +7021,13 @@ static int vcap_enum_fmts(vcap_device* vd, vcap_format_info* info, uint32_t inde
     assert(vd != NULL);
     assert(info != NULL);
 
-    // Enumerate formats
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-enum-fmt.html
-    struct v4l2_fmtdesc fmtd;
-    VCAP_CLEAR(fmtd);
-
-    fmtd.type  = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmtd.index = index;
-
-    if (vcap_ioctl(vd->fd, VIDIOC_ENUM_FMT, &fmtd) == -1)
-    {
-        if (errno == EINVAL)
-        {
-            return VCAP_INVALID;
-        }
-        else
-        {
-            vcap_set_error_errno(vd, "Unable to enumerate formats on device %s", vd->path);
-            return VCAP_ERROR;
-        }
-    }
-
-    // Copy description
-    vcap_ustrcpy(info->name, fmtd.description, sizeof(info->name));
+    if (vcap_cache_formats(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
 
-    // Convert FOURCC code
-    vcap_fourcc_str(fmtd.pixelformat, info->fourcc);
+    if (index >= vd->fmt_count)
+        return VCAP_INVALID;
 
-    // Copy pixel format
-    info->id = vcap_convert_fmt(fmtd.pixelformat);
+    *info = vd->fmts[index].info;
 
     return VCAP_OK;
 }
@@ -2379,33 +7046,15 @@ static int vcap_enum_sizes(vcap_device* vd, vcap_format_id fmt, vcap_size* size,
         return VCAP_ERROR;
     }
 
-    // Enumerate frame sizes
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-enum-framesizes.html
-    struct v4l2_frmsizeenum fenum;
-    VCAP_CLEAR(fenum);
-
-    fenum.pixel_format = vcap_map_fmt(fmt);
-    fenum.index = index;
+    if (vcap_cache_formats(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
 
-    if (vcap_ioctl(vd->fd, VIDIOC_ENUM_FRAMESIZES, &fenum) == -1)
-    {
-        if (errno == EINVAL)
-        {
-            return VCAP_INVALID;
-        }
-        else
-        {
-            vcap_set_error_errno(vd, "Unable to enumerate sizes on device '%s'", vd->path);
-            return VCAP_ERROR;
-        }
-    }
+    vcap_format_cache* entry = vcap_find_format(vd, fmt);
 
-    // Only discrete sizes are supported
-    if (fenum.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+    if (!entry || index >= entry->size_count)
         return VCAP_INVALID;
 
-    size->width  = fenum.discrete.width;
-    size->height = fenum.discrete.height;
+    *size = entry->sizes[index].size;
 
     return VCAP_OK;
 }
@@ -2424,37 +7073,20 @@ static int vcap_enum_rates(vcap_device* vd, vcap_format_id fmt, vcap_size size,
         return VCAP_ERROR;
     }
 
-    // Enumerate frame rates
-    // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-enum-frameintervals.html
-    struct v4l2_frmivalenum frenum;
-    VCAP_CLEAR(frenum);
+    if (vcap_cache_formats(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
 
-    frenum.pixel_format = vcap_map_fmt(fmt);
-    frenum.index  = index;
-    frenum.width  = size.width;
-    frenum.height = size.height;
+    vcap_format_cache* fmt_entry = vcap_find_format(vd, fmt);
 
-    if (vcap_ioctl(vd->fd, VIDIOC_ENUM_FRAMEINTERVALS, &frenum) == -1)
-    {
-        if (errno == EINVAL)
-        {
-            return VCAP_INVALID;
-        }
-        else
-        {
-            vcap_set_error_errno(vd, "Unable to enumerate frame rates on device %s", vd->path);
-            return VCAP_ERROR;
-        }
-    }
+    if (!fmt_entry)
+        return VCAP_INVALID;
+
+    vcap_size_cache* size_entry = vcap_find_size(fmt_entry, size);
 
-    // Only discrete frame rates are supported
-    if (frenum.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+    if (!size_entry || index >= size_entry->rate_count)
         return VCAP_INVALID;
 
-    // NOTE: We swap the numerator and denominator because Vcap uses frame rates
-    // instead of intervals.
-    rate->numerator   = frenum.discrete.denominator;
-    rate->denominator = frenum.discrete.numerator;
+    *rate = size_entry->rates[index];
 
     return VCAP_OK;
 }
@@ -2464,26 +7096,15 @@ static int vcap_enum_ctrls(vcap_device* vd, vcap_control_info* info, uint32_t in
     assert(vd != NULL);
     assert(info != NULL);
 
-    uint32_t count = 0;
-
-    // Enuemrate user controls
-    for (vcap_control_id ctrl = 0; ctrl < VCAP_CTRL_COUNT; ctrl++)
-    {
-        int result = vcap_get_control_info(vd, ctrl, info);
-
-        if (result == VCAP_ERROR)
-            return VCAP_ERROR;
+    if (vcap_cache_controls(vd) == VCAP_ERROR)
+        return VCAP_ERROR;
 
-        if (result == VCAP_INVALID)
-            continue;
+    if (index >= vd->ctrl_count)
+        return VCAP_INVALID;
 
-        if (index == count)
-            return VCAP_OK;
-        else
-            count++;
-    }
+    *info = vd->ctrls[index].info;
 
-    return VCAP_INVALID;
+    return VCAP_OK;
 }
 
 static int vcap_enum_menu(vcap_device* vd, vcap_control_id ctrl, vcap_menu_item* item, uint32_t index)
@@ -2492,83 +7113,41 @@ static int vcap_enum_menu(vcap_device* vd, vcap_control_id ctrl, vcap_menu_item*
     assert(item != NULL);
 
     // Ensure control ID is within the proper range
-    assert(ctrl < VCAP_CTRL_COUNT);
+    assert(vcap_ctrl_valid(ctrl));
 
-    if (ctrl >= VCAP_CTRL_COUNT)
+    if (!vcap_ctrl_valid(ctrl))
     {
         vcap_set_error(vd, "Invalid argument (out of range)");
         return VCAP_ERROR;
     }
 
     // Check if supported and a menu
-    vcap_control_info info;
-    VCAP_CLEAR(info);
-
-    int result = vcap_get_control_info(vd, ctrl, &info);
-
-    if (result == VCAP_ERROR)
+    if (vcap_cache_controls(vd) == VCAP_ERROR)
         return VCAP_ERROR;
 
-    if (result == VCAP_INVALID)
+    vcap_control_cache* entry = vcap_find_control(vd, ctrl);
+
+    if (!entry)
     {
         vcap_set_error(vd, "Can't enumerate menu of an invalid control");
         return VCAP_ERROR;
     }
 
-    if (info.type != VCAP_CTRL_TYPE_MENU && info.type != VCAP_CTRL_TYPE_INTEGER_MENU)
+    if (entry->info.type != VCAP_CTRL_TYPE_MENU && entry->info.type != VCAP_CTRL_TYPE_INTEGER_MENU)
     {
         vcap_set_error(vd, "Control is not a menu");
         return VCAP_ERROR;
     }
 
-    if (index < (uint32_t)info.min || index > (uint32_t)info.max)
-        return VCAP_INVALID;
-
-    // Loop through all entries in the menu until count == index
-
-    uint32_t count = 0;
-
-    for (int32_t i = info.min; i <= info.max; i += info.step)
-    {
-        // Query menu
-        // https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/vidioc-queryctrl.html
-        struct v4l2_querymenu qmenu;
-        VCAP_CLEAR(qmenu);
-
-        qmenu.id    = vcap_map_ctrl(ctrl);
-        qmenu.index = i;
-
-        if (vcap_ioctl(vd->fd, VIDIOC_QUERYMENU, &qmenu) == -1)
-        {
-            if (errno == EINVAL)
-            {
-                continue;
-            }
-            else
-            {
-                vcap_set_error_errno(vd, "Unable to enumerate menu on device %s", vd->path);
-                return VCAP_ERROR;
-            }
-        }
-
-        if (index == count)
-        {
-            item->index = i;
+    if (vcap_cache_menu(vd, entry) == VCAP_ERROR)
+        return VCAP_ERROR;
 
-            if (info.type == VCAP_CTRL_TYPE_MENU)
-                vcap_ustrcpy(item->label.str, qmenu.name, sizeof(item->label.str));
-            else
-                item->label.num = qmenu.value;
+    if (index >= entry->menu_count)
+        return VCAP_INVALID;
 
-            return VCAP_OK;
-        }
-        else
-        {
-            count++;
-        }
-    }
+    *item = entry->menu[index];
 
-    return VCAP_INVALID;
+    return VCAP_OK;
 }
 
 static uint32_t ctrl_map[] = {
@@ -2636,6 +7215,7 @@ static uint32_t ctrl_type_map[] = {
     V4L2_CTRL_TYPE_INTEGER,
     V4L2_CTRL_TYPE_BOOLEAN,
     V4L2_CTRL_TYPE_MENU,
+    V4L2_CTRL_TYPE_INTEGER_MENU,
     V4L2_CTRL_TYPE_BUTTON
 };
 
@@ -2648,6 +7228,14 @@ static const char* ctrl_type_str_map[] = {
     "Unknown"
 };
 
+static bool vcap_ctrl_valid(vcap_control_id id)
+{
+    return id < VCAP_CTRL_COUNT || id >= VCAP_CTRL_V4L2_BASE;
+}
+
+//
+// Controls unknown to Vcap keep their V4L2 control ID
+//
 static vcap_control_id vcap_convert_ctrl(uint32_t id)
 {
     for (size_t i = 0; i < VCAP_CTRL_COUNT; i++)
@@ -2656,11 +7244,14 @@ static vcap_control_id vcap_convert_ctrl(uint32_t id)
             return (vcap_control_id)i;
     }
 
-    return VCAP_CTRL_UNKNOWN;
+    return id;
 }
 
 static uint32_t vcap_map_ctrl(vcap_control_id id)
 {
+    if (id >= VCAP_CTRL_V4L2_BASE)
+        return id;
+
     return ctrl_map[id];
 }
 
@@ -2680,49 +7271,129 @@ static const char* vcap_ctrl_type_str(vcap_control_type id)
     return ctrl_type_str_map[id];
 }
 
-static uint32_t fmt_map[] = {
+//
+// Pixel format table, indexed by format ID
+//
+//   FourCC                          bpp  planes  h/v subsampling  bits  cpu
+//
+static const vcap_format_entry fmt_table[] = {
     /* RGB formats */
-    V4L2_PIX_FMT_BGR24,
-    V4L2_PIX_FMT_RGB24,
+    { V4L2_PIX_FMT_BGR24,              24, 1, 1, 1, 24.0,  0.5 },
+    { V4L2_PIX_FMT_RGB24,              24, 1, 1, 1, 24.0,  0.5 },
     /* 8-Greyscale */
-    V4L2_PIX_FMT_GREY,
+    { V4L2_PIX_FMT_GREY,                8, 1, 1, 1,  8.0,  0.5 },
     /* Luminance+Chrominance formats */
-    V4L2_PIX_FMT_YUYV,
-    V4L2_PIX_FMT_YVYU,
-    V4L2_PIX_FMT_UYVY,
-    V4L2_PIX_FMT_HM12,
+    { V4L2_PIX_FMT_YUYV,               16, 1, 2, 1, 16.0,  2.0 },
+    { V4L2_PIX_FMT_YVYU,               16, 1, 2, 1, 16.0,  2.0 },
+    { V4L2_PIX_FMT_UYVY,               16, 1, 2, 1, 16.0,  2.0 },
+    { V4L2_PIX_FMT_HM12,               12, 2, 2, 2, 12.0,  3.0 },
     /* three planes - Y Cb,  Cr */
-    V4L2_PIX_FMT_YUV420,
-    V4L2_PIX_FMT_YVU420,
+    { V4L2_PIX_FMT_YUV420,             12, 3, 2, 2, 12.0,  2.0 },
+    { V4L2_PIX_FMT_YVU420,             12, 3, 2, 2, 12.0,  2.0 },
     /* Bayer formats - see http://www.siliconimaging.com/RGB%20Bayer.htm */
-    V4L2_PIX_FMT_SBGGR8,
-    V4L2_PIX_FMT_SGBRG8,
-    V4L2_PIX_FMT_SGRBG8,
-    V4L2_PIX_FMT_SRGGB8,
+    { V4L2_PIX_FMT_SBGGR8,              8, 1, 1, 1,  8.0,  3.0 },
+    { V4L2_PIX_FMT_SGBRG8,              8, 1, 1, 1,  8.0,  3.0 },
+    { V4L2_PIX_FMT_SGRBG8,              8, 1, 1, 1,  8.0,  3.0 },
+    { V4L2_PIX_FMT_SRGGB8,              8, 1, 1, 1,  8.0,  3.0 },
     /* compressed formats */
-    V4L2_PIX_FMT_MJPEG,
-    V4L2_PIX_FMT_JPEG,
+    { V4L2_PIX_FMT_MJPEG,               0, 1, 1, 1,  3.0, 12.0 },
+    { V4L2_PIX_FMT_JPEG,                0, 1, 1, 1,  3.0, 12.0 },
     /*  Vendor-specific formats */
-    V4L2_PIX_FMT_SN9C10X,
-    V4L2_PIX_FMT_SN9C20X_I420,
-    V4L2_PIX_FMT_SPCA501,
-    V4L2_PIX_FMT_SPCA505,
-    V4L2_PIX_FMT_SPCA508,
-    V4L2_PIX_FMT_SPCA561,
-    V4L2_PIX_FMT_PAC207,
-    V4L2_PIX_FMT_OV511,
-    V4L2_PIX_FMT_OV518,
-    V4L2_PIX_FMT_MR97310A,
-    V4L2_PIX_FMT_SQ905C,
-    V4L2_PIX_FMT_PJPG,
+    { V4L2_PIX_FMT_SN9C10X,             0, 1, 1, 1,  4.0, 16.0 },
+    { V4L2_PIX_FMT_SN9C20X_I420,       12, 3, 2, 2, 12.0,  4.0 },
+    { V4L2_PIX_FMT_SPCA501,            12, 1, 2, 2, 12.0,  3.0 },
+    { V4L2_PIX_FMT_SPCA505,            12, 1, 2, 2, 12.0,  3.0 },
+    { V4L2_PIX_FMT_SPCA508,            12, 1, 2, 2, 12.0,  3.0 },
+    { V4L2_PIX_FMT_SPCA561,             0, 1, 1, 1,  4.0, 16.0 },
+    { V4L2_PIX_FMT_PAC207,              0, 1, 1, 1,  4.0, 16.0 },
+    { V4L2_PIX_FMT_OV511,               0, 1, 1, 1,  3.0, 16.0 },
+    { V4L2_PIX_FMT_OV518,               0, 1, 1, 1,  3.0, 16.0 },
+    { V4L2_PIX_FMT_MR97310A,            0, 1, 1, 1,  4.0, 16.0 },
+    { V4L2_PIX_FMT_SQ905C,              0, 1, 1, 1,  4.0, 16.0 },
+    { V4L2_PIX_FMT_PJPG,                0, 1, 1, 1,  3.0, 16.0 },
+    /* RGB formats (cont.) */
+    { V4L2_PIX_FMT_RGB332,              8, 1, 1, 1,  8.0,  1.0 },
+    { V4L2_PIX_FMT_RGB444,             16, 1, 1, 1, 16.0,  1.0 },
+    { V4L2_PIX_FMT_RGB555,             16, 1, 1, 1, 16.0,  1.0 },
+    { V4L2_PIX_FMT_RGB565,             16, 1, 1, 1, 16.0,  1.0 },
+    { V4L2_PIX_FMT_RGB565X,            16, 1, 1, 1, 16.0,  1.0 },
+    { V4L2_PIX_FMT_BGR32,              32, 1, 1, 1, 32.0,  0.5 },
+    { V4L2_PIX_FMT_RGB32,              32, 1, 1, 1, 32.0,  0.5 },
+    { V4L2_PIX_FMT_XBGR32,             32, 1, 1, 1, 32.0,  0.5 },
+    { V4L2_PIX_FMT_XRGB32,             32, 1, 1, 1, 32.0,  0.5 },
+    { V4L2_PIX_FMT_ABGR32,             32, 1, 1, 1, 32.0,  0.5 },
+    { V4L2_PIX_FMT_ARGB32,             32, 1, 1, 1, 32.0,  0.5 },
+    { V4L2_PIX_FMT_BGRA32,             32, 1, 1, 1, 32.0,  0.5 },
+    { V4L2_PIX_FMT_RGBA32,             32, 1, 1, 1, 32.0,  0.5 },
+    /* Greyscale formats (cont.) */
+    { V4L2_PIX_FMT_Y10,                16, 1, 1, 1, 16.0,  1.0 },
+    { V4L2_PIX_FMT_Y12,                16, 1, 1, 1, 16.0,  1.0 },
+    { V4L2_PIX_FMT_Y16,                16, 1, 1, 1, 16.0,  1.0 },
+    { V4L2_PIX_FMT_Y10BPACK,           10, 1, 1, 1, 10.0,  1.5 },
+    { V4L2_PIX_FMT_Y10P,               10, 1, 1, 1, 10.0,  1.5 },
+    /* Luminance+Chrominance formats (cont.) */
+    { V4L2_PIX_FMT_VYUY,               16, 1, 2, 1, 16.0,  2.0 },
+    { V4L2_PIX_FMT_Y41P,               12, 1, 4, 1, 12.0,  2.0 },
+    { V4L2_PIX_FMT_YUV410,              9, 3, 4, 4,  9.0,  2.0 },
+    { V4L2_PIX_FMT_YUV411P,            12, 3, 4, 1, 12.0,  2.0 },
+    { V4L2_PIX_FMT_YUV422P,            16, 3, 2, 1, 16.0,  2.0 },
+    /* two planes - Y, CbCr interleaved */
+    { V4L2_PIX_FMT_NV12,               12, 2, 2, 2, 12.0,  2.0 },
+    { V4L2_PIX_FMT_NV21,               12, 2, 2, 2, 12.0,  2.0 },
+    { V4L2_PIX_FMT_NV16,               16, 2, 2, 1, 16.0,  2.0 },
+    { V4L2_PIX_FMT_NV61,               16, 2, 2, 1, 16.0,  2.0 },
+    { V4L2_PIX_FMT_NV24,               24, 2, 1, 1, 24.0,  2.0 },
+    { V4L2_PIX_FMT_NV42,               24, 2, 1, 1, 24.0,  2.0 },
+    /* Bayer formats (cont.) */
+    { V4L2_PIX_FMT_SBGGR10,            16, 1, 1, 1, 16.0,  3.5 },
+    { V4L2_PIX_FMT_SGBRG10,            16, 1, 1, 1, 16.0,  3.5 },
+    { V4L2_PIX_FMT_SGRBG10,            16, 1, 1, 1, 16.0,  3.5 },
+    { V4L2_PIX_FMT_SRGGB10,            16, 1, 1, 1, 16.0,  3.5 },
+    { V4L2_PIX_FMT_SBGGR10P,           10, 1, 1, 1, 10.0,  4.0 },
+    { V4L2_PIX_FMT_SGBRG10P,           10, 1, 1, 1, 10.0,  4.0 },
+    { V4L2_PIX_FMT_SGRBG10P,           10, 1, 1, 1, 10.0,  4.0 },
+    { V4L2_PIX_FMT_SRGGB10P,           10, 1, 1, 1, 10.0,  4.0 },
+    { V4L2_PIX_FMT_SBGGR12,            16, 1, 1, 1, 16.0,  3.5 },
+    { V4L2_PIX_FMT_SGBRG12,            16, 1, 1, 1, 16.0,  3.5 },
+    { V4L2_PIX_FMT_SGRBG12,            16, 1, 1, 1, 16.0,  3.5 },
+    { V4L2_PIX_FMT_SRGGB12,            16, 1, 1, 1, 16.0,  3.5 },
+    { V4L2_PIX_FMT_SBGGR12P,           12, 1, 1, 1, 12.0,  4.0 },
+    { V4L2_PIX_FMT_SGBRG12P,           12, 1, 1, 1, 12.0,  4.0 },
+    { V4L2_PIX_FMT_SGRBG12P,           12, 1, 1, 1, 12.0,  4.0 },
+    { V4L2_PIX_FMT_SRGGB12P,           12, 1, 1, 1, 12.0,  4.0 },
+    { V4L2_PIX_FMT_SBGGR16,            16, 1, 1, 1, 16.0,  3.5 },
+    { V4L2_PIX_FMT_SGBRG16,            16, 1, 1, 1, 16.0,  3.5 },
+    { V4L2_PIX_FMT_SGRBG16,            16, 1, 1, 1, 16.0,  3.5 },
+    { V4L2_PIX_FMT_SRGGB16,            16, 1, 1, 1, 16.0,  3.5 },
+    /* compressed formats (cont.) */
+    { V4L2_PIX_FMT_H264,                0, 1, 1, 1,  0.2, 20.0 },
+    { V4L2_PIX_FMT_HEVC,                0, 1, 1, 1,  0.2, 20.0 },
+    { V4L2_PIX_FMT_MPEG,                0, 1, 1, 1,  0.5, 20.0 },
+    { V4L2_PIX_FMT_VP8,                 0, 1, 1, 1,  0.2, 20.0 },
+    { V4L2_PIX_FMT_VP9,                 0, 1, 1, 1,  0.2, 20.0 },
+    /* Depth formats */
+    { V4L2_PIX_FMT_Z16,                16, 1, 1, 1, 16.0,  1.0 },
 };
 
+// FourCC lookup table (open addressing, holds format IDs)
+static struct
+{
+    uint32_t fourcc;
+    vcap_format_id id;
+} fmt_hash[VCAP_FMT_HASH_SIZE];
+
+// Guards lazy construction of the FourCC lookup table
+static pthread_once_t fmt_hash_once = PTHREAD_ONCE_INIT;
+
 static vcap_format_id vcap_convert_fmt(uint32_t id)
 {
-    for (size_t i = 0; i < VCAP_FMT_COUNT; i++)
+    pthread_once(&fmt_hash_once, vcap_init_fmt_hash);
+
+    // Unused slots have a FourCC of zero
+    for (uint32_t i = vcap_hash_fourcc(id); fmt_hash[i].fourcc != 0; i = (i + 1) & (VCAP_FMT_HASH_SIZE - 1))
     {
-        if (fmt_map[i] == id)
-            return (vcap_format_id)i;
+        if (fmt_hash[i].fourcc == id)
+            return fmt_hash[i].id;
     }
 
     return VCAP_FMT_UNKNOWN;
@@ -2730,5 +7401,47 @@ static vcap_format_id vcap_convert_fmt(uint32_t id)
 
 static uint32_t vcap_map_fmt(vcap_format_id id)
 {
-    return fmt_map[id];
+    return fmt_table[id].fourcc;
+}
+
+static uint32_t sel_target_map[] = {
+    V4L2_SEL_TGT_CROP,
+    V4L2_SEL_TGT_CROP_DEFAULT,
+    V4L2_SEL_TGT_CROP_BOUNDS,
+    V4L2_SEL_TGT_COMPOSE,
+    V4L2_SEL_TGT_COMPOSE_DEFAULT,
+    V4L2_SEL_TGT_COMPOSE_BOUNDS,
+};
+
+static uint32_t vcap_map_sel_target(vcap_selection_target target)
+{
+    return sel_target_map[target];
+}
+
+static const vcap_format_entry* vcap_get_format_entry(vcap_format_id id)
+{
+    return &fmt_table[id];
+}
+
+static void vcap_init_fmt_hash(void)
+{
+    assert(sizeof(fmt_table) / sizeof(fmt_table[0]) == VCAP_FMT_COUNT);
+    assert(VCAP_FMT_COUNT * 2 <= VCAP_FMT_HASH_SIZE);
+
+    for (uint32_t id = 0; id < VCAP_FMT_COUNT; id++)
+    {
+        uint32_t i = vcap_hash_fourcc(fmt_table[id].fourcc);
+
+        while (fmt_hash[i].fourcc != 0)
+            i = (i + 1) & (VCAP_FMT_HASH_SIZE - 1);
+
+        fmt_hash[i].fourcc = fmt_table[id].fourcc;
+        fmt_hash[i].id = id;
+    }
+}
+
+static uint32_t vcap_hash_fourcc(uint32_t fourcc)
+{
+    // Fibonacci hashing, keeping the top 8 bits
+    return (fourcc * 2654435761u) >> 24;
 }
@@ -70,9 +70,11 @@ extern "C" {
 ///
 enum
 {
-    VCAP_OK      =  0,        ///< Function executed without error
-    VCAP_ERROR   = -1,        ///< Error while executing function
-    VCAP_INVALID = -2         ///< An argument is invalid
+    VCAP_OK             =  0, ///< Function executed without error
+    VCAP_ERROR          = -1, ///< Error while executing function
+    VCAP_INVALID        = -2, ///< An argument is invalid
+    VCAP_SOURCE_CHANGED = -3, ///< The capture source changed (see `vcap_subscribe_source_events`)
+    VCAP_END_OF_STREAM  = -4  ///< The capture source has no more frames
 };
 
 ///
@@ -85,6 +87,11 @@ typedef struct vcap_device vcap_device;
 ///
 typedef struct vcap_iterator vcap_iterator;
 
+///
+/// \brief Precompiled settings handle
+///
+typedef struct vcap_preset vcap_preset;
+
 ///
 /// \brief Format ID type
 ///
@@ -95,11 +102,25 @@ typedef uint32_t vcap_format_id;
 ///
 typedef uint32_t vcap_control_id;
 
+///
+/// \brief Controls unknown to Vcap (e.g. driver-private controls)
+///
+/// Controls that don't have a Vcap control ID are identified by their V4L2
+/// control ID instead. V4L2 control IDs are never less than this value, so
+/// they can't be confused with Vcap control IDs.
+///
+#define VCAP_CTRL_V4L2_BASE 0x00980000
+
 ///
 /// \brief Control type ID
 ///
 typedef uint8_t vcap_control_type;
 
+///
+/// \brief Selection target ID
+///
+typedef uint32_t vcap_selection_target;
+
 ///
 /// \brief Video capture device infomation
 ///
@@ -133,6 +154,90 @@ typedef struct
     uint32_t denominator;       ///< Interval denominator
 } vcap_rate;
 
+///
+/// \brief Range of frame sizes (stepwise or continuous)
+///
+typedef struct
+{
+    vcap_size min;              ///< Smallest frame size
+    vcap_size max;              ///< Largest frame size
+    vcap_size step;             ///< Size increment (1x1 for continuous ranges)
+} vcap_size_range;
+
+///
+/// \brief Range of frame rates (stepwise or continuous)
+///
+/// NOTE: Devices step frame intervals, not rates, so `step` is an interval in
+/// seconds (numerator / denominator). It is zero for continuous ranges.
+///
+typedef struct
+{
+    vcap_rate min;              ///< Slowest frame rate
+    vcap_rate max;              ///< Fastest frame rate
+    vcap_rate step;             ///< Frame interval increment
+} vcap_rate_range;
+
+///
+/// \brief Pixel format layout
+///
+typedef struct
+{
+    uint32_t fourcc;            ///< V4L2 FourCC code
+    uint8_t bpp;                ///< Bits per pixel over all planes (0 if compressed)
+    uint8_t planes;             ///< Number of planes in the buffer
+    uint8_t h_subsampling;      ///< Horizontal chroma subsampling (1 if none)
+    uint8_t v_subsampling;      ///< Vertical chroma subsampling (1 if none)
+    bool compressed;            ///< True if the format is compressed
+} vcap_pixel_format;
+
+///
+/// \brief Maximum number of planes in a frame
+///
+#define VCAP_MAX_PLANES 3
+
+///
+/// \brief Layout of one plane of a frame
+///
+typedef struct
+{
+    size_t offset;              ///< Offset of the plane in the frame buffer
+    uint32_t stride;            ///< Bytes per line
+    size_t size;                ///< Size of the plane in bytes
+} vcap_plane_layout;
+
+///
+/// \brief Memory layout of captured frames
+///
+/// Colorimetry fields hold V4L2 values (e.g. V4L2_COLORSPACE_SRGB).
+///
+typedef struct
+{
+    vcap_format_id format;      ///< Format ID
+    uint32_t fourcc;            ///< V4L2 FourCC code
+    uint32_t width;             ///< Frame width
+    uint32_t height;            ///< Frame height
+    uint32_t stride;            ///< Bytes per line of the first plane
+    size_t image_size;          ///< Size of the frame buffer
+    uint32_t plane_count;       ///< Number of planes
+    vcap_plane_layout planes[VCAP_MAX_PLANES]; ///< Plane layouts
+    uint32_t field;             ///< Field order (V4L2_FIELD_*)
+    uint32_t colorspace;        ///< Colorspace (V4L2_COLORSPACE_*)
+    uint32_t ycbcr_enc;         ///< Y'CbCr encoding (V4L2_YCBCR_ENC_*)
+    uint32_t quantization;      ///< Quantization range (V4L2_QUANTIZATION_*)
+    uint32_t xfer_func;         ///< Transfer function (V4L2_XFER_FUNC_*)
+} vcap_frame_layout;
+
+///
+/// \brief Metadata of a captured frame
+///
+typedef struct
+{
+    uint32_t sequence;          ///< Frame sequence number
+    uint32_t field;             ///< Field order of the frame (V4L2_FIELD_*)
+    uint64_t timestamp;         ///< Capture time in microseconds (usually CLOCK_MONOTONIC)
+    uint32_t bytes_used;        ///< Bytes of image data in the frame
+} vcap_frame_info;
+
 ///
 /// \brief Pixel format description
 ///
@@ -185,6 +290,68 @@ typedef struct
 
 } vcap_menu_item;
 
+///
+/// \brief Control ID/value pair (used by the batched control functions)
+///
+typedef struct
+{
+    vcap_control_id id;         ///< Control ID
+    int32_t value;              ///< Control value
+} vcap_control_value;
+
+///
+/// \brief Control change event
+///
+typedef struct
+{
+    vcap_control_id id;         ///< Control ID
+    int32_t value;              ///< The current value of the control
+    bool value_changed;         ///< True if the value of the control changed
+    bool flags_changed;         ///< True if the status of the control changed
+    bool range_changed;         ///< True if the min/max/step/default changed
+    vcap_control_status status; ///< The current status of the control
+    int32_t min;                ///< The minimum value of the control
+    int32_t max;                ///< The maximum value of the control
+    int32_t step;               ///< The spacing between consecutive values
+    int32_t default_value;      ///< The default value of the control
+} vcap_control_event;
+
+///
+/// \brief Source change event
+///
+typedef struct
+{
+    uint32_t input;             ///< Index of the input that changed
+    bool resolution_changed;    ///< True if the resolution of the source changed
+} vcap_source_event;
+
+///
+/// \brief Completion of an asynchronous control write
+///
+typedef struct
+{
+    vcap_control_id id;         ///< Control ID
+    int32_t value;              ///< Value that was set
+    int result;                 ///< VCAP_OK if the operation completed, VCAP_ERROR otherwise
+} vcap_control_complete_event;
+
+///
+/// \brief Device event
+///
+typedef struct
+{
+    uint32_t type;              ///< Event type
+    uint32_t sequence;          ///< Event sequence number
+
+    union
+    {
+        vcap_control_event ctrl;   ///< Control event (used if type is VCAP_EVENT_CTRL)
+        vcap_source_event source;  ///< Source event (used if type is VCAP_EVENT_SOURCE_CHANGE)
+        vcap_control_complete_event complete; ///< Completion event (used if type is VCAP_EVENT_CTRL_COMPLETE)
+    } data;
+
+} vcap_event;
+
 ///
 /// \brief Defines a rectangle (used by cropping functionality)
 ///
@@ -196,6 +363,65 @@ typedef struct
     int32_t height;             ///< Height of rectangle
 } vcap_rect;
 
+///
+/// \brief Format negotiation request
+///
+typedef struct
+{
+    vcap_format_id format;      ///< Desired output format
+    vcap_size size;             ///< Minimum frame size (0x0 for any)
+    vcap_rate rate;             ///< Minimum frame rate (0/0 for any)
+} vcap_format_request;
+
+///
+/// \brief Result of format negotiation
+///
+typedef struct
+{
+    vcap_format_id format;          ///< Format to pass to vcap_set_format
+    vcap_format_id native_format;   ///< Format delivered by the device
+    vcap_size size;                 ///< Frame size
+    vcap_rate rate;                 ///< Frame rate
+    double cost;                    ///< Estimated cost (bytes per second equivalent)
+    char reason[256];               ///< Explanation of the choice
+} vcap_format_choice;
+
+///
+/// \brief Snapshot identifier ("VCSS", stored in native byte order)
+///
+#define VCAP_SNAPSHOT_MAGIC 0x53534356
+
+///
+/// \brief Snapshot layout version
+///
+#define VCAP_SNAPSHOT_VERSION 1
+
+///
+/// \brief Maximum number of controls stored in a snapshot
+///
+/// Leaves room for driver-private controls. Only the stored controls are
+/// serialized, so the limit doesn't affect the size of saved snapshots.
+///
+#define VCAP_SNAPSHOT_MAX_CONTROLS 512
+
+///
+/// \brief Binary snapshot of camera settings
+///
+/// A fixed-size alternative to the JSON settings extension, intended for fast
+/// save and restore. The snapshot can be written to and read from storage
+/// as-is, only the first `vcap_snapshot_size` bytes are significant.
+///
+typedef struct
+{
+    uint32_t magic;                 ///< Always VCAP_SNAPSHOT_MAGIC
+    uint32_t version;               ///< Always VCAP_SNAPSHOT_VERSION
+    vcap_format_id format_id;       ///< Format ID
+    vcap_size size;                 ///< Frame size
+    vcap_rate rate;                 ///< Frame rate
+    uint32_t control_count;         ///< Number of controls that follow
+    vcap_control_value controls[VCAP_SNAPSHOT_MAX_CONTROLS]; ///< Control values
+} vcap_snapshot;
+
 ///
 /// \brief Custom malloc function type
 ///
@@ -361,7 +587,8 @@ int vcap_get_device_info(vcap_device* vd, vcap_device_info* info);
 ///
 /// Return the size of the frame buffer for the current video device and
 /// configuration (format/frame size). This size is used with the function
-/// `vcap_capture`
+/// `vcap_capture`. The size is served from the cached format (see
+/// `vcap_get_frame_layout`).
 ///
 /// \param  vd  Pointer to the video device
 ///
@@ -369,6 +596,21 @@ int vcap_get_device_info(vcap_device* vd, vcap_device_info* info);
 ///
 size_t vcap_get_image_size(vcap_device* vd);
 
+//------------------------------------------------------------------------------
+///
+/// \brief  Gets the memory layout of captured frames
+///
+/// The format negotiated by `vcap_set_format` or read by `vcap_get_format` is
+/// cached, so no ioctl is made unless the format is unknown (e.g. after a
+/// source change event or cropping).
+///
+/// \param  vd      Pointer to the video device
+/// \param  layout  Pointer to the frame layout (output)
+///
+/// \returns VCAP_ERROR on error and VCAP_OK otherwise
+///
+int vcap_get_frame_layout(vcap_device* vd, vcap_frame_layout* layout);
+
 //------------------------------------------------------------------------------
 ///
 /// \brief  Captures a video frame (image)
@@ -379,10 +621,34 @@ size_t vcap_get_image_size(vcap_device* vd);
 /// \param  image_size  Size of the image in bytes
 /// \param  image_data  Previously allocated buffer to read into (equal to
 ///
-/// \returns VCAP_ERROR on error and VCAP_OK otherwise
+/// \returns VCAP_OK              if a frame was captured,
+///          VCAP_ERROR           on error,
+///          VCAP_SOURCE_CHANGED  if the source changed (only if subscribed to
+///                               source events), and
+///          VCAP_END_OF_STREAM   if the source has no more frames (only if
+///                               subscribed to source events)
 ///
 int vcap_capture(vcap_device* vd, size_t image_size, uint8_t* image_data);
 
+//------------------------------------------------------------------------------
+///
+/// \brief  Retrieves the metadata of the last captured frame
+///
+/// Frames captured from streaming devices report the sequence number, field
+/// and timestamp set by the driver. Frames read from devices using read/write
+/// I/O are numbered by Vcap, timestamped when read and report the field order
+/// of the current format. Interlaced frames can be passed to a deinterlacer
+/// along with their field order.
+///
+/// \param  vd    Pointer to the video device
+/// \param  info  Pointer to the frame metadata (output)
+///
+/// \returns VCAP_OK       if the metadata was retrieved,
+///          VCAP_ERROR    on error, and
+///          VCAP_INVALID  if no frame was captured since the stream started
+///
+int vcap_get_frame_info(vcap_device* vd, vcap_frame_info* info);
+
 //------------------------------------------------------------------------------
 ///
 /// \brief Tests if an error occurred while creating or advancing an iterator
@@ -399,6 +665,77 @@ bool vcap_iterator_error(vcap_iterator* iterator);
 ///
 void vcap_free_iterator(vcap_iterator* iterator);
 
+//------------------------------------------------------------------------------
+///
+/// \brief Discards cached device capabilities
+///
+/// The first time formats, frame sizes, frame rates or controls are queried,
+/// Vcap enumerates them all at once and caches the result. Iterators and
+/// lookups are then served from memory. Call this function if the capabilities of the
+/// device may have changed (e.g. after switching inputs) so that they are
+/// enumerated again on next use. The cached frame layout is discarded as well.
+/// The cache is also discarded when the device is closed.
+///
+/// \param  vd  Pointer to the video device
+///
+void vcap_invalidate_cache(vcap_device* vd);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Saves cached device capabilities to a file
+///
+/// Enumerates all formats, frame sizes, frame rates, controls and menus, and
+/// writes them to a file that can be loaded with `vcap_load_cache`, avoiding
+/// hundreds of ioctls the next time the device is opened. The file is keyed by
+/// the driver, card, bus info and driver version of the device. It is only
+/// valid for the same build of Vcap on the same machine.
+///
+/// \param  vd    Pointer to the video device
+/// \param  path  Path of the cache file
+///
+/// \returns VCAP_ERROR on error and VCAP_OK otherwise
+///
+int vcap_save_cache(vcap_device* vd, const char* path);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Loads cached device capabilities from a file
+///
+/// Replaces the capability cache with the contents of a file written by
+/// `vcap_save_cache`. The file is checked against the capabilities read when
+/// the device was opened, so no additional ioctls are needed. Cached values
+/// are never loaded, and control statuses are read again on first use.
+///
+/// \param  vd    Pointer to the video device
+/// \param  path  Path of the cache file
+///
+/// \returns VCAP_OK       if the cache was loaded,
+///          VCAP_ERROR    if there was an error, and
+///          VCAP_INVALID  if the file doesn't exist, doesn't match the device
+///                        or is corrupt (the device is then probed as usual)
+///
+int vcap_load_cache(vcap_device* vd, const char* path);
+
+//------------------------------------------------------------------------------
+///
+/// \brief Enables or disables the control value cache
+///
+/// Reading or writing a control is a blocking call into the driver, which can
+/// take milliseconds on USB cameras. When the value cache is enabled, Vcap
+/// remembers the last value read or written for each control. Repeated reads
+/// are served from memory and writes of the current value are skipped.
+///
+/// Volatile and write-only controls are never cached. Setting a control that
+/// affects other controls discards all cached values. Values changed outside
+/// of this device handle (e.g. by another process) are only noticed after
+/// subscribing to control events and dequeuing them. The cache is disabled by
+/// default.
+///
+/// \param  vd      Pointer to the video device
+/// \param  enable  True to enable the value cache
+///
+void vcap_set_value_cache(vcap_device* vd, bool enable);
+
 //------------------------------------------------------------------------------
 ///
 /// \brief  Retrieves format information
@@ -415,6 +752,33 @@ void vcap_free_iterator(vcap_iterator* iterator);
 ///
 int vcap_get_format_info(vcap_device* vd, vcap_format_id fmt, vcap_format_info* info);
 
+//------------------------------------------------------------------------------
+///
+/// \brief  Gets the layout of a pixel format
+///
+/// Describes the memory layout of a format ID. Unlike `vcap_get_format_info`,
+/// this doesn't depend on a device.
+///
+/// \param  fmt     The format ID
+/// \param  layout  Pointer to the pixel format layout (output)
+///
+/// \returns VCAP_OK      if the layout was retrieved successfully, and
+///          VCAP_INVALID if the format ID is invalid
+///
+int vcap_get_pixel_format(vcap_format_id fmt, vcap_pixel_format* layout);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Converts a V4L2 FourCC code to a format ID
+///
+/// The lookup takes constant time.
+///
+/// \param  fourcc  The V4L2 FourCC code (e.g. V4L2_PIX_FMT_NV12)
+///
+/// \returns The format ID, or VCAP_FMT_UNKNOWN if the code isn't recognized
+///
+vcap_format_id vcap_fourcc_to_format(uint32_t fourcc);
+
 //------------------------------------------------------------------------------
 ///
 /// \brief  Creates a new format iterator
@@ -497,6 +861,41 @@ vcap_iterator* vcap_rate_iterator(vcap_device* vd, vcap_format_id fmt, vcap_size
 ///
 bool vcap_next_rate(vcap_iterator* itr, vcap_rate* rate);
 
+//------------------------------------------------------------------------------
+///
+/// \brief  Gets the stepwise or continuous frame size range of a format
+///
+/// Size iterators only list discrete frame sizes. Devices that support a range
+/// of sizes instead (common for sensors that scale or bin) report it here.
+///
+/// \param  vd     Pointer to the video device
+/// \param  fmt    The format ID
+/// \param  range  Pointer to the size range (output)
+///
+/// \returns VCAP_OK       if the range was retrieved,
+///          VCAP_ERROR    if there was an error, and
+///          VCAP_INVALID  if the format has no size range
+///
+int vcap_get_size_range(vcap_device* vd, vcap_format_id fmt, vcap_size_range* range);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Gets the stepwise or continuous frame rate range of a frame size
+///
+/// Rate iterators only list discrete frame rates. The frame size may be a
+/// discrete size or any size within the format's size range.
+///
+/// \param  vd     Pointer to the video device
+/// \param  fmt    The format ID
+/// \param  size   The frame size
+/// \param  range  Pointer to the rate range (output)
+///
+/// \returns VCAP_OK       if the range was retrieved,
+///          VCAP_ERROR    if there was an error, and
+///          VCAP_INVALID  if the frame size has no rate range
+///
+int vcap_get_rate_range(vcap_device* vd, vcap_format_id fmt, vcap_size size, vcap_rate_range* range);
+
 //------------------------------------------------------------------------------
 ///
 /// \brief  Gets the current format and frame size
@@ -554,6 +953,34 @@ int vcap_get_rate(vcap_device* vd, vcap_rate* rate);
 ///
 int vcap_set_rate(vcap_device* vd, vcap_rate rate);
 
+//------------------------------------------------------------------------------
+///
+/// \brief  Chooses the cheapest format, size and rate for a desired output
+///
+/// Considers every native format and frame size that is at least as large as
+/// requested, at the lowest frame rate that meets the requested minimum. For
+/// size and rate ranges, the smallest size and slowest rate in the range that
+/// meet the request are considered, even if they are not listed discretely. Each
+/// candidate is scored by its estimated bus bandwidth plus the CPU cost of
+/// converting to the requested format (e.g. decoding MJPEG versus unpacking
+/// YUYV). The cheapest candidate is confirmed with the driver without changing
+/// the device state. If the device was created with conversion enabled and
+/// libv4l2 emulates the requested format, `choice->format` is the requested
+/// format and `choice->native_format` is the cheapest native source that the
+/// driver itself accepts (libv4l2 accepts any emulated format, so the native
+/// source is tried on the device directly).
+/// Otherwise both are the native format and the caller converts.
+///
+/// \param  vd       Pointer to the video device
+/// \param  request  The desired output
+/// \param  choice   The chosen format, size and rate (output)
+///
+/// \returns VCAP_OK       if a format was chosen,
+///          VCAP_ERROR    if there was an error, and
+///          VCAP_INVALID  if no format satisfies the request
+///
+int vcap_negotiate(vcap_device* vd, const vcap_format_request* request, vcap_format_choice* choice);
+
 //------------------------------------------------------------------------------
 ///
 /// \brief  Retrieves control information
@@ -586,11 +1013,36 @@ int vcap_get_control_info(vcap_device* vd, vcap_control_id ctrl, vcap_control_in
 ///
 int vcap_get_control_status(vcap_device* vd, vcap_control_id ctrl, vcap_control_status* status);
 
+//------------------------------------------------------------------------------
+///
+/// \brief  Retrieves the status of several controls
+///
+/// Controls subscribed to control events (see `vcap_subscribe_control_events`)
+/// use the flags cached when the controls were enumerated, which the events
+/// keep current. They are re-read once, in a single pass, after a control that
+/// affects other controls is set. Other controls are queried individually, as
+/// their flags can change without notice (e.g. auto modes, other handles).
+///
+/// \param  vd        Pointer to the video device
+/// \param  ctrls     Array of control IDs
+/// \param  statuses  Array receiving the status of each control
+/// \param  count     Number of controls
+///
+/// \returns VCAP_OK       if the statuses were retrieved successfully,
+///          VCAP_ERROR    if getting the statuses failed, and
+///          VCAP_INVALID  if a control ID is invalid
+///
+int vcap_get_control_statuses(vcap_device* vd, const vcap_control_id* ctrls, vcap_control_status* statuses, uint32_t count);
+
 //------------------------------------------------------------------------------
 ///
 /// \brief  Creates a new control iterator
 ///
 /// Creates and initializes a new control iterator for the specified device.
+/// All controls exposed by the driver are enumerated, including those that
+/// Vcap doesn't define an ID for (see `VCAP_CTRL_V4L2_BASE`). Control
+/// information is cached the first time controls are queried (see
+/// `vcap_invalidate_cache`).
 ///
 /// \param  vd  Pointer to the video device
 ///
@@ -612,6 +1064,23 @@ vcap_iterator* vcap_control_iterator(vcap_device* vd);
 ///
 bool vcap_next_control(vcap_iterator* itr, vcap_control_info* info);
 
+//------------------------------------------------------------------------------
+///
+/// \brief  Retrieves control info by enumeration index
+///
+/// Enumerates the same controls, in the same order, as a control iterator, but
+/// doesn't allocate memory (once controls have been cached).
+///
+/// \param  vd     Pointer to the video device
+/// \param  index  Enumeration index of the control
+/// \param  info   Pointer to the control information (output)
+///
+/// \returns VCAP_OK       if the control info was retrieved,
+///          VCAP_ERROR    if enumerating the controls failed, and
+///          VCAP_INVALID  if the index is past the last control
+///
+int vcap_enum_control(vcap_device* vd, uint32_t index, vcap_control_info* info);
+
 //------------------------------------------------------------------------------
 ///
 /// \brief  Creates a new control menu iterator
@@ -672,6 +1141,71 @@ int vcap_get_control(vcap_device* vd, vcap_control_id ctrl, int32_t* value);
 ///
 int vcap_set_control(vcap_device* vd, vcap_control_id ctrl, int32_t value);
 
+//------------------------------------------------------------------------------
+///
+/// \brief  Gets the values of several controls at once
+///
+/// Retrieves the current values of all controls in 'ctrls' using a single
+/// request to the driver. The 'id' field of each element specifies the
+/// control and the 'value' field receives its value.
+///
+/// \param  vd           Pointer to the video device
+/// \param  ctrls        Array of control ID/value pairs (input/output)
+/// \param  count        Number of elements in 'ctrls'
+/// \param  error_index  Receives the index of the control that caused an error,
+///                      or 'count' if the error can't be attributed to a
+///                      single control (may be NULL)
+///
+/// \returns VCAP_OK       if the control values were retrieved
+///          VCAP_ERROR    if an error occured
+///          VCAP_INVALID  if a control ID is invalid
+///
+int vcap_get_controls(vcap_device* vd, vcap_control_value* ctrls, uint32_t count, uint32_t* error_index);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Sets the values of several controls atomically
+///
+/// Sets all controls in 'ctrls' using a single request to the driver. The
+/// values are validated before any of them are applied, so either all of the
+/// controls are set or none of them are (unless the hardware fails while
+/// applying them, in which case 'error_index' identifies the failing control).
+///
+/// \param  vd           Pointer to the video device
+/// \param  ctrls        Array of control ID/value pairs
+/// \param  count        Number of elements in 'ctrls'
+/// \param  error_index  Receives the index of the control that caused an error,
+///                      or 'count' if the error can't be attributed to a
+///                      single control (may be NULL)
+///
+/// \returns VCAP_OK       if the control values were set
+///          VCAP_ERROR    if an error occured
+///          VCAP_INVALID  if a control ID is invalid
+///
+int vcap_set_controls(vcap_device* vd, const vcap_control_value* ctrls, uint32_t count, uint32_t* error_index);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Validates the values of several controls without setting them
+///
+/// Checks whether the controls in 'ctrls' could be set with
+/// `vcap_set_controls`. The device state is not changed. Drivers may adjust
+/// out of range values instead of rejecting them, in which case the adjusted
+/// values are written back to 'ctrls'.
+///
+/// \param  vd           Pointer to the video device
+/// \param  ctrls        Array of control ID/value pairs (input/output)
+/// \param  count        Number of elements in 'ctrls'
+/// \param  error_index  Receives the index of the control that caused an error,
+///                      or 'count' if the error can't be attributed to a
+///                      single control (may be NULL)
+///
+/// \returns VCAP_OK       if the control values are valid
+///          VCAP_ERROR    if a value is invalid or an error occured
+///          VCAP_INVALID  if a control ID is invalid
+///
+int vcap_try_controls(vcap_device* vd, vcap_control_value* ctrls, uint32_t count, uint32_t* error_index);
+
 //------------------------------------------------------------------------------
 ///
 /// \brief  Resets a control's value
@@ -691,7 +1225,9 @@ int vcap_reset_control(vcap_device* vd, vcap_control_id ctrl);
 ///
 /// \brief  Resets all controls to defaults
 ///
-/// Resets all controls to their default values.
+/// Resets all controls to their default values. Read-only, disabled and
+/// inactive controls are skipped, as are buttons (which have no value). The
+/// defaults are written with a single batched request where possible.
 ///
 /// \param  vd  Pointer to the video device
 ///
@@ -699,6 +1235,308 @@ int vcap_reset_control(vcap_device* vd, vcap_control_id ctrl);
 ///
 int vcap_reset_all_controls(vcap_device* vd);
 
+//------------------------------------------------------------------------------
+///
+/// \brief  Starts the background control writer
+///
+/// Writing a control can take milliseconds on USB cameras, so high-frequency
+/// updates (e.g. pan/tilt/zoom driven by a joystick) quickly fall behind. The
+/// control writer applies values queued with `vcap_queue_control` from a
+/// background thread. Only the latest queued value of each control is kept,
+/// and all pending values are written in a single batch, so the camera
+/// follows the input at the rate it can sustain.
+///
+/// \param  vd  Pointer to the video device
+///
+/// \returns VCAP_ERROR on error and VCAP_OK otherwise
+///
+int vcap_start_control_writer(vcap_device* vd);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Queues a control value for the background control writer
+///
+/// Returns immediately. A previously queued value of the same control that
+/// hasn't been written yet is replaced. Errors while writing are reported by
+/// `vcap_flush_controls` and `vcap_stop_control_writer`.
+///
+/// \param  vd     Pointer to the video device
+/// \param  ctrl   The control ID
+/// \param  value  The control value
+///
+/// \returns VCAP_OK       if the value was queued
+///          VCAP_ERROR    if an error occured (e.g. the writer isn't started)
+///          VCAP_INVALID  if the control ID is invalid
+///
+int vcap_queue_control(vcap_device* vd, vcap_control_id ctrl, int32_t value);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Sets a control's value without blocking
+///
+/// Intended for slow mechanical controls such as focus, zoom, iris and
+/// pan/tilt. The value is written by the background control writer, which is
+/// started if necessary. When the operation completes, an event of type
+/// VCAP_EVENT_CTRL_COMPLETE is queued and the event fd (see
+/// `vcap_get_event_fd`) becomes readable.
+///
+/// Drivers that apply controls asynchronously (e.g. UVC) signal completion with
+/// a control event, so the control's events are subscribed to. Other writes
+/// complete when the driver returns. If the write fails, or doesn't complete
+/// within ten seconds of being queued, the event's result is VCAP_ERROR. The
+/// event fd becomes readable when the timeout expires. Only the latest value
+/// of a control is reported if a pending write is replaced.
+///
+/// \param  vd     Pointer to the video device
+/// \param  ctrl   The control ID
+/// \param  value  The control value
+///
+/// \returns VCAP_OK       if the value was queued
+///          VCAP_ERROR    if an error occured
+///          VCAP_INVALID  if the control ID is invalid
+///
+int vcap_set_control_async(vcap_device* vd, vcap_control_id ctrl, int32_t value);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Waits until all queued control values are written
+///
+/// \param  vd  Pointer to the video device
+///
+/// \returns VCAP_ERROR if writing a value failed since the last flush, and
+///          VCAP_OK otherwise
+///
+int vcap_flush_controls(vcap_device* vd);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Writes all queued control values and stops the control writer
+///
+/// The control writer is also stopped when the device is closed.
+///
+/// \param  vd  Pointer to the video device
+///
+/// \returns VCAP_ERROR if writing a value failed since the last flush, and
+///          VCAP_OK otherwise
+///
+int vcap_stop_control_writer(vcap_device* vd);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Returns a file descriptor that signals pending events
+///
+/// The returned file descriptor becomes readable (POLLIN) whenever an event is
+/// waiting to be dequeued with `vcap_dequeue_event`. It can be used with
+/// poll/select/epoll, or integrated into an event loop. The file descriptor is
+/// owned by the device and closed by `vcap_close`.
+///
+/// \param  vd  Pointer to the video device
+///
+/// \returns -1 on error and a pollable file descriptor otherwise
+///
+int vcap_get_event_fd(vcap_device* vd);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Subscribes to change events for a control
+///
+/// Once subscribed, an event of type VCAP_EVENT_CTRL is queued whenever the
+/// value, status or range of the control changes (e.g. when automatic exposure
+/// adjusts the exposure time). Changes made through this device handle don't
+/// generate events.
+///
+/// \param  vd    Pointer to the video device
+/// \param  ctrl  The control ID
+///
+/// \returns VCAP_OK       if the subscription succeeded
+///          VCAP_ERROR    if an error occured
+///          VCAP_INVALID  if the control ID is invalid
+///
+int vcap_subscribe_control_events(vcap_device* vd, vcap_control_id ctrl);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Subscribes to change events for every control of the device
+///
+/// \param  vd  Pointer to the video device
+///
+/// \returns VCAP_ERROR on error and VCAP_OK otherwise
+///
+int vcap_subscribe_all_control_events(vcap_device* vd);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Subscribes to source change and end-of-stream events
+///
+/// Capture sources such as HDMI grabbers can change resolution mid-stream.
+/// Once subscribed, `vcap_capture` stops waiting for a frame and returns
+/// VCAP_SOURCE_CHANGED when the source changes, or VCAP_END_OF_STREAM when it
+/// has no more frames. The corresponding events (VCAP_EVENT_SOURCE_CHANGE and
+/// VCAP_EVENT_EOS) are also queued and signaled through `vcap_get_event_fd`.
+///
+/// If 'auto_renegotiate' is true, `vcap_capture` calls `vcap_renegotiate`
+/// before returning VCAP_SOURCE_CHANGED, so capture can resume immediately
+/// after querying the new image size.
+///
+/// \param  vd                Pointer to the video device
+/// \param  auto_renegotiate  Renegotiate the format automatically
+///
+/// \returns VCAP_ERROR on error and VCAP_OK otherwise
+///
+int vcap_subscribe_source_events(vcap_device* vd, bool auto_renegotiate);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Adopts the format of a changed capture source
+///
+/// Locks onto the new timings of digital video sources, then applies the format
+/// proposed by the driver for the new source while keeping the pixel format.
+/// If the device is streaming, the stream is restarted and its buffers are
+/// reallocated. Cached frame sizes and rates are discarded.
+///
+/// \param  vd  Pointer to the video device
+///
+/// \returns VCAP_ERROR on error and VCAP_OK otherwise
+///
+int vcap_renegotiate(vcap_device* vd);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Cancels all event subscriptions
+///
+/// \param  vd  Pointer to the video device
+///
+/// \returns VCAP_ERROR on error and VCAP_OK otherwise
+///
+int vcap_unsubscribe_events(vcap_device* vd);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Dequeues a pending event
+///
+/// This function doesn't block. Cached control information is updated from
+/// control events, so `vcap_get_control_info` reflects range changes without
+/// querying the driver.
+///
+/// \param  vd     Pointer to the video device
+/// \param  event  Pointer to the event (output)
+///
+/// \returns VCAP_OK       if an event was dequeued
+///          VCAP_ERROR    if an error occured
+///          VCAP_INVALID  if no event is pending
+///
+int vcap_dequeue_event(vcap_device* vd, vcap_event* event);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Captures the current camera settings in a snapshot
+///
+/// Records the format, frame size, frame rate and the values of all writable
+/// controls (the same settings as `vcap_export_settings`). No memory is
+/// allocated once controls have been enumerated.
+///
+/// If the device has more writable controls than `VCAP_SNAPSHOT_MAX_CONTROLS`,
+/// `snapshot->control_count` is set to the number required and no values are
+/// read.
+///
+/// \param  vd        Pointer to the video device
+/// \param  snapshot  Pointer to the snapshot (output)
+///
+/// \returns VCAP_OK       if the snapshot was captured
+///          VCAP_ERROR    if an error occured
+///          VCAP_INVALID  if the controls don't fit in a snapshot
+///
+int vcap_capture_snapshot(vcap_device* vd, vcap_snapshot* snapshot);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Applies a snapshot to the camera
+///
+/// The format and frame rate are only set if they differ from the current
+/// ones. Control values are written in a single batch. No memory is allocated
+/// once controls have been enumerated (unless the format changes while
+/// streaming).
+///
+/// \param  vd        Pointer to the video device
+/// \param  snapshot  Pointer to the snapshot
+///
+/// \returns VCAP_OK       if the snapshot was applied
+///          VCAP_ERROR    if an error occured
+///          VCAP_INVALID  if the snapshot is malformed
+///
+int vcap_apply_snapshot(vcap_device* vd, const vcap_snapshot* snapshot);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Returns the number of significant bytes in a snapshot
+///
+/// \param  snapshot  Pointer to the snapshot
+///
+/// \returns The size of the header plus the stored controls
+///
+size_t vcap_snapshot_size(const vcap_snapshot* snapshot);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Loads a snapshot from a buffer
+///
+/// Validates the header and length of the serialized snapshot (e.g. read from
+/// a file) before copying it.
+///
+/// \param  snapshot  Pointer to the snapshot (output)
+/// \param  data      Serialized snapshot
+/// \param  size      Size of the serialized snapshot in bytes
+///
+/// \returns VCAP_OK if the snapshot was loaded and VCAP_INVALID if the data
+///          isn't a valid snapshot
+///
+int vcap_load_snapshot(vcap_snapshot* snapshot, const void* data, size_t size);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Creates a preset from a snapshot
+///
+/// Validates and resolves the snapshot once against the device, so it can be
+/// applied repeatedly with minimal overhead (e.g. to switch between day and
+/// night profiles). The format and frame size must be supported, control IDs
+/// must exist and be writable, and menu values must be valid menu items.
+/// Other control values are clamped to the control's range and rounded to its
+/// step. The preset must be recreated if the device is reopened or its cache
+/// is invalidated.
+///
+/// \param  vd        Pointer to the video device
+/// \param  snapshot  Pointer to the snapshot
+///
+/// \returns A pointer to the preset, or NULL if an error occured
+///
+vcap_preset* vcap_create_preset(vcap_device* vd, const vcap_snapshot* snapshot);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Releases a preset
+///
+/// \param  preset  Pointer to the preset (may be NULL)
+///
+void vcap_destroy_preset(vcap_preset* preset);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Applies a preset
+///
+/// The format and frame rate are only set if they differ from the current
+/// ones. All control values are written with a single pre-built batch.
+///
+/// \param  vd        Pointer to the video device the preset was created for
+/// \param  preset    Pointer to the preset
+/// \param  apply_ns  Time spent applying the preset in nanoseconds (output,
+///                   may be NULL)
+///
+/// \returns VCAP_OK       if the preset was applied
+///          VCAP_ERROR    if an error occured
+///          VCAP_INVALID  if the preset belongs to another device
+///
+int vcap_apply_preset(vcap_device* vd, vcap_preset* preset, uint64_t* apply_ns);
+
 //------------------------------------------------------------------------------
 ///
 /// \brief  Get cropping bounds
@@ -752,6 +1590,46 @@ int vcap_get_crop(vcap_device* vd, vcap_rect* rect);
 ///
 int vcap_set_crop(vcap_device* vd, vcap_rect rect);
 
+//------------------------------------------------------------------------------
+///
+/// \brief  Gets a selection rectangle
+///
+/// The crop targets select the area of the sensor or source that is captured.
+/// The compose targets select where in the frame buffer it is stored, so a
+/// compose rectangle smaller than the crop rectangle makes the device scale
+/// down. Bounds and default targets are read-only.
+///
+/// \param  vd      Pointer to the video device
+/// \param  target  The selection target (VCAP_SEL_*)
+/// \param  rect    Pointer to the rectangle (output)
+///
+/// \returns VCAP_OK       if the rectangle was retrieved,
+///          VCAP_ERROR    if there was an error, and
+///          VCAP_INVALID  if the device doesn't support the target
+///
+int vcap_get_selection(vcap_device* vd, vcap_selection_target target, vcap_rect* rect);
+
+//------------------------------------------------------------------------------
+///
+/// \brief  Sets a selection rectangle
+///
+/// Only VCAP_SEL_CROP and VCAP_SEL_COMPOSE can be set. The driver may adjust
+/// the rectangle, which is then updated to the rectangle actually applied.
+/// Constraint flags control the direction of adjustments. To have the device
+/// crop and downscale, set the format to the output size, then the crop
+/// rectangle, then a compose rectangle covering the output size.
+///
+/// \param  vd      Pointer to the video device
+/// \param  target  The selection target (VCAP_SEL_CROP or VCAP_SEL_COMPOSE)
+/// \param  rect    Pointer to the rectangle (input and output)
+/// \param  flags   Constraint flags (VCAP_SEL_FLAG_*)
+///
+/// \returns VCAP_OK       if the rectangle was set,
+///          VCAP_ERROR    if there was an error, and
+///          VCAP_INVALID  if the device doesn't support the target
+///
+int vcap_set_selection(vcap_device* vd, vcap_selection_target target, vcap_rect* rect, uint32_t flags);
+
 ///
 /// \brief Pixel format IDs
 ///
@@ -797,10 +1675,114 @@ enum
     VCAP_FMT_MR97310A,     ///< compressed BGGR bayer
     VCAP_FMT_SQ905C,       ///< compressed RGGB bayer
     VCAP_FMT_PJPG,         ///< Pixart 73xx JPEG
+
+    /* RGB formats (cont.) */
+    VCAP_FMT_RGB332,       ///<  8  RGB-3-3-2
+    VCAP_FMT_RGB444,       ///< 16  xxxxrrrr ggggbbbb
+    VCAP_FMT_RGB555,       ///< 16  RGB-5-5-5
+    VCAP_FMT_RGB565,       ///< 16  RGB-5-6-5
+    VCAP_FMT_RGB565X,      ///< 16  RGB-5-6-5 BE
+    VCAP_FMT_BGR32,        ///< 32  BGR-8-8-8-8
+    VCAP_FMT_RGB32,        ///< 32  RGB-8-8-8-8
+    VCAP_FMT_XBGR32,       ///< 32  BGRX-8-8-8-8
+    VCAP_FMT_XRGB32,       ///< 32  XRGB-8-8-8-8
+    VCAP_FMT_ABGR32,       ///< 32  BGRA-8-8-8-8
+    VCAP_FMT_ARGB32,       ///< 32  ARGB-8-8-8-8
+    VCAP_FMT_BGRA32,       ///< 32  ABGR-8-8-8-8
+    VCAP_FMT_RGBA32,       ///< 32  RGBA-8-8-8-8
+
+    /* Greyscale formats (cont.) */
+    VCAP_FMT_Y10,          ///< 16  Greyscale 10-bit
+    VCAP_FMT_Y12,          ///< 16  Greyscale 12-bit
+    VCAP_FMT_Y16,          ///< 16  Greyscale 16-bit
+    VCAP_FMT_Y10BPACK,     ///< 10  Greyscale 10-bit, packed big endian
+    VCAP_FMT_Y10P,         ///< 10  Greyscale 10-bit, MIPI packed
+
+    /* Luminance+Chrominance formats (cont.) */
+    VCAP_FMT_VYUY,         ///< 16  YUV 4:2:2
+    VCAP_FMT_Y41P,         ///< 12  YUV 4:1:1
+    VCAP_FMT_YUV410,       ///<  9  YUV 4:1:0, three planes
+    VCAP_FMT_YUV411P,      ///< 12  YUV 4:1:1, three planes
+    VCAP_FMT_YUV422P,      ///< 16  YUV 4:2:2, three planes
+
+    /* two planes - Y, CbCr interleaved */
+    VCAP_FMT_NV12,         ///< 12  Y/CbCr 4:2:0
+    VCAP_FMT_NV21,         ///< 12  Y/CrCb 4:2:0
+    VCAP_FMT_NV16,         ///< 16  Y/CbCr 4:2:2
+    VCAP_FMT_NV61,         ///< 16  Y/CrCb 4:2:2
+    VCAP_FMT_NV24,         ///< 24  Y/CbCr 4:4:4
+    VCAP_FMT_NV42,         ///< 24  Y/CrCb 4:4:4
+
+    /* Bayer formats (cont.) */
+    VCAP_FMT_SBGGR10,      ///< 16  BGBG.. GRGR.., 10-bit
+    VCAP_FMT_SGBRG10,      ///< 16  GBGB.. RGRG.., 10-bit
+    VCAP_FMT_SGRBG10,      ///< 16  GRGR.. BGBG.., 10-bit
+    VCAP_FMT_SRGGB10,      ///< 16  RGRG.. GBGB.., 10-bit
+    VCAP_FMT_SBGGR10P,     ///< 10  BGBG.. GRGR.., 10-bit packed
+    VCAP_FMT_SGBRG10P,     ///< 10  GBGB.. RGRG.., 10-bit packed
+    VCAP_FMT_SGRBG10P,     ///< 10  GRGR.. BGBG.., 10-bit packed
+    VCAP_FMT_SRGGB10P,     ///< 10  RGRG.. GBGB.., 10-bit packed
+    VCAP_FMT_SBGGR12,      ///< 16  BGBG.. GRGR.., 12-bit
+    VCAP_FMT_SGBRG12,      ///< 16  GBGB.. RGRG.., 12-bit
+    VCAP_FMT_SGRBG12,      ///< 16  GRGR.. BGBG.., 12-bit
+    VCAP_FMT_SRGGB12,      ///< 16  RGRG.. GBGB.., 12-bit
+    VCAP_FMT_SBGGR12P,     ///< 12  BGBG.. GRGR.., 12-bit packed
+    VCAP_FMT_SGBRG12P,     ///< 12  GBGB.. RGRG.., 12-bit packed
+    VCAP_FMT_SGRBG12P,     ///< 12  GRGR.. BGBG.., 12-bit packed
+    VCAP_FMT_SRGGB12P,     ///< 12  RGRG.. GBGB.., 12-bit packed
+    VCAP_FMT_SBGGR16,      ///< 16  BGBG.. GRGR.., 16-bit
+    VCAP_FMT_SGBRG16,      ///< 16  GBGB.. RGRG.., 16-bit
+    VCAP_FMT_SGRBG16,      ///< 16  GRGR.. BGBG.., 16-bit
+    VCAP_FMT_SRGGB16,      ///< 16  RGRG.. GBGB.., 16-bit
+
+    /* compressed formats (cont.) */
+    VCAP_FMT_H264,         ///< H.264 with start codes
+    VCAP_FMT_HEVC,         ///< HEVC
+    VCAP_FMT_MPEG,         ///< MPEG-1/2/4 multiplexed
+    VCAP_FMT_VP8,          ///< VP8
+    VCAP_FMT_VP9,          ///< VP9
+
+    /* Depth formats */
+    VCAP_FMT_Z16,          ///< 16  Depth data, 16-bit
+
     VCAP_FMT_COUNT,        ///< Number of formats
     VCAP_FMT_UNKNOWN       ///< Unrecognized format
 };
 
+///
+/// \brief Event types
+///
+enum
+{
+    VCAP_EVENT_CTRL,            ///< The value, status or range of a control changed
+    VCAP_EVENT_SOURCE_CHANGE,   ///< The capture source changed (e.g. its resolution)
+    VCAP_EVENT_EOS,             ///< The capture source has no more frames
+    VCAP_EVENT_CTRL_COMPLETE    ///< An asynchronous control write completed
+};
+
+///
+/// \brief Selection targets
+///
+enum
+{
+    VCAP_SEL_CROP,              ///< Crop rectangle
+    VCAP_SEL_CROP_DEFAULT,      ///< Default crop rectangle (read-only)
+    VCAP_SEL_CROP_BOUNDS,       ///< Limits of the crop rectangle (read-only)
+    VCAP_SEL_COMPOSE,           ///< Compose rectangle in the frame buffer
+    VCAP_SEL_COMPOSE_DEFAULT,   ///< Default compose rectangle (read-only)
+    VCAP_SEL_COMPOSE_BOUNDS,    ///< Limits of the compose rectangle (read-only)
+    VCAP_SEL_COUNT              ///< Number of selection targets
+};
+
+///
+/// \brief Selection constraint flags
+///
+enum
+{
+    VCAP_SEL_FLAG_GE = 1 << 0,  ///< The rectangle may only grow
+    VCAP_SEL_FLAG_LE = 1 << 1   ///< The rectangle may only shrink
+};
+
 ///
 /// \brief Camera control types
 ///